@@ -10,6 +10,7 @@
 //
 //=====================================================================
 #include "ikcp.h"
+#include "ikcp_sdt.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -33,6 +34,9 @@ const IUINT32 IKCP_CMD_PUSH = 81;		// cmd: push data
 const IUINT32 IKCP_CMD_ACK  = 82;		// cmd: ack
 const IUINT32 IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
 const IUINT32 IKCP_CMD_WINS = 84;		// cmd: window size (tell)
+const IUINT32 IKCP_CMD_SKIP = 85;		// cmd: expired push, skip the message
+const IUINT32 IKCP_CMD_UPUSH = 86;		// cmd: push data of an unordered message
+const IUINT32 IKCP_CMD_UPUSH_FIRST = 87;	// cmd: push the first fragment of an unordered message
 const IUINT32 IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
 const IUINT32 IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
 const IUINT32 IKCP_WND_SND = 32;
@@ -140,6 +144,14 @@ static inline long _itimediff(IUINT32 later, IUINT32 earlier)
 	return ((IINT32)(later - earlier));
 }
 
+// 编译时定义 IKCP_COUNT_COPIES 则统计拷贝的数据字节数, 供benchmark用
+#ifdef IKCP_COUNT_COPIES
+IUINT64 ikcp_copied_bytes = 0;
+#define IKCP_COUNT_COPY(len) (ikcp_copied_bytes += (len))
+#else
+#define IKCP_COUNT_COPY(len)
+#endif
+
 //---------------------------------------------------------------------
 // manage segment
 //---------------------------------------------------------------------
@@ -202,6 +214,29 @@ static int ikcp_canlog(const ikcpcb *kcp, int mask)
 	return 1;
 }
 
+// check trace mask
+static int ikcp_cantrace(const ikcpcb *kcp, int mask)
+{
+	return kcp->tracebuf != NULL && (mask & kcp->tracemask) != 0;
+}
+
+// write a binary trace record
+static void ikcp_trace(ikcpcb *kcp, int event, IUINT32 sn, IUINT32 una, 
+	IUINT32 arg, IUINT32 wnd)
+{
+	IKCPTRACEBUF *buf = kcp->tracebuf;
+	IKCPTRACEREC *rec = &buf->recs[buf->count++ & (buf->size - 1)];
+	rec->ts = kcp->current;
+	rec->conv = kcp->conv;
+	rec->sn = sn;
+	rec->una = una;
+	rec->arg = arg;
+	rec->rto = (IUINT32)kcp->rx_rto;
+	rec->cwnd = kcp->cwnd;
+	rec->wnd = (IUINT16)wnd;
+	rec->event = (IUINT16)event;
+}
+
 // output segment
 static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 {
@@ -210,6 +245,9 @@ static int ikcp_output(ikcpcb *kcp, const void *data, int size)
 	if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
 		ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
 	}
+	if (ikcp_cantrace(kcp, IKCP_LOG_OUTPUT)) {
+		ikcp_trace(kcp, IKCP_LOG_OUTPUT, 0, 0, (IUINT32)size, 0);
+	}
 	if (size == 0) return 0;
 	return kcp->output((const char*)data, size, kcp, kcp->user);
 }
@@ -230,6 +268,19 @@ void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 }
 
 
+//---------------------------------------------------------------------
+// 自适应flush间隔 : 有收发活动时恢复到 interval,
+// 并保证下次flush不会晚于 current + interval, 以免空闲时拉长的间隔增加延迟
+//---------------------------------------------------------------------
+static void ikcp_interval_wake(ikcpcb *kcp)
+{
+	if (kcp->interval_max == 0) return;
+	kcp->interval_cur = kcp->interval;
+	if (kcp->updated && _itimediff(kcp->ts_flush, kcp->current + kcp->interval) > 0)
+		kcp->ts_flush = kcp->current + kcp->interval;
+}
+
+
 //---------------------------------------------------------------------
 // create a new kcpcb
 // 首先需要创建一个kcp用于管理接下来的工作过程，
@@ -254,6 +305,9 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->timeout_resnd_cnt = 0;
 	kcp->loss_rate = 0;
 	kcp->rdc_loss_rate_limit = IKCP_RDC_LOSS_RATE_LIMIT;
+	kcp->stat_resnd_timeout = 0;
+	kcp->stat_resnd_fast = 0;
+	kcp->stat_rcv_dup = 0;
 
 	kcp->conv = conv;
 	kcp->user = user;
@@ -296,6 +350,16 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->rx_minrto = IKCP_RTO_MIN;
 	kcp->current = 0;
 	kcp->interval = IKCP_INTERVAL;
+	kcp->interval_min = 0;
+	kcp->interval_max = 0;
+	kcp->interval_cur = IKCP_INTERVAL;
+	kcp->ack_every = 0;
+	kcp->ack_delay = 0;
+	kcp->ts_ack = 0;
+	kcp->ack_immediate = 0;
+	kcp->deadline_used = 0;
+	kcp->snd_partial = 0;
+	kcp->nrcv_skip = 0;
 	kcp->ts_flush = IKCP_INTERVAL;
 	kcp->nodelay = 0;
 	kcp->updated = 0;
@@ -306,6 +370,10 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
   kcp->dead_link = IKCP_DEADLINK;
 	kcp->output = NULL;
 	kcp->writelog = NULL;
+	kcp->stagetime = NULL;
+	kcp->ts_stage = 0;
+	kcp->tracebuf = NULL;
+	kcp->tracemask = 0;
 
 	return kcp;
 }
@@ -368,6 +436,62 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+//---------------------------------------------------------------------
+// set stage time callback
+//---------------------------------------------------------------------
+void ikcp_setstagetime(ikcpcb *kcp, void (*stagetime)(int stage, IUINT32 ms,
+	ikcpcb *kcp, void *user))
+{
+	kcp->stagetime = stagetime;
+}
+
+//---------------------------------------------------------------------
+// set binary trace buffer
+//---------------------------------------------------------------------
+void ikcp_settrace(ikcpcb *kcp, IKCPTRACEBUF *buf, int mask)
+{
+	assert(buf == NULL || (buf->size > 0 && (buf->size & (buf->size - 1)) == 0));
+	kcp->tracebuf = buf;
+	kcp->tracemask = mask;
+}
+
+// segment离开stage对应的队列时, 报告它从 stage_ts 起待了多久
+static void ikcp_stage_end(ikcpcb *kcp, int stage, const IKCPSEG *seg)
+{
+	if (kcp->stagetime) {
+		IINT32 ms = _itimediff(kcp->ts_stage, seg->stage_ts);
+		kcp->stagetime(stage, ms > 0 ? (IUINT32)ms : 0, kcp, kcp->user);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// 丢弃rcv_queue中含有 IKCP_CMD_SKIP 的完整消息, 消息的剩余分片未到齐时先留着
+//---------------------------------------------------------------------
+static void ikcp_purge_skipped(ikcpcb *kcp)
+{
+	struct IQUEUEHEAD *p = kcp->rcv_queue.next, *start;
+	while (p != &kcp->rcv_queue) {
+		int skip = 0;
+		for (start = p; p != &kcp->rcv_queue; p = p->next) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			if (seg->cmd == IKCP_CMD_SKIP) skip = 1;
+			if (seg->frg == 0) break;
+		}
+		if (p == &kcp->rcv_queue) break;
+		p = p->next;
+		while (skip && start != p) {
+			IKCPSEG *seg = iqueue_entry(start, IKCPSEG, node);
+			start = start->next;
+			if (seg->cmd == IKCP_CMD_SKIP) kcp->nrcv_skip--;
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+			kcp->nrcv_que--;
+		}
+	}
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 // kcp_recv函数，用户获取接收到数据（去除kcp头的用户数据）。
@@ -430,6 +554,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 
 		if (buffer) {
 			memcpy(buffer, seg->data, seg->len);
+			IKCP_COUNT_COPY(seg->len);
 			buffer += seg->len;
 		}
 
@@ -439,6 +564,12 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
 			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
 		}
+		if (ikcp_cantrace(kcp, IKCP_LOG_RECV)) {
+			ikcp_trace(kcp, IKCP_LOG_RECV, seg->sn, seg->una, seg->len, seg->wnd);
+		}
+		if (fragment == 0 && ispeek == 0) {
+			IKCP_PROBE4(kcp, recv, kcp->conv, seg->sn, len, kcp->nrcv_que);
+		}
 
 		if (ispeek == 0) {
 			iqueue_del(&seg->node);
@@ -460,6 +591,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
 			iqueue_del(&seg->node);
 			kcp->nrcv_buf--;
+			if (seg->cmd != IKCP_CMD_SKIP) ikcp_stage_end(kcp, IKCP_STAGE_RCV_BUF, seg);
 			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
 			kcp->nrcv_que++;
 			kcp->rcv_nxt++;
@@ -468,6 +600,10 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 		}
 	}
 
+	if (kcp->nrcv_skip > 0) {
+		ikcp_purge_skipped(kcp);
+	}
+
 	// fast recover
 	// 最后进行窗口恢复。此时如果 recover 标记为1，表明在此次接收之前，
 	// 可用接收窗口为0，如果经过本次接收之后，可用窗口大于0，
@@ -549,6 +685,32 @@ int ikcp_peeksize(const ikcpcb *kcp)
 // - 流模式，检测上一个分片是否达到mss，如未达到则填充，利用率高一些
 //---------------------------------------------------------------------
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+	return ikcp_send_deadline(kcp, buffer, len, 0);
+}
+
+static int ikcp_send_segments(ikcpcb *kcp, const char *buffer, int len, 
+	IUINT32 deadline, int unordered);
+
+//---------------------------------------------------------------------
+// 带过期时间的 ikcp_send, 流模式下消息边界不存在, 忽略过期时间
+//---------------------------------------------------------------------
+int ikcp_send_deadline(ikcpcb *kcp, const char *buffer, int len, IUINT32 deadline)
+{
+	return ikcp_send_segments(kcp, buffer, len, deadline, 0);
+}
+
+//---------------------------------------------------------------------
+// 无序的 ikcp_send, 分片用 IKCP_CMD_UPUSH(首个分片 IKCP_CMD_UPUSH_FIRST) 发出,
+// 接收端收齐分片即可交给上层, 不必等前面的sn. 流模式下按普通消息发送
+//---------------------------------------------------------------------
+int ikcp_send_unordered(ikcpcb *kcp, const char *buffer, int len, IUINT32 deadline)
+{
+	return ikcp_send_segments(kcp, buffer, len, deadline, 1);
+}
+
+static int ikcp_send_segments(ikcpcb *kcp, const char *buffer, int len, 
+	IUINT32 deadline, int unordered)
 {
 	IKCPSEG *seg;
 	int count, i;
@@ -556,6 +718,16 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	assert(kcp->mss > 0);
 	if (len < 0) return -1;
 
+	if (ikcp_cantrace(kcp, IKCP_LOG_SEND)) {
+		ikcp_trace(kcp, IKCP_LOG_SEND, 0, 0, (IUINT32)len, 0);
+	}
+
+	if (kcp->stream != 0) {
+		deadline = 0;
+		unordered = 0;
+	}
+	if (deadline != 0) kcp->deadline_used = 1;
+
 	// append to previous segment in streaming mode (if possible)
 	// 1. 如果当前的 KCP 开启流模式，取出 `snd_queue` 中的最后一个报文(即 kcp->snd_queue.prev)
 	// 将其填充到 mss 的长度，并设置其 frg 为 0.
@@ -572,12 +744,18 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 				}
 				iqueue_add_tail(&seg->node, &kcp->snd_queue);
 				memcpy(seg->data, old->data, old->len);
+				IKCP_COUNT_COPY(old->len);
 				if (buffer) {
 					memcpy(seg->data + old->len, buffer, extend);
+					IKCP_COUNT_COPY(extend);
 					buffer += extend;
 				}
 				seg->len = old->len + extend;
+				seg->cmd = IKCP_CMD_PUSH;
 				seg->frg = 0;
+				seg->frg_cnt = 1;
+				seg->deadline = 0;
+				seg->stage_ts = old->stage_ts;
 				len -= extend;
 				iqueue_del_init(&old->node);
 				ikcp_segment_delete(kcp, old);
@@ -607,10 +785,16 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 		}
 		if (buffer && len > 0) {
 			memcpy(seg->data, buffer, size);
+			IKCP_COUNT_COPY(size);
 		}
 		seg->len = size;
 		// frg用来表示被分片的序号，从大到小递减; 流模式情况下分片编号不用填写
 		seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
+		seg->frg_cnt = (kcp->stream == 0)? count : 1;
+		if (unordered) seg->cmd = (i == 0)? IKCP_CMD_UPUSH_FIRST : IKCP_CMD_UPUSH;
+		else seg->cmd = IKCP_CMD_PUSH;
+		seg->deadline = deadline;
+		seg->stage_ts = kcp->ts_stage;
 		iqueue_init(&seg->node);
 		iqueue_add_tail(&seg->node, &kcp->snd_queue); // 加入到 snd_queue 中
 		kcp->nsnd_que++;
@@ -620,6 +804,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 		len -= size;
 	}
 
+	ikcp_interval_wake(kcp);
+
 	return 0;
 }
 
@@ -673,6 +859,7 @@ static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 		next = p->next;
 		if (sn == seg->sn) {
 			iqueue_del(p);
+			ikcp_stage_end(kcp, IKCP_STAGE_SND_BUF, seg);
 			ikcp_segment_delete(kcp, seg);
 			kcp->nsnd_buf--;
 			break;
@@ -694,6 +881,7 @@ static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
 		next = p->next;
 		if (_itimediff(una, seg->sn) > 0) {
 			iqueue_del(p);
+			ikcp_stage_end(kcp, IKCP_STAGE_SND_BUF, seg);
 			ikcp_segment_delete(kcp, seg);
 			kcp->nsnd_buf--;
 		}	else {
@@ -774,6 +962,64 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 }
 
 
+//---------------------------------------------------------------------
+// 无序消息的分片在rcv_buf中收齐后, 先于rcv_nxt交给rcv_queue:
+// 分片移入rcv_queue中最后一条完整消息之后, rcv_buf中原位换成只有包头的
+// IKCP_CMD_SKIP 占住sn, 等rcv_nxt走到时再由 ikcp_purge_skipped 丢弃
+//---------------------------------------------------------------------
+static void ikcp_deliver_unordered(ikcpcb *kcp, IKCPSEG *newseg)
+{
+	struct IQUEUEHEAD *first = &newseg->node, *last = &newseg->node, *p, *at;
+	IKCPSEG *seg = newseg;
+
+	// 往前找到首个分片, 往后找到frg为0的分片, sn连续且frg逐个递减才算收齐
+	while (seg->cmd != IKCP_CMD_UPUSH_FIRST) {
+		IKCPSEG *prev;
+		if (first->prev == &kcp->rcv_buf) return;
+		prev = iqueue_entry(first->prev, IKCPSEG, node);
+		if (prev->sn + 1 != seg->sn || prev->frg != seg->frg + 1 || 
+			(prev->cmd != IKCP_CMD_UPUSH && prev->cmd != IKCP_CMD_UPUSH_FIRST))
+			return;
+		first = first->prev;
+		seg = prev;
+	}
+	for (seg = newseg; seg->frg != 0; ) {
+		IKCPSEG *next;
+		if (last->next == &kcp->rcv_buf) return;
+		next = iqueue_entry(last->next, IKCPSEG, node);
+		if (next->sn != seg->sn + 1 || next->frg + 1 != seg->frg || next->cmd != IKCP_CMD_UPUSH)
+			return;
+		last = last->next;
+		seg = next;
+	}
+	if (kcp->nrcv_que >= kcp->rcv_wnd) return;
+
+	// rcv_queue末尾可能是还没收齐的有序消息, 插在它前面
+	for (at = kcp->rcv_queue.prev; at != &kcp->rcv_queue; at = at->prev) {
+		if (iqueue_entry(at, IKCPSEG, node)->frg == 0) break;
+	}
+
+	for (p = first; ; ) {
+		struct IQUEUEHEAD *next = p->next;
+		IKCPSEG *data = iqueue_entry(p, IKCPSEG, node);
+		IKCPSEG *skip = ikcp_segment_new(kcp, 0);
+		int done = (p == last);
+		*skip = *data;
+		skip->cmd = IKCP_CMD_SKIP;
+		skip->len = 0;
+		iqueue_add(&skip->node, p);
+		iqueue_del(p);
+		ikcp_stage_end(kcp, IKCP_STAGE_RCV_BUF, data);
+		kcp->nrcv_skip++;
+		iqueue_add(p, at);
+		at = p;
+		kcp->nrcv_que++;
+		if (done) break;
+		p = next;
+	}
+}
+
+
 //---------------------------------------------------------------------
 // parse data
 // 首先会在rcv_buf中遍历一次，判断是否已经接收过这个数据包，
@@ -810,8 +1056,10 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		iqueue_init(&newseg->node);
 		iqueue_add(&newseg->node, p); // 新数据newseg插入到p的后面
 		kcp->nrcv_buf++;
+		if (newseg->cmd == IKCP_CMD_SKIP) kcp->nrcv_skip++;
 	}	else {
 		// 如果已经接收过了，则丢弃
+		kcp->stat_rcv_dup++;
 		ikcp_segment_delete(kcp, newseg);
 	}
 
@@ -828,6 +1076,7 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
 			iqueue_del(&seg->node);
 			kcp->nrcv_buf--;
+			if (seg->cmd != IKCP_CMD_SKIP) ikcp_stage_end(kcp, IKCP_STAGE_RCV_BUF, seg);
 			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
 			kcp->nrcv_que++;
 			kcp->rcv_nxt++;
@@ -836,6 +1085,15 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		}
 	}
 
+	if (repeat == 0 && _itimediff(sn, kcp->rcv_nxt) >= 0 && 
+		(newseg->cmd == IKCP_CMD_UPUSH || newseg->cmd == IKCP_CMD_UPUSH_FIRST)) {
+		ikcp_deliver_unordered(kcp, newseg);
+	}
+
+	if (kcp->nrcv_skip > 0) {
+		ikcp_purge_skipped(kcp);
+	}
+
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
 	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
@@ -898,6 +1156,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
 		ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
 	}
+	if (ikcp_cantrace(kcp, IKCP_LOG_INPUT)) {
+		ikcp_trace(kcp, IKCP_LOG_INPUT, 0, 0, (IUINT32)size, 0);
+	}
 
 	if (data == NULL || (int)size < (int)IKCP_OVERHEAD) return -1;
 
@@ -944,7 +1205,8 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		if ((long)size < (long)len) return -2;
 
 		if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS) 
+			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS && cmd != IKCP_CMD_SKIP &&
+			cmd != IKCP_CMD_UPUSH && cmd != IKCP_CMD_UPUSH_FIRST) 
 			return -3;
 
 		//** Part 1.2
@@ -968,6 +1230,8 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 				ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
 			}
 
+			IKCP_PROBE4(kcp, ack, kcp->conv, sn, _itimediff(kcp->current, ts) >= 0 ? _itimediff(kcp->current, ts) : -1, una);
+
 			//** 分析具体是哪个segment被收到了，将其从snd_buf中移除
 			ikcp_parse_ack(kcp, sn);
 
@@ -991,19 +1255,29 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					(long)_itimediff(kcp->current, ts),
 					(long)kcp->rx_rto);
 			}
+			if (ikcp_cantrace(kcp, IKCP_LOG_IN_ACK)) {
+				ikcp_trace(kcp, IKCP_LOG_IN_ACK, sn, una, 
+					(IUINT32)_itimediff(kcp->current, ts), wnd);
+			}
 		}
 		//** Part 1.5
 		//** 如果收到的是远端发来的数据包
-		else if (cmd == IKCP_CMD_PUSH) {
+		else if (cmd == IKCP_CMD_PUSH || cmd == IKCP_CMD_SKIP || 
+			cmd == IKCP_CMD_UPUSH || cmd == IKCP_CMD_UPUSH_FIRST) {
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
 				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
 					"input psh: sn=%lu ts=%lu", sn, ts);
 			}
+			if (ikcp_cantrace(kcp, IKCP_LOG_IN_DATA)) {
+				ikcp_trace(kcp, IKCP_LOG_IN_DATA, sn, una, ts, wnd);
+			}
 
 			//** 如果还有足够多的接收窗口
 			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
 				//** push当前包的ack给远端（会在flush中发送ack出去)
 				// 调用 ikcp_ack_push 将对该报文的确认 ACK 报文放入 ACK 列表acklist中
+				if (kcp->ackcount == 0) kcp->ts_ack = kcp->current;
+				if (sn != kcp->rcv_nxt) kcp->ack_immediate = 1; // 乱序或重复, 尽快让对端知道
 				ikcp_ack_push(kcp, sn, ts);
 
 				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
@@ -1016,9 +1290,11 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					seg->sn = sn;
 					seg->una = una;
 					seg->len = len;
+					seg->stage_ts = kcp->ts_stage;
 
 					if (len > 0) {
 						memcpy(seg->data, data, len);
+						IKCP_COUNT_COPY(len);
 					}
 
 					// 解析data, 
@@ -1026,6 +1302,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 					// 如果数据包不存在则添加到rcv_buf中，之后将可用的Segment再转移到rcv_queue中
 					ikcp_parse_data(kcp, seg);
 				}
+				else {
+					kcp->stat_rcv_dup++; // rcv_nxt之前的sn, 已经收过了
+				}
 			}
 		}
 		//** Part 1.6
@@ -1037,6 +1316,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
 				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
 			}
+			if (ikcp_cantrace(kcp, IKCP_LOG_IN_PROBE)) {
+				ikcp_trace(kcp, IKCP_LOG_IN_PROBE, sn, una, 0, wnd);
+			}
 		}
 		// wins告知窗口大小
 		else if (cmd == IKCP_CMD_WINS) {
@@ -1045,6 +1327,9 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 				ikcp_log(kcp, IKCP_LOG_IN_WINS,
 					"input wins: %lu", (IUINT32)(wnd));
 			}
+			if (ikcp_cantrace(kcp, IKCP_LOG_IN_WINS)) {
+				ikcp_trace(kcp, IKCP_LOG_IN_WINS, sn, una, 0, wnd);
+			}
 		}
 		else {
 			return -3;
@@ -1054,6 +1339,8 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
 		size -= len;
 	}
 
+	ikcp_interval_wake(kcp);
+
 	if (flag != 0) {
 		// 根据记录的最大ack的snd值，扫描 snd_buf ，小于max ack的segment的fastack ++，
 		// 在 ikcp_flush 函数中会判断是否超过指定快速重传次数阈值，超过了就会启动快速重传
@@ -1114,6 +1401,68 @@ static int ikcp_wnd_unused(const ikcpcb *kcp)
 }
 
 
+//---------------------------------------------------------------------
+// 丢弃snd_queue中已过期的消息. 同一条消息的分片过期时间相同, 
+// 从消息边界开始逐个判断即可整条丢弃; 队头若是已部分移入snd_buf的消息,
+// 其剩余分片要留着占用sn, 移入snd_buf后再作为 IKCP_CMD_SKIP 发出
+//---------------------------------------------------------------------
+static void ikcp_drop_expired(ikcpcb *kcp, IUINT32 current)
+{
+	struct IQUEUEHEAD *p = kcp->snd_queue.next;
+	if (kcp->snd_partial) {
+		while (p != &kcp->snd_queue) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			p = p->next;
+			if (seg->frg == 0) break;
+		}
+	}
+	while (p != &kcp->snd_queue) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		p = p->next;
+		if (seg->deadline != 0 && _itimediff(current, seg->deadline) >= 0) {
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+			kcp->nsnd_que--;
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// 延迟ACK : 是否继续暂存acklist中的ACK
+//---------------------------------------------------------------------
+static int ikcp_ack_holding(const ikcpcb *kcp, IUINT32 current)
+{
+	if (kcp->ack_every == 0 || kcp->ackcount == 0 || kcp->ack_immediate)
+		return 0;
+	if (kcp->ackcount >= kcp->ack_every)
+		return 0;
+	return _itimediff(current, kcp->ts_ack) < (IINT32)kcp->ack_delay;
+}
+
+// 把acklist中的ACK编码到ptr之后, 放不下时先输出, 返回新的ptr
+static char* ikcp_flush_acks(ikcpcb *kcp, char *ptr, IKCPSEG *seg)
+{
+	char *buffer = kcp->buffer;
+	int count = kcp->ackcount, size, i;
+	for (i = 0; i < count; i++) {
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ikcp_ack_get(kcp, i, &seg->sn, &seg->ts);
+		ptr = ikcp_encode_seg(ptr, seg);
+		if (ikcp_cantrace(kcp, IKCP_LOG_OUT_ACK)) {
+			ikcp_trace(kcp, IKCP_LOG_OUT_ACK, seg->sn, seg->una, 0, seg->wnd);
+		}
+	}
+	kcp->ackcount = 0;
+	kcp->ack_immediate = 0;
+	return ptr;
+}
+
+
 //---------------------------------------------------------------------
 //	ikcp_flush
 //	KCP.flush之发包
@@ -1174,13 +1523,14 @@ void ikcp_flush(ikcpcb *kcp)
 	IUINT32 current = kcp->current;
 	char *buffer = kcp->buffer;
 	char *ptr = buffer;
-	int count, size, i;
+	int size;
 	IUINT32 resent, cwnd;
 	IUINT32 rtomin;
 	struct IQUEUEHEAD *p;
 	int change = 0; // 标识快重传发生
 	int lost = 0; // 记录出现了报文丢失
 	IKCPSEG seg;
+	int holdack;
 
 	// 'ikcp_update' haven't been called. 
 	// 检查 kcp->update 是否更新，未更新直接返回。
@@ -1205,19 +1555,12 @@ void ikcp_flush(ikcpcb *kcp)
 	// - ackblock：acklist 数组的可用长度，当 acklist 的容量不足时，需要进行扩容；
 	// 以下代码表示 : 
 	// 准备将 acklist 中记录的 ACK 报文发送出去，即从 acklist 中填充 ACK 报文的 sn 和 ts 字段；
-	count = kcp->ackcount;
-	for (i = 0; i < count; i++) {
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
-		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-		ptr = ikcp_encode_seg(ptr, &seg);
+	// 开启延迟ACK时, 未到期的ACK先不发, 等本次flush有数据要发再捎带在数据之后
+	holdack = ikcp_ack_holding(kcp, current);
+	if (!holdack) {
+		ptr = ikcp_flush_acks(kcp, ptr, &seg);
 	}
 
-	kcp->ackcount = 0;
-
 	// probe window size (if remote window size equals zero)
 	// 检查当前是否需要对远端窗口进行探测。
 	// 由于 KCP 流量控制依赖于远端通知其可接受窗口的大小，
@@ -1255,6 +1598,9 @@ void ikcp_flush(ikcpcb *kcp)
 			ptr = buffer;
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
+		if (ikcp_cantrace(kcp, IKCP_LOG_OUT_PROBE)) {
+			ikcp_trace(kcp, IKCP_LOG_OUT_PROBE, 0, seg.una, 0, seg.wnd);
+		}
 	}
 
 	// flush window probing commands
@@ -1268,6 +1614,9 @@ void ikcp_flush(ikcpcb *kcp)
 			ptr = buffer;
 		}
 		ptr = ikcp_encode_seg(ptr, &seg);
+		if (ikcp_cantrace(kcp, IKCP_LOG_OUT_WINS)) {
+			ikcp_trace(kcp, IKCP_LOG_OUT_WINS, 0, seg.una, 0, seg.wnd);
+		}
 	}
 
 	kcp->probe = 0;
@@ -1280,6 +1629,10 @@ void ikcp_flush(ikcpcb *kcp)
 	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
 	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
 
+	if (kcp->deadline_used) {
+		ikcp_drop_expired(kcp, current);
+	}
+
 	// move data from snd_queue to snd_buf
 	// 将缓存在 snd_queue 中的数据移到 snd_buf 中等待发送
 	// 移动的包的数量不会超过snd_una+cwnd-snd_nxt，确保发送的数据不会让接收方的接收队列溢出。
@@ -1292,12 +1645,12 @@ void ikcp_flush(ikcpcb *kcp)
 		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);  //snd_queue：发送消息的队列
 
 		iqueue_del(&newseg->node);                      //从发送消息队列中，删除节点
+		ikcp_stage_end(kcp, IKCP_STAGE_SND_QUEUE, newseg);
 		iqueue_add_tail(&newseg->node, &kcp->snd_buf);  //然后把删除的节点，加入到kcp的发送缓存队列中
 		kcp->nsnd_que--;
 		kcp->nsnd_buf++;
 
-		newseg->conv = kcp->conv;     //会话id
-		newseg->cmd = IKCP_CMD_PUSH;
+		newseg->conv = kcp->conv;     //会话id, cmd 在 ikcp_send 时已定好
 		newseg->wnd = seg.wnd;
 		newseg->ts = current;
 		newseg->sn = kcp->snd_nxt++;  //下一个待发报的序号
@@ -1306,6 +1659,8 @@ void ikcp_flush(ikcpcb *kcp)
 		newseg->rto = kcp->rx_rto;    //由ack接收延迟计算出来的重传超时时间
 		newseg->fastack = 0;          //收到ack时计算的该分片被跳过的累计次数
 		newseg->xmit = 0;             //发送分片的次数，每发送一次加一
+		newseg->stage_ts = kcp->ts_stage;   //进入snd_buf的时间, 被ack时算出等了多久
+		kcp->snd_partial = newseg->frg != 0;
 	}
 
 	// calculate resent
@@ -1324,6 +1679,14 @@ void ikcp_flush(ikcpcb *kcp)
 	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
 		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
 		int needsend = 0;
+		int expired = segment->deadline != 0 && segment->cmd != IKCP_CMD_SKIP
+			&& _itimediff(current, segment->deadline) >= 0;
+
+		// 0. 过期的数据不再发送, 只保留包头改为 IKCP_CMD_SKIP, 照常可靠传输以占住这个sn
+		if (expired) {
+			segment->cmd = IKCP_CMD_SKIP;
+			segment->len = 0;
+		}
 
 		// 1. xmit为0，第一次发送，赋值rto及resendts
 		if (segment->xmit == 0) {
@@ -1331,12 +1694,20 @@ void ikcp_flush(ikcpcb *kcp)
 			segment->xmit++;
 			segment->rto = kcp->rx_rto;
 			segment->resendts = current + segment->rto + rtomin;
+			IKCP_PROBE3(kcp, segment_send, kcp->conv, segment->sn, segment->len);
+		}
+		// 1.5 刚过期且已发送过, 立即发送SKIP, 不让对端的队头继续等待
+		else if (expired) {
+			needsend = 1;
+			segment->xmit++;
+			segment->resendts = current + segment->rto;
 		}
 		// 2. 超过segment重发时间，却仍在send_buf中，说明长时间未收到ack，认为丢失，重发
 		else if (_itimediff(current, segment->resendts) >= 0) {
 			needsend = 1;
 			segment->xmit++;
 			++kcp->timeout_resnd_cnt;
+			++kcp->stat_resnd_timeout;
 			// 更新重传时间信息，根据kcp的设置选择rto*2或rto*1.5，并记录lost标志。
 			if (kcp->nodelay == 0) {
 				segment->rto += kcp->rx_rto; // 以2倍的方式来增长(TCP的RTO默认也是2倍增长)
@@ -1345,6 +1716,7 @@ void ikcp_flush(ikcpcb *kcp)
 			}
 			segment->resendts = current + segment->rto;
 			lost = 1; // 记录出现了报文丢失
+			IKCP_PROBE5(kcp, retransmit, kcp->conv, segment->sn, segment->xmit, segment->rto, 0);
 		}
 		// 3. 达到快速重传阈值，重新发送
 		else if (segment->fastack >= resent) {
@@ -1352,7 +1724,9 @@ void ikcp_flush(ikcpcb *kcp)
 			segment->xmit++;
 			segment->fastack = 0;
 			segment->resendts = current + segment->rto;
+			++kcp->stat_resnd_fast;
 			change++;  // 标识快重传发生
+			IKCP_PROBE5(kcp, retransmit, kcp->conv, segment->sn, segment->xmit, segment->rto, 1);
 		}
 
 		if (needsend) {
@@ -1371,12 +1745,17 @@ void ikcp_flush(ikcpcb *kcp)
 			}
 
 			ptr = ikcp_encode_seg(ptr, segment);
+			if (ikcp_cantrace(kcp, IKCP_LOG_OUT_DATA)) {
+				ikcp_trace(kcp, IKCP_LOG_OUT_DATA, segment->sn, segment->una, 
+					segment->xmit, segment->wnd);
+			}
 
 			if (segment->len > 0) {
 				// 因为ptr初始值是指向buffer的, 而buffer是指向kcp->buffer的, 
 				// 所以这里实际上是把segment->data拷贝到kcp->buffer中, 
 				// 之后再求ptr与buffer的差值是否大于mtu决定是否要ikcp_output
 				memcpy(ptr, segment->data, segment->len);
+				IKCP_COUNT_COPY(segment->len);
 				ptr += segment->len;
 			}
 
@@ -1386,6 +1765,12 @@ void ikcp_flush(ikcpcb *kcp)
 		}
 	}
 
+	// piggyback held acknowledges on the data going out
+	if (holdack && ptr != buffer) {
+		seg.cmd = IKCP_CMD_ACK;
+		ptr = ikcp_flush_acks(kcp, ptr, &seg);
+	}
+
 	// flush remain segments
 	size = (int)(ptr - buffer);
 	if (size > 0) {
@@ -1445,6 +1830,35 @@ int ikcp_rdc_check(ikcpcb *kcp)
 	return kcp->is_rdc_on;
 }
 
+//---------------------------------------------------------------------
+// 自适应flush间隔, 每次flush之后调整下一次flush的时间 : 
+// - 空闲(snd_queue, snd_buf, acklist都为空且不需要探测窗口)时, 间隔翻倍, 直到 interval_max,
+//	 大量空闲连接的 ikcp_check 因此可以返回更远的时间, 减少无谓的唤醒
+// - 有数据在途时间隔恢复为 interval, 且若 snd_buf 中最早的重传时间早于下次flush,
+//	 则把flush提前到重传时间(但不早于 current + interval_min), 避免重传被 interval 量化而推迟
+//---------------------------------------------------------------------
+static void ikcp_interval_adapt(ikcpcb *kcp)
+{
+	struct IQUEUEHEAD *p;
+	int idle = iqueue_is_empty(&kcp->snd_buf) && iqueue_is_empty(&kcp->snd_queue)
+		&& kcp->ackcount == 0 && kcp->probe == 0 && kcp->rmt_wnd != 0;
+
+	if (idle) {
+		kcp->interval_cur = _imin_(kcp->interval_cur * 2, kcp->interval_max);
+		kcp->ts_flush = kcp->current + kcp->interval_cur;
+		return;
+	}
+
+	kcp->interval_cur = kcp->interval;
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		if (_itimediff(seg->resendts, kcp->ts_flush) < 0) {
+			IUINT32 earliest = kcp->current + kcp->interval_min;
+			kcp->ts_flush = _itimediff(seg->resendts, earliest) > 0 ? seg->resendts : earliest;
+		}
+	}
+}
+
 //---------------------------------------------------------------------
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
@@ -1466,6 +1880,7 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 	IINT32 slap;
 
 	kcp->current = current;
+	kcp->ts_stage = current;
 
 	if (kcp->updated == 0) {
 		kcp->updated = 1;
@@ -1480,11 +1895,18 @@ void ikcp_update(ikcpcb *kcp, IUINT32 current)
 	}
 
 	if (slap >= 0) {
-		kcp->ts_flush += kcp->interval; // 设置下一次flush刷新时间戳
+		IUINT32 interval = kcp->interval_max ? kcp->interval_cur : kcp->interval;
+		kcp->ts_flush += interval; // 设置下一次flush刷新时间戳
 		if (_itimediff(kcp->current, kcp->ts_flush) >= 0) {
-			kcp->ts_flush = kcp->current + kcp->interval;
+			kcp->ts_flush = kcp->current + interval;
 		}
 		ikcp_flush(kcp);
+		if (kcp->interval_max) {
+			ikcp_interval_adapt(kcp);
+		}
+	}
+	else if (kcp->ack_every && kcp->ackcount && !ikcp_ack_holding(kcp, current)) {
+		ikcp_flush(kcp); // 延迟ACK到期, 不等下一次flush
 	}
 }
 
@@ -1527,6 +1949,15 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
 	tm_flush = _itimediff(ts_flush, current);
 
+	if (kcp->ack_every && kcp->ackcount) {
+		IINT32 tm_ack;
+		if (!ikcp_ack_holding(kcp, current)) {
+			return current;
+		}
+		tm_ack = _itimediff(kcp->ts_ack + kcp->ack_delay, current);
+		if (tm_ack < tm_flush) tm_flush = tm_ack;
+	}
+
 	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
 		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
 		IINT32 diff = _itimediff(seg->resendts, current);
@@ -1537,19 +1968,38 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 	}
 
 	minimal = (IUINT32)(tm_packet < tm_flush ? tm_packet : tm_flush);
-	if (minimal >= kcp->interval) minimal = kcp->interval;
+	if (kcp->interval_max) {
+		if (minimal >= kcp->interval_cur) minimal = kcp->interval_cur;
+	} else {
+		if (minimal >= kcp->interval) minimal = kcp->interval;
+	}
 
 	return current + minimal;
 }
 
 
 
+//---------------------------------------------------------------------
+// 可以在连接过程中调整mtu(比如kcpp的path mtu探测),
+// mtu变小时 snd_queue/snd_buf 中可能还有按旧mss切好的Segment,
+// ikcp_flush 仍会把它们单独编码进buffer, 所以buffer要按最大的那个Segment来分配
+//---------------------------------------------------------------------
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
 	char *buffer;
-	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
+	struct IQUEUEHEAD *p;
+	IUINT32 need = (IUINT32)mtu;
+	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD)
 		return -1;
-	buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		need = _imax_(need, seg->len + IKCP_OVERHEAD);
+	}
+	for (p = kcp->snd_queue.next; p != &kcp->snd_queue; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		need = _imax_(need, seg->len + IKCP_OVERHEAD);
+	}
+	buffer = (char*)ikcp_malloc((need + IKCP_OVERHEAD) * 3);
 	if (buffer == NULL) 
 		return -2;
 	kcp->mtu = mtu;
@@ -1564,6 +2014,37 @@ int ikcp_interval(ikcpcb *kcp, int interval)
 	if (interval > 5000) interval = 5000;
 	else if (interval < 10) interval = 10;
 	kcp->interval = interval;
+	kcp->interval_cur = interval;
+	return 0;
+}
+
+int ikcp_ack_policy(ikcpcb *kcp, int every, int delay)
+{
+	if (every <= 0) {
+		kcp->ack_every = 0;
+		return 0;
+	}
+	if (delay < 0) delay = 0;
+	else if (delay > 5000) delay = 5000;
+	kcp->ack_every = every;
+	kcp->ack_delay = delay;
+	return 0;
+}
+
+int ikcp_interval_adaptive(ikcpcb *kcp, int interval_min, int interval_max)
+{
+	if (interval_max <= 0) {
+		kcp->interval_max = 0;
+		kcp->interval_cur = kcp->interval;
+		return 0;
+	}
+	if (interval_max > 60000) interval_max = 60000;
+	if (interval_min < 1) interval_min = 1;
+	if (interval_min > (int)kcp->interval) interval_min = (int)kcp->interval;
+	if (interval_max < (int)kcp->interval) interval_max = (int)kcp->interval;
+	kcp->interval_min = interval_min;
+	kcp->interval_max = interval_max;
+	kcp->interval_cur = kcp->interval;
 	return 0;
 }
 
@@ -1592,6 +2073,7 @@ int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
 		else if (interval < 10)
 			interval = 10;
 		kcp->interval = interval; //内部flush刷新时间
+		kcp->interval_cur = interval;
 	}
 	if (resend >= 0) // ACK被跳过resend次数后直接重传该包, 而不等待超时
 	{                     
@@ -316,6 +316,11 @@ typedef struct IQUEUEHEAD iqueue_head;
 //						隔一段时间询问一次，从而让本地有机会再开始重新传数据。
 //				- 4. 窗口大小回应包（IKCP_CMD_WINS）：
 //						回应远端自己的数据接收窗口大小window size
+//				- 5. 跳过包（IKCP_CMD_SKIP）：
+//						只有包头的数据包, 占用原来过期数据包的sn, 同样需要ack, 
+//						告诉远端这个sn所在的消息已过期, 远端收齐该消息后整条丢弃
+//				- 6. 无序数据包（IKCP_CMD_UPUSH, 首个分片为 IKCP_CMD_UPUSH_FIRST）：
+//						和数据包一样可靠传输, 但远端收齐一条消息的分片就交给上层, 不等前面的sn
 //		- KCP.Segment.frg frg是fragment的缩小，是一个Segment在一次Send的data中的倒序序号。 
 //				在让KCP发送数据时，KCP会加入snd_queue的Segment分配序号，标记Segment是这次发送数据中的倒数第几个Segment。
 //				数据在发送出去时，由于mss的限制，数据可能被分成若干个Segment发送出去。在分segment的过程中，相应的序号就会被记录到frg中。
@@ -376,16 +381,50 @@ struct IKCPSEG
 	IUINT32 rto;			// 即 Retransmit Timeout, 用于记录超时重传的时间间隔
 	IUINT32 fastack;	// 记录ack跳过的次数，用于快速重传, 由函数 ikcp_parse_fastack 更新
 	IUINT32 xmit;			// 记录发送的次数
+	IUINT32 deadline;	// 过期时间戳, 过期后不再发送数据, 改为发送 IKCP_CMD_SKIP, 0 表示不过期
+	IUINT32 stage_ts;	// 进入当前所在队列的时间戳(kcp->ts_stage), 用于 stagetime 回调统计各阶段耗时
+	IUINT32 frg_cnt;	// 发送端: 所属消息的分片数, 首个分片的 frg 为 frg_cnt - 1, 流模式下为1. 据此判断消息的首个分片是否已被ack
 	char data[1];			// 应用层要发送出去的数据
 };
 
 
+//---------------------------------------------------------------------
+// 二进制跟踪 : 每个事件一条定长记录写入环形缓冲, 不做格式化, 写满后覆盖最旧的.
+// event 为 IKCP_LOG_* 之一, arg 随事件 : OUTPUT/INPUT 字节数, SEND/RECV 消息长度,
+// IN_DATA 对端发送时的ts, IN_ACK rtt, OUT_DATA 第几次发送(xmit), 其余为0
+//---------------------------------------------------------------------
+typedef struct IKCPTRACEREC
+{
+	IUINT32 ts; // kcp->current
+	IUINT32 conv;
+	IUINT32 sn;
+	IUINT32 una;
+	IUINT32 arg;
+	IUINT32 rto; // kcp->rx_rto
+	IUINT32 cwnd; // kcp->cwnd
+	IUINT16 wnd; // segment的wnd字段, 收到的是对端的, 发出的是本端的
+	IUINT16 event;
+} IKCPTRACEREC;
+
+typedef struct IKCPTRACEBUF
+{
+	IKCPTRACEREC *recs;
+	IUINT32 size; // 2的幂
+	IUINT32 count; // 写入过的记录数, 最新一条在 recs[(count - 1) & (size - 1)]
+} IKCPTRACEBUF;
+
 //---------------------------------------------------------------------
 // IKCPCB
 //
 //	conv 会话ID
 //	mtu	最大传输单元
 //	mss	最大分片大小
+//	stat_resnd_timeout, stat_resnd_fast, stat_rcv_dup 只增不减的统计: 超时重传, 快速重传, 收到重复数据包的次数,
+//		不像 timeout_resnd_cnt 会被 ikcp_rdc_check 清零
+//	stagetime 阶段耗时回调, 可为NULL, segment离开 snd_queue, snd_buf(被ack), rcv_buf 时
+//		报告它在其中待了多少毫秒, 见 IKCP_STAGE_*
+//	ts_stage 阶段计时用的当前时间戳, ikcp_update 时等于current, 上层可在 ikcp_send/ikcp_input 前
+//		设为调用时刻, 使阶段耗时不差一个update间隔, 且不改动 current 对rtt采样与flush时机的影响
 //	state 连接状态（0xFFFFFFFF表示断开连接）
 //	snd_una 第一个未确认的包
 //	snd_nxt 下一个待分配的包的序号
@@ -401,7 +440,15 @@ struct IKCPSEG
 //	cwnd, 拥塞窗口大小
 //	probe 探查变量，IKCP_ASK_TELL表示告知远端窗口大小。IKCP_ASK_SEND表示请求远端告知窗口大小
 //	interval	内部flush刷新间隔
+//	interval_min, interval_max 自适应flush间隔的上下限, interval_max为0表示不开启自适应
+//	interval_cur 自适应模式下当前使用的flush间隔, 空闲时逐步翻倍直到interval_max
+//	ack_every, ack_delay 延迟ACK策略: 攒够ack_every个或等待ack_delay毫秒后才单独发送ACK, ack_every为0表示不开启
+//	ts_ack acklist中第一个ACK的入队时间戳
+//	ack_immediate 收到乱序或重复的包, 需要立即发送ACK以触发对端快重传
 //	ts_flush 下次flush刷新时间戳
+//	deadline_used 是否发送过带过期时间的消息
+//	snd_partial 最后一个移入snd_buf的Segment不是消息的最后一个分片, 即snd_queue队头是一条消息的剩余分片
+//	nrcv_skip rcv_buf与rcv_queue中 IKCP_CMD_SKIP 的个数
 //	nodelay	是否启动无延迟模式
 //	updated 是否调用过update函数的标识
 //	ts_probe 下次探查窗口的时间戳
@@ -460,6 +507,7 @@ struct IKCPCB
 	IINT32 rdc_rtt_limit, is_rdc_on, rdc_close_try_times, rdc_close_try_threshold;
 	IUINT32 snd_sum, timeout_resnd_cnt;
 	IUINT32 loss_rate, rdc_loss_rate_limit;
+	IUINT32 stat_resnd_timeout, stat_resnd_fast, stat_rcv_dup;
 
 	IUINT32 conv, mtu, mss, state;
 	IUINT32 snd_una, snd_nxt, rcv_nxt;
@@ -467,6 +515,10 @@ struct IKCPCB
 	IINT32 rx_rttval, rx_srtt, rx_rto, rx_minrto;
 	IUINT32 snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
 	IUINT32 current, interval, ts_flush;
+	IUINT32 interval_min, interval_max, interval_cur;
+	IUINT32 ack_every, ack_delay, ts_ack;
+	int ack_immediate;
+	int deadline_used, snd_partial, nrcv_skip;
 	IUINT32 nrcv_buf, nsnd_buf; // 收发缓存区中的Segment数量
 	IUINT32 nrcv_que, nsnd_que; // 收发队列中的Segment数量
 	IUINT32 nodelay, updated; // 非延迟ack，是否update(kcp需要上层通过不断的ikcp_update和ikcp_check来驱动kcp的收发过程)
@@ -486,6 +538,10 @@ struct IKCPCB
 	int logmask;
 	int(*output)(const char *buf, int len, struct IKCPCB *kcp, void *user); // 底层网络传输函数
 	void(*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+	void(*stagetime)(int stage, IUINT32 ms, struct IKCPCB *kcp, void *user);
+	IUINT32 ts_stage;
+	struct IKCPTRACEBUF *tracebuf; // 二进制跟踪的环形缓冲, NULL为关闭
+	int tracemask;
 };
 
 
@@ -504,6 +560,10 @@ typedef struct IKCPCB ikcpcb;
 #define IKCP_LOG_OUT_PROBE		1024
 #define IKCP_LOG_OUT_WINS		2048
 
+#define IKCP_STAGE_SND_QUEUE	0	// ikcp_send 之后在 snd_queue 中等发送窗口
+#define IKCP_STAGE_SND_BUF		1	// 首次发出之后在 snd_buf 中等ack
+#define IKCP_STAGE_RCV_BUF		2	// 收到之后在 rcv_buf 中等之前的segment或其余分片
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -524,12 +584,27 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len, 
 	ikcpcb *kcp, void *user));
 
+// set stage time callback, invoked with IKCP_STAGE_* as segments leave
+// snd_queue, snd_buf and rcv_buf. NULL to disable
+void ikcp_setstagetime(ikcpcb *kcp, void (*stagetime)(int stage, IUINT32 ms,
+	ikcpcb *kcp, void *user));
+
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// ikcp_send with an expiry timestamp ('deadline', 0 for never, ignored in stream
+// mode). once expired, unsent fragments are dropped, sent ones are retransmitted
+// as header-only IKCP_CMD_SKIP, and the receiver discards the whole message.
+int ikcp_send_deadline(ikcpcb *kcp, const char *buffer, int len, IUINT32 deadline);
+
+// ikcp_send_deadline of a message the receiver hands over as soon as all of its
+// fragments are in, ahead of earlier messages still missing segments. ordered in
+// stream mode. the receiver should be built with this version.
+int ikcp_send_unordered(ikcpcb *kcp, const char *buffer, int len, IUINT32 deadline);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec. 
@@ -569,11 +644,31 @@ int ikcp_waitsnd(const ikcpcb *kcp);
 // nc: 0:normal congestion control(default), 1:disable congestion control
 int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc);
 
+// adaptive flush interval: stretch the interval up to 'interval_max' while
+// snd_queue, snd_buf and acklist are all empty, go back to 'interval' as soon
+// as there is traffic, and pull the flush in (no closer than 'interval_min')
+// for retransmit deadlines earlier than the next flush. interval_max 0: disable
+int ikcp_interval_adaptive(ikcpcb *kcp, int interval_min, int interval_max);
+
+// delayed ack: hold ACKs until 'every' of them are pending or the oldest one
+// is 'delay' ms old, ACK immediately on out-of-order or duplicate segments.
+// held ACKs ride along with any data segment flushed meanwhile. every 0: disable
+int ikcp_ack_policy(ikcpcb *kcp, int every, int delay);
+
 void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 
+// binary trace of the events in 'mask'(IKCP_LOG_*) into 'buf', buf NULL: disable.
+// buf may be shared by the kcps of one thread
+void ikcp_settrace(ikcpcb *kcp, IKCPTRACEBUF *buf, int mask);
+
 // setup allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 
+#ifdef IKCP_COUNT_COPIES
+// data bytes memcpy'd by kcp so far, built with IKCP_COUNT_COPIES only
+extern IUINT64 ikcp_copied_bytes;
+#endif
+
 // read conv
 IUINT32 ikcp_getconv(const void *ptr);
 
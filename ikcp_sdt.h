@@ -0,0 +1,43 @@
+//=====================================================================
+//
+// USDT static tracepoints of ikcp.c and kcpp.h, for perf/bpftrace/systemtap to attach to
+// a running process. a probe is a single nop till a tracer attaches, its arguments are only
+// read then. on where <sys/sdt.h> is found(systemtap-sdt-dev, systemtap-sdt-devel), define
+// KCPP_NO_USDT to build without them. elsewhere they compile to nothing.
+//
+//	bpftrace -e 'usdt:./server:kcp:retransmit { @[arg4 ? "fast" : "timeout"] = count(); }'
+//	perf probe -x ./server sdt_kcp:retransmit && perf record -e sdt_kcp:retransmit -p <pid>
+//
+// kcp:segment_send		conv, sn, len						a data segment sent the first time
+// kcp:retransmit		conv, sn, xmit, rto, kind			kind 0 : on timeout, 1 : fast retransmit
+// kcp:ack				conv, sn, rtt, una					an ack taken in, rtt -1 if from the future
+// kcp:recv				conv, sn, len, nrcv_que				a msg handed over by ikcp_recv, sn of its last fragment
+// kcpp:rdc_switch		rdc, on								redundancy switched on or off
+// kcpp:rdc_flush		rdc, pkt_cnt, len, latest_len		a datagram with the latest packet and pkt_cnt - 1 previous ones
+// kcpp:conn_state		session, conv, from, to				ConnectionStateE of a session changed
+// kcpp:fragment_drop	base_sn, frg_cnt, rcved_cnt, reason	an unreliable msg given up, reason 0 : a newer msg, 1 : malformed
+//
+//=====================================================================
+#ifndef __IKCP_SDT_H__
+#define __IKCP_SDT_H__
+
+#if !defined(KCPP_NO_USDT) && defined(__has_include)
+#	if __has_include(<sys/sdt.h>)
+#		include <sys/sdt.h>
+#		define KCPP_USDT 1
+#	endif
+#endif
+
+#if defined(KCPP_USDT)
+#	define IKCP_PROBE2(provider, name, a1, a2) DTRACE_PROBE2(provider, name, a1, a2)
+#	define IKCP_PROBE3(provider, name, a1, a2, a3) DTRACE_PROBE3(provider, name, a1, a2, a3)
+#	define IKCP_PROBE4(provider, name, a1, a2, a3, a4) DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#	define IKCP_PROBE5(provider, name, a1, a2, a3, a4, a5) DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#else
+#	define IKCP_PROBE2(provider, name, a1, a2) ((void)0)
+#	define IKCP_PROBE3(provider, name, a1, a2, a3) ((void)0)
+#	define IKCP_PROBE4(provider, name, a1, a2, a3, a4) ((void)0)
+#	define IKCP_PROBE5(provider, name, a1, a2, a3, a4, a5) ((void)0)
+#endif
+
+#endif
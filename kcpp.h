@@ -3,12 +3,16 @@
 #include <functional>
 #include <memory>
 #include <deque>
-#include <unordered_map>
 #include <string>
 #include <algorithm>
 #include <vector>
+#include <unordered_map>
+#include <atomic>
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
 #include "ikcp.h"
+#include "ikcp_sdt.h"
 
 
 // "License": Public Domain
@@ -150,6 +154,111 @@
 namespace kcpp
 {
 
+// payload bytes copied by Buf and Rdc, counted for the benchmarks when built with KCPP_COUNT_COPIES
+#ifdef KCPP_COUNT_COPIES
+inline uint64_t& CopiedBytes()
+{
+	static uint64_t bytes = 0;
+	return bytes;
+}
+#	define KCPP_COUNT_COPY(len) (::kcpp::CopiedBytes() += (len))
+#else
+#	define KCPP_COUNT_COPY(len)
+#endif
+
+// thread local free lists of power-of-2 sized chunks backing Buf, from 256B to 64KB.
+// a size class caches at most kMaxCachedBytesPerClass bytes of chunks, the rest and
+// chunks beyond 64KB go back to the heap, so a burst of large msgs doesn't stay resident.
+// free chunks are linked through their first bytes, the per thread lists are plain data
+// so the hot path needs no tls guard, a Reaper frees them at thread exit.
+class BufPool
+{
+public:
+	// returns a chunk of at least `size` bytes and sets `size` to the chunk's real size
+	static char* Acquire(size_t& size)
+	{
+		size_t classIdx = 0;
+		if (!ClassOf(size, classIdx))
+			return new char[size];
+		size = kMinChunkSize << classIdx;
+		Lists& lists = TlsLists();
+		char* chunk = lists.heads_[classIdx];
+		if (!chunk)
+			return new char[size];
+		::memcpy(&lists.heads_[classIdx], chunk, sizeof(char*));
+		lists.cachedBytes_[classIdx] -= size;
+		return chunk;
+	}
+
+	static void Release(char* chunk, size_t size)
+	{
+		size_t classIdx = 0;
+		Lists& lists = TlsLists();
+		if (ClassOf(size, classIdx) && size == kMinChunkSize << classIdx
+			&& lists.cachedBytes_[classIdx] + size <= kMaxCachedBytesPerClass)
+		{
+			if (lists.state_ == kUnborn)
+				Reaper::Instance(); // arms the cleanup of this thread's lists
+			if (lists.state_ == kAlive)
+			{
+				::memcpy(chunk, &lists.heads_[classIdx], sizeof(char*));
+				lists.heads_[classIdx] = chunk;
+				lists.cachedBytes_[classIdx] += size;
+				return;
+			}
+		}
+		delete[] chunk;
+	}
+
+private:
+	enum StateE { kUnborn, kAlive, kDestroyed };
+
+	static const size_t kMinChunkSize = 256;
+	static const size_t kClassCnt = 9;
+	static const size_t kMaxChunkSize = kMinChunkSize << (kClassCnt - 1);
+	static const size_t kMaxCachedBytesPerClass = 256 * 1024;
+
+	struct Lists
+	{
+		char* heads_[kClassCnt];
+		size_t cachedBytes_[kClassCnt];
+		StateE state_;
+	};
+
+	// zero initialized, so no lazy construction on access
+	static Lists& TlsLists() { static thread_local Lists lists; return lists; }
+
+	struct Reaper
+	{
+		static Reaper& Instance() { static thread_local Reaper reaper; return reaper; }
+		Reaper() { TlsLists().state_ = kAlive; }
+		~Reaper()
+		{
+			// Bufs destroyed after this point free their chunks directly
+			Lists& lists = TlsLists();
+			lists.state_ = kDestroyed;
+			for (size_t i = 0; i < kClassCnt; ++i)
+			{
+				while (char* chunk = lists.heads_[i])
+				{
+					::memcpy(&lists.heads_[i], chunk, sizeof(char*));
+					delete[] chunk;
+				}
+				lists.cachedBytes_[i] = 0;
+			}
+		}
+	};
+
+	static bool ClassOf(size_t size, size_t& classIdx)
+	{
+		if (size > kMaxChunkSize)
+			return false;
+		for (classIdx = 0; (kMinChunkSize << classIdx) < size; ++classIdx)
+			;
+		return true;
+	}
+};
+
 // a light weight buffer.
 // thx to chensuo, modify on muduo::net::Buffer and make it safe to prepend data of any length.
 
@@ -163,38 +272,100 @@ namespace kcpp
 /// |                   |                  |                  |
 /// 0      <=      readerIndex   <=   writerIndex    <=     size
 /// @endcode
+///
+/// the chunk comes from BufPool on the first write, with `prependReserve` bytes
+/// kept in front of the data. once emptied, the chunk goes back to the pool if it is
+/// larger than the shrink watermark (0 by default : always), so idle Bufs hold no memory.
 class Buf
 {
 public:
 	static const size_t kCheapPrepend = 1024;
 	static const size_t kInitialSize = 512;
 
-	explicit Buf(size_t initialSize = kInitialSize)
+	explicit Buf(size_t initialSize = kInitialSize, size_t prependReserve = kCheapPrepend)
 		:
-		buffer_(kCheapPrepend + initialSize),
-		readerIndex_(kCheapPrepend),
-		writerIndex_(kCheapPrepend)
+		chunk_(nullptr),
+		capacity_(0),
+		readerIndex_(0),
+		writerIndex_(0),
+		initialSize_(initialSize),
+		prependReserve_(prependReserve),
+		shrinkWatermark_(0)
 	{
 		assert(readableBytes() == 0);
-		assert(writableBytes() == initialSize);
-		assert(prependableBytes() == kCheapPrepend);
 	}
 
-	// implicit copy-ctor, move-ctor, dtor and assignment are fine
-	// NOTE: implicit move-ctor is added in g++ 4.6
+	Buf(const Buf& rhs)
+		:
+		chunk_(nullptr),
+		capacity_(0),
+		readerIndex_(0),
+		writerIndex_(0),
+		initialSize_(rhs.initialSize_),
+		prependReserve_(rhs.prependReserve_),
+		shrinkWatermark_(rhs.shrinkWatermark_)
+	{
+		if (rhs.readableBytes() > 0)
+			append(rhs.peek(), rhs.readableBytes());
+	}
+
+	Buf(Buf&& rhs)
+		:
+		chunk_(rhs.chunk_),
+		capacity_(rhs.capacity_),
+		readerIndex_(rhs.readerIndex_),
+		writerIndex_(rhs.writerIndex_),
+		initialSize_(rhs.initialSize_),
+		prependReserve_(rhs.prependReserve_),
+		shrinkWatermark_(rhs.shrinkWatermark_)
+	{
+		rhs.chunk_ = nullptr;
+		rhs.capacity_ = rhs.readerIndex_ = rhs.writerIndex_ = 0;
+	}
+
+	Buf& operator=(Buf rhs)
+	{
+		swap(rhs);
+		return *this;
+	}
+
+	~Buf() { releaseChunk(); }
 
 	void swap(Buf& rhs)
 	{
-		buffer_.swap(rhs.buffer_);
+		std::swap(chunk_, rhs.chunk_);
+		std::swap(capacity_, rhs.capacity_);
 		std::swap(readerIndex_, rhs.readerIndex_);
 		std::swap(writerIndex_, rhs.writerIndex_);
+		std::swap(initialSize_, rhs.initialSize_);
+		std::swap(prependReserve_, rhs.prependReserve_);
+		std::swap(shrinkWatermark_, rhs.shrinkWatermark_);
+	}
+
+	// an emptied Buf keeps its chunk only while it is no larger than `bytes`
+	void setShrinkWatermark(size_t bytes)
+	{ shrinkWatermark_ = bytes; }
+
+	// moves the data into the smallest chunk holding it plus `reserve` writable bytes
+	void shrink(size_t reserve)
+	{
+		if (readableBytes() == 0 && reserve == 0)
+		{
+			releaseChunk();
+			return;
+		}
+		Buf other(reserve, prependReserve_);
+		other.shrinkWatermark_ = shrinkWatermark_;
+		other.ensureWritableBytes(readableBytes() + reserve);
+		other.append(peek(), readableBytes());
+		swap(other);
 	}
 
 	size_t readableBytes() const
 	{ return writerIndex_ - readerIndex_; }
 
 	size_t writableBytes() const
-	{ return buffer_.size() - writerIndex_; }
+	{ return capacity_ - writerIndex_; }
 
 	size_t prependableBytes() const
 	{ return readerIndex_; }
@@ -277,8 +448,10 @@ public:
 
 	void retrieveAll()
 	{
-		readerIndex_ = kCheapPrepend;
-		writerIndex_ = kCheapPrepend;
+		if (capacity_ > shrinkWatermark_)
+			releaseChunk();
+		else
+			readerIndex_ = writerIndex_ = (chunk_ ? prependReserve_ : 0);
 	}
 
 	std::string retrieveAllAsString()
@@ -303,6 +476,7 @@ public:
 	{
 		ensureWritableBytes(len);
 		std::copy(data, data + len, beginWrite());
+		KCPP_COUNT_COPY(len);
 		hasWritten(len);
 	}
 
@@ -482,6 +656,15 @@ public:
 		readerIndex_ -= len;
 		const char* d = static_cast<const char*>(data);
 		std::copy(d, d + len, begin() + readerIndex_);
+		KCPP_COUNT_COPY(len);
+	}
+
+	// prepends `len` bytes of room, to be written in place through the returned pointer
+	char* reservePrepend(size_t len)
+	{
+		ensurePrependableBytes(len);
+		readerIndex_ -= len;
+		return begin() + readerIndex_;
 	}
 
 	void ensurePrependableBytes(size_t len)
@@ -495,58 +678,78 @@ public:
 
 	size_t internalCapacity() const
 	{
-		return buffer_.capacity();
+		return capacity_;
 	}
 
 private:
 
+	// writes go through chunk_, which makeSpace() and makeSpaceForPrepend() allocate first.
+	// a chunkless Buf reads as empty at a const sentinel
 	char* begin()
-	{ return &*buffer_.begin(); }
+	{ return chunk_; }
 
 	const char* begin() const
-	{ return &*buffer_.begin(); }
+	{ static const char empty = 0; return chunk_ ? chunk_ : &empty; }
 
-	void makeSpace(size_t len)
+	void releaseChunk()
 	{
-		if (writableBytes() + prependableBytes() < len + kCheapPrepend)
-		{
-			// FIXME: move readable data
-			buffer_.resize(writerIndex_ + len);
-		}
-		else
-		{
-			// move readable data to the front, make space inside buffer
-			assert(kCheapPrepend < readerIndex_);
-			size_t readable = readableBytes();
-			std::copy(begin() + readerIndex_,
-				begin() + writerIndex_,
-				begin() + kCheapPrepend);
-			readerIndex_ = kCheapPrepend;
-			writerIndex_ = readerIndex_ + readable;
-			assert(readable == readableBytes());
-		}
+		if (chunk_)
+			BufPool::Release(chunk_, capacity_);
+		chunk_ = nullptr;
+		capacity_ = readerIndex_ = writerIndex_ = 0;
 	}
 
-	void makeSpaceForPrepend(size_t len)
+	// moves `readable` bytes at the reader index to `newReaderIndex` of a chunk holding
+	// at least `size` bytes, the current chunk if it is large enough
+	void relocate(size_t newReaderIndex, size_t size)
 	{
-		if (len - readerIndex_ > writableBytes())
+		size_t readable = readableBytes();
+		KCPP_COUNT_COPY(readable);
+		if (chunk_ && size <= capacity_)
+			::memmove(chunk_ + newReaderIndex, chunk_ + readerIndex_, readable);
+		else
 		{
-			buffer_.resize(writerIndex_ + (len - readerIndex_));
+			// grow at least twofold, by size classes and past the largest one, so appends stay
+			// amortized O(1). the readable data is moved rather than the whole chunk copied
+			if (size < capacity_ * 2)
+				size = capacity_ * 2;
+			char* chunk = BufPool::Acquire(size);
+			if (readable > 0)
+				::memcpy(chunk + newReaderIndex, chunk_ + readerIndex_, readable);
+			if (chunk_)
+				BufPool::Release(chunk_, capacity_);
+			chunk_ = chunk;
+			capacity_ = size;
 		}
-		// move readable data to the end
-		size_t readable = readableBytes();
-		std::copy(begin() + readerIndex_,
-			begin() + writerIndex_,
-			begin() + len);
-		readerIndex_ = len;
+		readerIndex_ = newReaderIndex;
 		writerIndex_ = readerIndex_ + readable;
 		assert(readable == readableBytes());
 	}
 
+	void makeSpace(size_t len)
+	{
+		size_t readable = readableBytes();
+		size_t room = capacity_ - readable; // writable plus prependable bytes, checked without overflowing on a huge len
+		if (chunk_ && room >= prependReserve_ && room - prependReserve_ >= len)
+			relocate(prependReserve_, capacity_); // move readable data to the front
+		else
+			relocate(prependReserve_, prependReserve_ + std::max(readable + len, initialSize_));
+	}
+
+	void makeSpaceForPrepend(size_t len)
+	{
+		// move readable data to the end of the prepended bytes
+		relocate(len, std::max(len + readableBytes() + writableBytes(), len + initialSize_));
+	}
+
 private:
-	std::vector<char> buffer_;
+	char* chunk_;
+	size_t capacity_;
 	size_t readerIndex_;
 	size_t writerIndex_;
+	size_t initialSize_;
+	size_t prependReserve_;
+	size_t shrinkWatermark_;
 	static const char kCRLF[];
 };
 
@@ -566,40 +769,398 @@ struct UserInputData
 	int len_;
 };
 
-class KcpSession;
-typedef std::shared_ptr<KcpSession> KcpSessionPtr;
-
 typedef std::function<void(const void* pendingSendData, int pendingSendDataLen)> UserOutputFunction;
 typedef std::function<UserInputData()> UserInputFunction;
 typedef std::function<int64_t()> CurrentTimestampMsFunction;
 typedef std::function<void(std::deque<std::string>* pendingSendDataDeque)> KcpSessionConnectionCallback;
 
-enum TransmitModeE { kUnreliable = 88, kReliable };
+template <typename OutputPolicy, typename InputPolicy, typename ClockPolicy>
+class BasicKcpSession;
+// the session with type-erased callbacks, see BasicKcpSession for inlinable ones
+typedef BasicKcpSession<UserOutputFunction, UserInputFunction, CurrentTimestampMsFunction> KcpSession;
+typedef std::shared_ptr<KcpSession> KcpSessionPtr;
+
+enum TransmitModeE { kUnreliable = 88, kReliable, kReliableUnordered, kState };
 enum RoleTypeE { kSrv, kCli };
 enum ConnectionStateE { kConnecting, kConnected, kResetting, kReset };
-enum PktTypeE { kSyn = 66, kAck, kPsh, kRst };
+enum PktTypeE { kSyn = 66, kAck, kPsh, kRst, kMtuProbe, kMtuProbeAck, kPshFrg, kStatePkt, kMtuFallback };
+enum RedundancyModeE { kRdcDynamic, kRdcOff, kRdcOn };
+
+// a msg of a RecvBatch() call, in the caller's Buf
+struct RecvMsgView
+{
+	const char* data_;
+	size_t offset_; // from the Buf's peek() at the time RecvBatch() returned
+	int len_;
+	TransmitModeE transmitMode_;
+	int stream_; // reliable stream the msg came on, 0 for unreliable msgs
+	uint32_t key_; // key of a kState msg, 0 for the others
+};
+
+// what a session did since it was created, see GetStats().
+// counters only go up, gauges are as of the call
+struct KcpSessionStats
+{
+	// user msgs of a channel, their payload bytes
+	struct Channel
+	{
+		uint64_t msgsOut_; // sent, or queued before connected for reliable msgs
+		uint64_t bytesOut_;
+		uint64_t msgsIn_; // handed over by Recv()/RecvBatch()
+		uint64_t bytesIn_;
+	};
+	Channel unreliable_;
+	Channel reliable_; // kReliable and kReliableUnordered, every stream
+	Channel state_; // SendState() updates that went out and newer ones that came in
+
+	// datagrams as passed to and from the user's callbacks
+	uint64_t datagramsOut_;
+	uint64_t datagramBytesOut_;
+	uint64_t datagramsIn_;
+	uint64_t datagramBytesIn_;
+	uint64_t redundantBytesOut_; // previous packets resent along with the latest while rdc is on
+	uint64_t reassemblyDrops_; // fragmented msgs given up with fragments missing
+	uint64_t rejectedPktsIn_; // malformed, or kcp data while not connected
+
+	// kcp segments, every stream
+	uint64_t timeoutRetransmits_;
+	uint64_t fastRetransmits_;
+	uint64_t duplicatesIn_;
+
+	// gauges, rtt and windows of stream 0, queues in segments summed over the streams
+	int srttMs_;
+	int rttVarMs_;
+	int rtoMs_;
+	int cwnd_;
+	int rmtWnd_;
+	int sndQueue_;
+	int sndBuf_;
+	int rcvQueue_;
+	int rcvBuf_;
+	int pendingMsgs_; // reliable msgs queued before connected
+	bool rdcOn_;
+};
+
+// log-bucketed histogram of latencies in ms, HDR style : exact below 8 ms, then 8 buckets per
+// power of two, a value reads back within 12.5%. written by one thread with relaxed stores,
+// no lock, other threads may read or Merge() it meanwhile
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() { Reset(); }
+
+	void Record(uint32_t ms)
+	{
+		Add(counts_[BucketOf(ms)], 1);
+		Add(count_, 1);
+		Add(sum_, ms);
+		if (ms > max_.load(std::memory_order_relaxed))
+			max_.store(ms, std::memory_order_relaxed);
+	}
+
+	// adds the values of `other` to this one, e.g. every session's into a per-server view
+	void Merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < kBucketCnt; ++i)
+			Add(counts_[i], other.counts_[i].load(std::memory_order_relaxed));
+		Add(count_, other.count_.load(std::memory_order_relaxed));
+		Add(sum_, other.sum_.load(std::memory_order_relaxed));
+		uint32_t otherMax = other.max_.load(std::memory_order_relaxed);
+		if (otherMax > max_.load(std::memory_order_relaxed))
+			max_.store(otherMax, std::memory_order_relaxed);
+	}
+
+	void Reset()
+	{
+		for (size_t i = 0; i < kBucketCnt; ++i)
+			counts_[i].store(0, std::memory_order_relaxed);
+		count_.store(0, std::memory_order_relaxed);
+		sum_.store(0, std::memory_order_relaxed);
+		max_.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+	uint32_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+	// values recorded in the buckets ending at or below `value`, exact for 2^n - 1 and below 8
+	uint64_t CountAtMost(uint32_t value) const
+	{
+		uint64_t count = 0;
+		for (size_t i = 0; i < kBucketCnt && HighestValueOf(i) <= value; ++i)
+			count += counts_[i].load(std::memory_order_relaxed);
+		return count;
+	}
+
+	double Mean() const
+	{
+		uint64_t count = Count();
+		return count > 0 ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / count : 0;
+	}
+
+	// the highest value of the bucket holding the `percentile`(0-100) one, 0 if empty
+	uint32_t ValueAtPercentile(double percentile) const
+	{
+		uint64_t count = Count();
+		if (count == 0)
+			return 0;
+		uint64_t rank = static_cast<uint64_t>(percentile / 100 * count + 0.5);
+		if (rank == 0)
+			rank = 1;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < kBucketCnt; ++i)
+		{
+			seen += counts_[i].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				return std::min(HighestValueOf(i), Max());
+		}
+		return Max();
+	}
+
+private:
+	static const size_t kSubBucketBits = 3;
+	static const size_t kSubBucketCnt = 1 << kSubBucketBits;
+	static const size_t kBucketCnt = (32 - kSubBucketBits + 1) * kSubBucketCnt;
+
+	// a single writer, no need for an atomic read-modify-write
+	static void Add(std::atomic<uint64_t>& counter, uint64_t n)
+	{ counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+	static size_t HighestBit(uint32_t v)
+	{
+#if defined(__GNUC__)
+		return 31 - __builtin_clz(v);
+#else
+		size_t bit = 0;
+		while (v >>= 1)
+			++bit;
+		return bit;
+#endif
+	}
+
+	static size_t BucketOf(uint32_t v)
+	{
+		if (v < kSubBucketCnt)
+			return v;
+		size_t shift = HighestBit(v) - kSubBucketBits;
+		return (shift + 1) * kSubBucketCnt + ((v >> shift) & (kSubBucketCnt - 1));
+	}
+
+	static uint32_t HighestValueOf(size_t bucket)
+	{
+		if (bucket < kSubBucketCnt)
+			return static_cast<uint32_t>(bucket);
+		size_t shift = bucket / kSubBucketCnt - 1;
+		uint64_t lowest = static_cast<uint64_t>(kSubBucketCnt + bucket % kSubBucketCnt) << shift;
+		return static_cast<uint32_t>(lowest + (static_cast<uint64_t>(1) << shift) - 1);
+	}
+
+	std::atomic<uint64_t> counts_[kBucketCnt];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint32_t> max_;
+};
+
+// latencies of a session, see SetLatencyTracking()
+struct KcpSessionLatency
+{
+	// Send() to the peer's Recv(), against the timestamp the peer stamped the msg with,
+	// so only meaningful when both sides read the same clock(same host, or synced)
+	LatencyHistogram unreliable_;
+	LatencyHistogram reliable_; // every stream, kReliable and kReliableUnordered
+
+	// the stages of a reliable segment in kcp, on this side's clock
+	LatencyHistogram sndQueue_; // in snd_queue, waiting for the send window
+	LatencyHistogram sndBuf_; // in snd_buf, from first sent till acked
+	LatencyHistogram rcvBuf_; // in rcv_buf, waiting for an earlier segment or the other fragments
+
+	void Merge(const KcpSessionLatency& other)
+	{
+		unreliable_.Merge(other.unreliable_);
+		reliable_.Merge(other.reliable_);
+		sndQueue_.Merge(other.sndQueue_);
+		sndBuf_.Merge(other.sndBuf_);
+		rcvBuf_.Merge(other.rcvBuf_);
+	}
+
+	void Reset()
+	{
+		unreliable_.Reset();
+		reliable_.Reset();
+		sndQueue_.Reset();
+		sndBuf_.Reset();
+		rcvBuf_.Reset();
+	}
+};
+
+// the sessions of one network thread summed up for MetricsRegistry(kcpp_metrics.h), see
+// SetMetrics(). written by that thread alone with relaxed stores, read from any thread
+struct MetricsShard
+{
+	MetricsShard()
+		: liveSessions_(0), connectedSessions_(0), handshakes_(0),
+		msgsOut_(0), msgBytesOut_(0), msgsIn_(0), msgBytesIn_(0),
+		datagramsOut_(0), datagramBytesOut_(0), datagramsIn_(0), datagramBytesIn_(0),
+		redundantBytesOut_(0), reassemblyDrops_(0), rejectedPktsIn_(0),
+		timeoutRetransmits_(0), fastRetransmits_(0), duplicatesIn_(0)
+	{}
+
+	MetricsShard(const MetricsShard&) = delete;
+	MetricsShard& operator=(const MetricsShard&) = delete;
+
+	// gauges
+	std::atomic<int64_t> liveSessions_; // set on the shard and not yet destroyed
+	std::atomic<int64_t> connectedSessions_;
+
+	// counters, every channel and stream
+	std::atomic<uint64_t> handshakes_; // sessions that got connected
+	std::atomic<uint64_t> msgsOut_;
+	std::atomic<uint64_t> msgBytesOut_;
+	std::atomic<uint64_t> msgsIn_;
+	std::atomic<uint64_t> msgBytesIn_;
+	std::atomic<uint64_t> datagramsOut_;
+	std::atomic<uint64_t> datagramBytesOut_;
+	std::atomic<uint64_t> datagramsIn_;
+	std::atomic<uint64_t> datagramBytesIn_;
+	std::atomic<uint64_t> redundantBytesOut_;
+	std::atomic<uint64_t> reassemblyDrops_;
+	std::atomic<uint64_t> rejectedPktsIn_;
+	std::atomic<uint64_t> timeoutRetransmits_;
+	std::atomic<uint64_t> fastRetransmits_;
+	std::atomic<uint64_t> duplicatesIn_;
+
+	// the connected sessions sampled about once a second, in ms and in segments
+	LatencyHistogram srttMs_;
+	LatencyHistogram sndQueue_; // snd_queue and msgs queued before connected
+	LatencyHistogram sndBuf_; // in flight
+	// recorded as they happen by the sessions with SetLatencyTracking() on
+	KcpSessionLatency latency_;
+
+	// adds what `stats` counted since `last`
+	void AddDelta(const KcpSessionStats& stats, const KcpSessionStats& last)
+	{
+		Add(msgsOut_, stats.unreliable_.msgsOut_ + stats.reliable_.msgsOut_ + stats.state_.msgsOut_
+			- last.unreliable_.msgsOut_ - last.reliable_.msgsOut_ - last.state_.msgsOut_);
+		Add(msgBytesOut_, stats.unreliable_.bytesOut_ + stats.reliable_.bytesOut_ + stats.state_.bytesOut_
+			- last.unreliable_.bytesOut_ - last.reliable_.bytesOut_ - last.state_.bytesOut_);
+		Add(msgsIn_, stats.unreliable_.msgsIn_ + stats.reliable_.msgsIn_ + stats.state_.msgsIn_
+			- last.unreliable_.msgsIn_ - last.reliable_.msgsIn_ - last.state_.msgsIn_);
+		Add(msgBytesIn_, stats.unreliable_.bytesIn_ + stats.reliable_.bytesIn_ + stats.state_.bytesIn_
+			- last.unreliable_.bytesIn_ - last.reliable_.bytesIn_ - last.state_.bytesIn_);
+		Add(datagramsOut_, stats.datagramsOut_ - last.datagramsOut_);
+		Add(datagramBytesOut_, stats.datagramBytesOut_ - last.datagramBytesOut_);
+		Add(datagramsIn_, stats.datagramsIn_ - last.datagramsIn_);
+		Add(datagramBytesIn_, stats.datagramBytesIn_ - last.datagramBytesIn_);
+		Add(redundantBytesOut_, stats.redundantBytesOut_ - last.redundantBytesOut_);
+		Add(reassemblyDrops_, stats.reassemblyDrops_ - last.reassemblyDrops_);
+		Add(rejectedPktsIn_, stats.rejectedPktsIn_ - last.rejectedPktsIn_);
+		Add(timeoutRetransmits_, stats.timeoutRetransmits_ - last.timeoutRetransmits_);
+		Add(fastRetransmits_, stats.fastRetransmits_ - last.fastRetransmits_);
+		Add(duplicatesIn_, stats.duplicatesIn_ - last.duplicatesIn_);
+	}
+
+	void Sample(const KcpSessionStats& stats)
+	{
+		srttMs_.Record(static_cast<uint32_t>(std::max(stats.srttMs_, 0)));
+		sndQueue_.Record(static_cast<uint32_t>(stats.sndQueue_ + stats.pendingMsgs_));
+		sndBuf_.Record(static_cast<uint32_t>(stats.sndBuf_));
+	}
+
+	// a single writer, no need for an atomic read-modify-write
+	template <typename T>
+	static void Add(std::atomic<T>& counter, T n)
+	{ counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+};
+
+// per thread ring of kcp's binary trace records(IKCPTRACEREC), shared by the sessions driven by
+// the thread with SetTracing() on, it is the only writer. the oldest records are overwritten, nothing is formatted on the way.
+// read it from that thread, e.g. Dump() on a flag the thread polls, decode with test/KcppTraceDump.cpp
+class KcpTrace
+{
+public:
+	static const IUINT32 kRecCnt = 1 << 16; // 2 MB
+
+	// this thread's ring, allocated on first use
+	static IKCPTRACEBUF* ThisThread()
+	{
+		static thread_local Ring ring;
+		return &ring.buf_;
+	}
+
+	// the records of this thread's ring, oldest first
+	static std::vector<IKCPTRACEREC> Snapshot()
+	{
+		const IKCPTRACEBUF* buf = ThisThread();
+		IUINT32 cnt = buf->count < buf->size ? buf->count : buf->size;
+		std::vector<IKCPTRACEREC> recs;
+		recs.reserve(cnt);
+		for (IUINT32 i = buf->count - cnt; i != buf->count; ++i)
+			recs.push_back(buf->recs[i & (buf->size - 1)]);
+		return recs;
+	}
+
+	// "KCPPTRC1", the record size(uint32) then Snapshot(), in this host's byte order
+	static bool Dump(const char* path)
+	{
+		FILE* file = fopen(path, "wb");
+		if (!file)
+			return false;
+		std::vector<IKCPTRACEREC> recs = Snapshot();
+		uint32_t recLen = sizeof(IKCPTRACEREC);
+		bool isOk = fwrite("KCPPTRC1", 1, 8, file) == 8
+			&& fwrite(&recLen, sizeof recLen, 1, file) == 1
+			&& (recs.empty() || fwrite(&recs[0], sizeof(IKCPTRACEREC), recs.size(), file) == recs.size());
+		return fclose(file) == 0 && isOk;
+	}
+
+private:
+	struct Ring
+	{
+		Ring() : recs_(kRecCnt)
+		{
+			buf_.recs = &recs_[0];
+			buf_.size = kRecCnt;
+			buf_.count = 0;
+		}
+
+		std::vector<IKCPTRACEREC> recs_;
+		IKCPTRACEBUF buf_;
+	};
+};
 
 
-class Rdc
+// `OutputPolicy` is called as void(const void* data, int len) for every datagram,
+// `RecvPolicy` as void(Buf* userBuf, int& len, const char* data, int dataLen, PktTypeE) for every packet.
+// both are held by value, plain functors get inlined, see the Rdc typedef for std::function ones.
+template <typename OutputPolicy, typename RecvPolicy>
+class BasicRdc
 {
 public:
-	typedef std::function<void(Buf*, int&, int, PktTypeE)> RecvFuncion;
-	Rdc(const UserOutputFunction& userOutputFunc, const RecvFuncion& rcvFunc)
+	// `data` is valid during the call only, Rdc consumes it from the input buffer afterwards
+	typedef RecvPolicy RecvFuncion;
+	BasicRdc(const OutputPolicy& userOutputFunc, const RecvFuncion& rcvFunc)
 		:
 		userOutputFunc_(userOutputFunc), rcvFunc_(rcvFunc), nextSndSn_(0), nextRcvSn_(0),
-		isThisRoundFinished_(true), on_(false), mss_(548)
+		isThisRoundFinished_(true), on_(false), mss_(548), baseDatagramLen_(548 + kReliableHeaderLen),
+		datagramsOut_(0), datagramBytesOut_(0), redundantBytesOut_(0), fullSizeDatagramsOut_(0)
 	{}
 
 	int Output(Buf* oBuf, PktTypeE pktType)
 	{
 		size_t curLen = oBuf->readableBytes();
-		if (pktType == static_cast<PktTypeE>(kUnreliable))
+		// kcp segments sized for a larger path mtu may still be in flight after the mtu shrank,
+		// those datagrams get split like unreliable data and reassembled before ikcp_input.
+		// at the base mtu kcp fills mss_ itself, the rdc header rides on top as it always did
+		bool isOversizedPsh = pktType == kPsh && curLen > std::min(mss_, static_cast<size_t>(kReliableDataLenLimit));
+		if (pktType == static_cast<PktTypeE>(kUnreliable) || isOversizedPsh)
 		{
+			size_t maxMss = isOversizedPsh ? mss_ : kMaxMSS;
+			size_t dataLenLimit = maxMss - kUnreliableHeaderLen;
 			size_t frgCnt = 0;
-			if (curLen <= kUnreliableDataLenLimit + kFrgLen)
+			if (!isOversizedPsh && curLen <= dataLenLimit + kFrgLen)
 				frgCnt = 1;
 			else
-				frgCnt = (curLen + kUnreliableDataLenLimit - 1) / kUnreliableDataLenLimit;
+				frgCnt = (curLen + dataLenLimit - 1) / dataLenLimit;
 
 			if (frgCnt >= kMaxFrgCnt)
 			{
@@ -607,36 +1168,41 @@ public:
 				return -1;
 			}
 
+			int8_t frgPktType = isOversizedPsh ? static_cast<int8_t>(kPshFrg) : static_cast<int8_t>(kUnreliable);
+			if (frgCnt == 1)
+			{
+				OutputPkt<UnfrgedPktHeader>(oBuf, frgPktType, 1, 0, curLen);
+				return 0;
+			}
+
 			size_t curDataLen = 0;
-			size_t curHeaderLen = frgCnt > 1 ? kUnreliableHeaderLen : (kUnreliableHeaderLen - kFrgLen);
-			size_t curDataLenLimit = kMaxMSS - curHeaderLen;
+			size_t curDataLenLimit = maxMss - FrgPktHeader::kLen;
 			for (size_t i = 0; i < frgCnt; ++i)
 			{
 				curDataLen = curLen > curDataLenLimit ? curDataLenLimit : curLen;
-				oBuf->prependInt16(static_cast<int16_t>(curDataLen));
-				if (frgCnt > 1)
-					oBuf->prependInt8(static_cast<int8_t>(frgCnt - i - 1));
-				oBuf->prependInt8(static_cast<int8_t>(frgCnt));
-				oBuf->prependInt32(nextSndSn_++);
-				oBuf->prependInt8(static_cast<int8_t>(kUnreliable));
-				outputPktDeque_.emplace_back(std::string(oBuf->peek(), curHeaderLen + curDataLen));
-				oBuf->retrieve(curHeaderLen + curDataLen);
+				int8_t frg = static_cast<int8_t>(frgCnt - i - 1);
+				// full fragments already fill a datagram, they go out alone from the headroom
+				// of oBuf and skip the history
+				if (FrgPktHeader::kLen + curDataLen >= mss_)
+				{
+					FrgPktHeader::Write(oBuf->reservePrepend(FrgPktHeader::kLen), frgPktType, nextSndSn_++,
+						static_cast<int8_t>(frgCnt), frg, static_cast<int16_t>(curDataLen));
+					OutputDatagram(oBuf->peek(), FrgPktHeader::kLen + curDataLen);
+					oBuf->retrieve(FrgPktHeader::kLen + curDataLen);
+				}
+				else
+				{
+					assert(i == frgCnt - 1);
+					OutputPkt<FrgPktHeader>(oBuf, frgPktType, static_cast<int8_t>(frgCnt), frg, curDataLen);
+				}
 				curLen -= curDataLen;
 			}
 			assert(curLen == 0);
 			assert(oBuf->readableBytes() == 0);
-
-			HandleFlush(oBuf, frgCnt);
 		}
 		else /*if(pktType != kUnreliable)*/
 		{
-			oBuf->prependInt16(static_cast<int16_t>(curLen));
-			oBuf->prependInt32(nextSndSn_++);
-			oBuf->prependInt8(static_cast<int8_t>(pktType));
-			outputPktDeque_.emplace_back(std::string(oBuf->peek(), kReliableHeaderLen + curLen));
-			oBuf->retrieveAll();
-
-			HandleFlush(oBuf);
+			OutputPkt<ReliablePktHeader>(oBuf, static_cast<int8_t>(pktType), 0, 0, curLen);
 		}
 		return 0;
 	}
@@ -652,61 +1218,36 @@ public:
 		bool hasDataLeftThisRound = ParsePkt(iBuf, pktType, rcvSn, rcvFrgCnt, rcvFrg, dataLen);
 		if (hasDataLeftThisRound)
 		{
-			auto discardRcvedData = [&]() { iBuf->retrieve(dataLen); len = 0; };
 			isThisRoundFinished_ = false;
+			len = 0;
 
-			if (pktType == static_cast<PktTypeE>(kUnreliable))
+			if ((pktType == static_cast<PktTypeE>(kUnreliable) || pktType == kPshFrg) && rcvFrgCnt > 1)
 			{
-				if (rcvSn >= nextRcvSn_)
-				{
+				// fragments of the msg being reassembled may come late or out of order,
+				// the reassembly dedups them by slot instead of by nextRcvSn_
+				bool isNewPkt = rcvSn >= nextRcvSn_;
+				if (isNewPkt)
 					nextRcvSn_ = rcvSn + 1;
-
-					if (rcvFrgCnt == 1)
-						rcvFunc_(userBuf, len, dataLen, pktType);
-					else
-					{
-						if (rcvFrg != 0)
-						{
-							bool isHeadFrg = (rcvFrg == rcvFrgCnt - 1);
-							if (isHeadFrg)
-								inputFrgMap_.clear();
-
-							if (isHeadFrg || inputFrgMap_.find(rcvSn - 1) != inputFrgMap_.end())
-								inputFrgMap_.emplace(std::make_pair(
-									rcvSn, std::string(iBuf->peek(), dataLen)));
-
-							discardRcvedData();
-						}
-						else if (rcvFrg == 0)
-						{
-							if (inputFrgMap_.find(rcvSn - 1) != inputFrgMap_.end())
-							{
-								int sumDataLen = dataLen;
-								for (int sn = rcvSn - 1; sn >= rcvSn - rcvFrgCnt + 1; --sn)
-								{
-									iBuf->prepend(inputFrgMap_[sn]);
-									sumDataLen += static_cast<int>(inputFrgMap_[sn].size());
-								}
-								rcvFunc_(userBuf, len, sumDataLen, pktType);
-							}
-							else
-								discardRcvedData();
-						}
-					} /*if (rcvFrgCnt > 1)*/
+				if ((isNewPkt || frgReassembly_.IsPending(rcvSn, rcvFrgCnt, rcvFrg))
+					&& frgReassembly_.Add(rcvSn, rcvFrgCnt, rcvFrg, iBuf->peek(), dataLen))
+				{
+					rcvFunc_(userBuf, len, frgReassembly_.Data(), static_cast<int>(frgReassembly_.Len()),
+						pktType == kPshFrg ? kPsh : pktType);
+					frgReassembly_.Release();
 				}
-				else if (rcvSn < nextRcvSn_)
-					discardRcvedData();
 			}
-			else /*if (pktType != kUnreliable)*/
+			else if (rcvSn >= nextRcvSn_)
 			{
-				if (rcvSn >= nextRcvSn_)
-				{
-					nextRcvSn_ = rcvSn + 1;
-					rcvFunc_(userBuf, len, dataLen, pktType);
-				}
-				else
-					discardRcvedData();
+				nextRcvSn_ = rcvSn + 1;
+				rcvFunc_(userBuf, len, iBuf->peek(), dataLen, pktType);
+			}
+			else if (pktType == kStatePkt)
+			{
+				// a late state packet may still hold the newest update of its keys,
+				// the receiver drops the superseded ones key by key
+				rcvFunc_(userBuf, len, iBuf->peek(), dataLen, pktType);
 			}
+			iBuf->retrieve(dataLen);
 		}
 		else if (!hasDataLeftThisRound)
 		{
@@ -717,92 +1258,150 @@ public:
 		return hasDataLeftThisRound;
 	}
 
+	// send a PMTU probe padded up to `probeMtu` bytes at the IP level.
+	// probes bypass the redundancy history, a lost probe must not drag
+	// a full-size datagram along with every following packet.
+	void OutputProbe(Buf* oBuf, size_t probeMtu)
+	{
+		assert(probeMtu - kIpUdpHeaderLen <= kMaxMSS);
+		assert(oBuf->readableBytes() == 0);
+		size_t dataLen = probeMtu - kIpUdpHeaderLen - kReliableHeaderLen;
+		oBuf->appendInt16(static_cast<int16_t>(probeMtu));
+		oBuf->ensureWritableBytes(dataLen - kDataLen);
+		std::fill(oBuf->beginWrite(), oBuf->beginWrite() + (dataLen - kDataLen), 0);
+		oBuf->hasWritten(dataLen - kDataLen);
+		ReliablePktHeader::Write(oBuf->reservePrepend(ReliablePktHeader::kLen), static_cast<int8_t>(kMtuProbe),
+			nextSndSn_++, 0, 0, static_cast<int16_t>(dataLen));
+		FlushOutputBuffer(oBuf);
+	}
+
 	bool IsThisRoundFinished() const { return isThisRoundFinished_; }
 
-	void Switch(bool on) { on_ = on; }
+	// fills the datagram, redundancy and reassembly counters
+	void GetStats(KcpSessionStats& stats) const
+	{
+		stats.datagramsOut_ = datagramsOut_;
+		stats.datagramBytesOut_ = datagramBytesOut_;
+		stats.redundantBytesOut_ = redundantBytesOut_;
+		stats.reassemblyDrops_ = frgReassembly_.DropCnt();
+		stats.rdcOn_ = on_;
+	}
+
+	// the history is allocated the first time redundancy is switched on,
+	// a session that never needs it sends every packet straight from oBuf
+	void Switch(bool on)
+	{
+		if (on != on_)
+			IKCP_PROBE2(kcpp, rdc_switch, this, static_cast<int>(on));
+		on_ = on;
+		if (on_ && !history_.IsAllocated())
+			history_.Resize(mss_);
+	}
 
 	void SetMTU(size_t mtu)
-	{ assert(mtu - 28 <= kMaxMSS); mss_ = mtu - 28; }
+	{
+		assert(mtu - kIpUdpHeaderLen <= kMaxMSS);
+		mss_ = mtu - kIpUdpHeaderLen;
+		if (history_.IsAllocated())
+			history_.Resize(mss_);
+	}
+
+	// datagrams longer than any sent at the base `mtu`, kcp filling its mss and the rdc header
+	// on top, are counted by FullSizeDatagramsOut(). they are what a raised path mtu carries
+	void SetBaseMTU(size_t mtu)
+	{ baseDatagramLen_ = mtu - kIpUdpHeaderLen + kReliableHeaderLen; }
+
+	uint64_t FullSizeDatagramsOut() const { return fullSizeDatagramsOut_; }
+
+	// bytes every reliable datagram spends below the kcp segment
+	static size_t ReliableOverhead() { return kIpUdpHeaderLen + kReliableHeaderLen; }
+
+public:
+	static const size_t kIpUdpHeaderLen = 28;
+	static const size_t kMaxMTU = 1500;
 
 private:
 
+	void OutputDatagram(const char* data, size_t len)
+	{
+		++datagramsOut_;
+		datagramBytesOut_ += len;
+		if (len > baseDatagramLen_)
+			++fullSizeDatagramsOut_;
+		userOutputFunc_(data, static_cast<int>(len));
+	}
+
 	void FlushOutputBuffer(Buf* oBuf)
 	{
-		userOutputFunc_(oBuf->peek(), static_cast<int>(oBuf->readableBytes()));
+		OutputDatagram(oBuf->peek(), oBuf->readableBytes());
 		oBuf->retrieveAll();
 	}
 
-	void HandleFlush(Buf* oBuf, size_t frgCnt = 1)
+	// header and the first `dataLen` bytes of oBuf as one packet, written straight into the history.
+	// a packet filling a datagram has no room for previous ones and isn't carried by later ones,
+	// it goes out alone from the headroom of oBuf, as does every packet while there is no history
+	template <typename PktHeader>
+	void OutputPkt(Buf* oBuf, int8_t pktType, int8_t frgCnt, int8_t frg, size_t dataLen)
 	{
-		if (frgCnt > 1)
+		size_t pktLen = PktHeader::kLen + dataLen;
+		if (!history_.IsAllocated() || pktLen >= mss_)
 		{
-			for (size_t i = frgCnt; i >= 1; --i)
+			if (on_)
 			{
-				auto curIt = outputPktDeque_.end() - i;
-				if (curIt->size() >= mss_)
-				{
-					oBuf->prepend(*curIt);
-					FlushOutputBuffer(oBuf);
-					outputPktDeque_.erase(curIt);
-				}
-				else
-				{
-					assert(i == 1);
-					HandleDynamicRdc(oBuf, *curIt);
-				}
+				IKCP_PROBE4(kcpp, rdc_flush, this, 1, pktLen, pktLen);
+				history_.PopFront(history_.Count()); // later packets reach back no further than this one
 			}
+			PktHeader::Write(oBuf->reservePrepend(PktHeader::kLen), pktType, nextSndSn_++,
+				frgCnt, frg, static_cast<int16_t>(dataLen));
+			OutputDatagram(oBuf->peek(), pktLen);
+			oBuf->retrieve(pktLen);
+			return;
 		}
-		else if (frgCnt == 1)
-		{
-			HandleDynamicRdc(oBuf, outputPktDeque_.back());
-		}
+		char* pkt = history_.Reserve(pktLen);
+		PktHeader::Write(pkt, pktType, nextSndSn_++, frgCnt, frg, static_cast<int16_t>(dataLen));
+		memcpy(pkt + PktHeader::kLen, oBuf->peek(), dataLen);
+		KCPP_COUNT_COPY(dataLen);
+		history_.Commit(pktLen);
+		oBuf->retrieve(dataLen);
+		HandleDynamicRdc();
 	}
 
-	void HandleDynamicRdc(Buf* oBuf, const std::string& pendingSndData)
+	// sends the latest packet, along with as many previous ones as fit in mss when rdc is on.
+	// the history keeps about one mss of the latest packets either way, ready for rdc switching on.
+	void HandleDynamicRdc()
 	{
-		// PrependPrePktAndFlush(oBuf); return;
-
+		size_t latestPktLen = history_.LenFromBack(0);
 		if (on_)
-			PrependPrePktAndFlush(oBuf);
-		else
 		{
-			oBuf->prepend(pendingSndData);
-			FlushOutputBuffer(oBuf);
-
-			if (pendingSndData.size() >= mss_)
-				outputPktDeque_.pop_back();
-
-			size_t sumPktLen = 0;
-			for (auto it = outputPktDeque_.end() - 1; it != outputPktDeque_.begin(); --it)
+			size_t pktCnt = 1;
+			size_t sumPktLen = latestPktLen;
+			for (; pktCnt < history_.Count(); ++pktCnt)
 			{
-				sumPktLen += it->size();
-				if (sumPktLen > mss_)
+				size_t prePktLen = history_.LenFromBack(pktCnt);
+				if (sumPktLen + prePktLen >= mss_)
 				{
-					outputPktDeque_.erase(outputPktDeque_.begin(), it);
+					history_.PopFront(history_.Count() - pktCnt);
 					break;
 				}
+				sumPktLen += prePktLen;
 			}
+			IKCP_PROBE4(kcpp, rdc_flush, this, pktCnt, sumPktLen, latestPktLen);
+			OutputDatagram(history_.Back(sumPktLen), sumPktLen);
+			redundantBytesOut_ += sumPktLen - latestPktLen;
 		}
-	}
-
-	void PrependPrePktAndFlush(Buf* oBuf)
-	{
-		for (size_t i = 1; i <= outputPktDeque_.size(); ++i)
+		else
 		{
-			auto curIt = outputPktDeque_.end() - i;
-			bool isFront = curIt == outputPktDeque_.begin();
-			oBuf->prepend(*curIt);
+			OutputDatagram(history_.Back(latestPktLen), latestPktLen);
 
-			size_t prePktDataLen = 0;
-			if (!isFront)
-				prePktDataLen = (curIt - 1)->size();
-
-			if ((oBuf->readableBytes() + prePktDataLen >= mss_) || isFront)
+			size_t sumPktLen = 0;
+			for (size_t i = 0; i + 1 < history_.Count(); ++i)
 			{
-				if (oBuf->readableBytes() + prePktDataLen >= mss_)
-					outputPktDeque_.erase(outputPktDeque_.begin(), curIt);
-				FlushOutputBuffer(oBuf);
-				break;
+				sumPktLen += history_.LenFromBack(i);
+				if (sumPktLen > mss_)
+				{
+					history_.PopFront(history_.Count() - 1 - i);
+					break;
+				}
 			}
 		}
 	}
@@ -831,15 +1430,16 @@ private:
 					if (dataLen <= static_cast<int16_t>(curDataLenLimit))
 						hasDataLeftThisRound = iBuf->readableBytes() >= static_cast<size_t>(dataLen);
 				}};
-			if (pktType == static_cast<PktTypeE>(kUnreliable))
+			if (pktType == static_cast<PktTypeE>(kUnreliable) || pktType == kPshFrg)
 			{
 				rcvFrgCnt = iBuf->readInt8();
 				if (rcvFrgCnt > 1 && static_cast<size_t>(rcvFrgCnt) <= kMaxFrgCnt)
 				{
 					rcvFrg = iBuf->readInt8();
-					checkDataLenFunc(kUnreliable);
+					if (rcvFrg >= 0 && rcvFrg < rcvFrgCnt)
+						checkDataLenFunc(kUnreliable);
 				}
-				else if (rcvFrgCnt == 1)
+				else if (rcvFrgCnt == 1 && pktType != kPshFrg)
 					checkDataLenFunc(kUnreliable, true);
 			}
 			else
@@ -864,48 +1464,717 @@ private:
 	static const size_t kUnreliableHeaderLen = kPktTypeLen + kSnLen + kFrgCntLen + kFrgLen + kDataLen;
 	static const size_t kUnreliableDataLenLimit = kMaxMSS - kUnreliableHeaderLen;
 
-	RecvFuncion rcvFunc_;
-	UserOutputFunction userOutputFunc_;
-	std::deque<std::string> outputPktDeque_;
-	std::unordered_map<int, std::string> inputFrgMap_;
-	int32_t nextSndSn_;
-	int32_t nextRcvSn_;
-	bool isThisRoundFinished_;
-	bool on_;
-	size_t mss_;
-};
+public:
+	// the most Output() prepends in front of the data, the prepend reserve a Buf fed to Rdc needs
+	static const size_t kMaxHeaderLen = kUnreliableHeaderLen;
 
+private:
 
+	// header layouts, fields in network endian :
+	// reliable               | pktType(1) | sn(4) | dataLen(2) |
+	// unreliable             | pktType(1) | sn(4) | frgCnt(1) | dataLen(2) |
+	// unreliable fragment    | pktType(1) | sn(4) | frgCnt(1) | frg(1) | dataLen(2) |
+	// a header is assembled on the stack and stored in one go
+	template <size_t kFrgFieldsLen>
+	struct PktHeader
+	{
+		static const size_t kLen = kPktTypeLen + kSnLen + kFrgFieldsLen + kDataLen;
 
+		static void Write(char* dst, int8_t pktType, int32_t sn, int8_t frgCnt, int8_t frg, int16_t dataLen)
+		{
+			char header[kLen];
+			int32_t be32 = htobe32(sn);
+			int16_t be16 = htobe16(dataLen);
+			header[0] = pktType;
+			::memcpy(header + kPktTypeLen, &be32, sizeof be32);
+			if (kFrgFieldsLen >= kFrgCntLen)
+				header[kPktTypeLen + kSnLen] = frgCnt;
+			if (kFrgFieldsLen >= kFrgCntLen + kFrgLen)
+				header[kPktTypeLen + kSnLen + kFrgCntLen] = frg;
+			::memcpy(header + kLen - kDataLen, &be16, sizeof be16);
+			::memcpy(dst, header, kLen);
+		}
+	};
+	typedef PktHeader<0> ReliablePktHeader;
+	typedef PktHeader<kFrgCntLen> UnfrgedPktHeader;
+	typedef PktHeader<kFrgCntLen + kFrgLen> FrgPktHeader;
+	static_assert(ReliablePktHeader::kLen == kReliableHeaderLen, "reliable header layout");
+	static_assert(FrgPktHeader::kLen == kUnreliableHeaderLen, "unreliable header layout");
+
+	// the latest output packets, stored back to back in a buffer sized from the mss so that
+	// the latest n packets are one contiguous range, a redundant datagram is then
+	// handed to the output function as is. the kept packets are moved back to the
+	// front when the tail runs out of room, they are about one mss at most.
+	class History
+	{
+	public:
+		History() : begin_(0), end_(0), first_(0), cnt_(0) {}
+
+		bool IsAllocated() const { return !buf_.empty(); }
+
+		// (re)sizes the buffer for packets below `mss`, keeping the latest packets that fit
+		void Resize(size_t mss)
+		{
+			size_t capacity = kCapacityInMss * mss;
+			size_t maxPktCnt = 1;
+			while (maxPktCnt < capacity / kReliableHeaderLen)
+				maxPktCnt <<= 1;
+			while (cnt_ > 0 && end_ - begin_ + mss > capacity / 2)
+				PopFront(1);
+
+			std::vector<char> buf(capacity);
+			std::vector<uint16_t> lens(maxPktCnt);
+			if (cnt_ > 0)
+				memcpy(&buf[0], &buf_[begin_], end_ - begin_);
+			for (size_t i = 0; i < cnt_; ++i)
+				lens[i] = lens_[(first_ + i) & (lens_.size() - 1)];
+			buf_.swap(buf);
+			lens_.swap(lens);
+			end_ -= begin_;
+			begin_ = 0;
+			first_ = 0;
+		}
 
-class KcpSession
-{
-public:
-	KcpSession(const RoleTypeE role,
-		const UserOutputFunction& userOutputFunc,
-		const UserInputFunction& userInputFunc,
-		const CurrentTimestampMsFunction& currentTimestampMsFunc)
-		:
-		role_(role),
-		conv_(0),
-		userInputFunc_(userInputFunc),
-		curTsMsFunc_(currentTimestampMsFunc),
-		kcp_(nullptr),
-		curConnState_(kConnecting),
-		rdc_(userOutputFunc, std::bind(&KcpSession::DoRecv, this, std::placeholders::_1,
-			std::placeholders::_2, std::placeholders::_3, std::placeholders::_4)),
-		nextUpdateTs_(0),
-		hasDataLeft_(false),
-		sndWnd_(128),
-		rcvWnd_(128),
-		waitSndCntLimit_(4 * sndWnd_),
-		nodelay_(1),
+		// room for a packet of `len` bytes at the tail, Commit() it once written
+		char* Reserve(size_t len)
+		{
+			if (end_ + len > buf_.size())
+			{
+				memmove(&buf_[0], &buf_[begin_], end_ - begin_);
+				end_ -= begin_;
+				begin_ = 0;
+			}
+			assert(end_ + len <= buf_.size());
+			return &buf_[end_];
+		}
+
+		void Commit(size_t len)
+		{
+			assert(cnt_ < lens_.size());
+			lens_[(first_ + cnt_++) & (lens_.size() - 1)] = static_cast<uint16_t>(len);
+			end_ += len;
+		}
+
+		size_t Count() const { return cnt_; }
+
+		// len of the i-th latest packet, 0 for the latest
+		size_t LenFromBack(size_t i) const
+		{ assert(i < cnt_); return lens_[(first_ + cnt_ - 1 - i) & (lens_.size() - 1)]; }
+
+		// the latest packets summing up to `len` bytes
+		const char* Back(size_t len) const { assert(len <= end_ - begin_); return &buf_[end_ - len]; }
+
+		void PopFront(size_t n)
+		{
+			assert(n <= cnt_);
+			for (; n > 0; --n, --cnt_)
+				begin_ += lens_[first_++ & (lens_.size() - 1)];
+			if (cnt_ == 0)
+				begin_ = end_ = 0;
+		}
+
+	private:
+		// packets are below mss and the kept ones stay below two mss, half the buffer.
+		// every packet has at least a reliable header, which bounds their count
+		static const size_t kCapacityInMss = 4;
+
+		std::vector<char> buf_;
+		std::vector<uint16_t> lens_; // a power of 2 of them
+		size_t begin_;
+		size_t end_;
+		size_t first_;
+		size_t cnt_;
+	};
+
+	// reassembly of one fragmented msg at a time. every fragment is copied once, into
+	// its slot of an arena sized for the msg's fragments, in whatever order they come,
+	// and the whole msg is handed over from the arena in one piece. the arena is a pooled
+	// Buf chunk held only while a msg is pending or handed over.
+	// a fragment of a newer msg drops the pending one, as unreliable msgs do.
+	class FrgReassembly
+	{
+	public:
+		FrgReassembly() : arena_(0, 0), baseSn_(0), frgCnt_(0), rcvedCnt_(0), frgLen_(0), lastFrgLen_(0), dropCnt_(0) {}
+
+		// is it a missing fragment of the pending msg
+		bool IsPending(int32_t sn, int frgCnt, int frg) const
+		{
+			return frgCnt_ > 0 && frgCnt == frgCnt_ && BaseSn(sn, frgCnt, frg) == baseSn_
+				&& !IsRcved(frgCnt - 1 - frg);
+		}
+
+		// returns true once the msg is complete, Data() and Len() are then valid till Release()
+		// or the next Add()
+		bool Add(int32_t sn, int frgCnt, int frg, const char* data, size_t len)
+		{
+			assert(frgCnt > 1 && frg < frgCnt && len <= kUnreliableDataLenLimit);
+			int32_t baseSn = BaseSn(sn, frgCnt, frg);
+			if (frgCnt != frgCnt_ || baseSn != baseSn_)
+			{
+				if (frgCnt_ > 0 && baseSn - baseSn_ < 0)
+					return false; // a late fragment of a dropped msg
+				if (frgCnt_ > 0)
+					CountDrop(0); // a newer msg takes over the pending one
+				Reset(baseSn, frgCnt);
+			}
+
+			size_t slot = static_cast<size_t>(frgCnt - 1 - frg);
+			if (IsRcved(slot))
+				return false;
+			// all but the last fragment are of the same len, the last one is no longer
+			if (frg != 0)
+			{
+				if (frgLen_ == 0 && len > 0 && len >= lastFrgLen_)
+					frgLen_ = len;
+				if (len != frgLen_)
+				{
+					CountDrop(1); // malformed, drop the msg
+					frgCnt_ = 0;
+					Release();
+					return false;
+				}
+			}
+			else
+			{
+				if (frgLen_ > 0 && len > frgLen_)
+				{
+					CountDrop(1);
+					frgCnt_ = 0;
+					Release();
+					return false;
+				}
+				lastFrgLen_ = len;
+			}
+
+			char* arena = arena_.beginWrite();
+			memcpy(arena + slot * kUnreliableDataLenLimit, data, len);
+			KCPP_COUNT_COPY(len);
+			rcvedBitmap_[slot / 32] |= 1u << (slot % 32);
+			if (++rcvedCnt_ < frgCnt_)
+				return false;
+
+			// slots are kUnreliableDataLenLimit apart, close the gaps left by shorter fragments
+			if (frgLen_ < kUnreliableDataLenLimit)
+				for (size_t i = 1; i < static_cast<size_t>(frgCnt_); ++i)
+				{
+					size_t len = i + 1 < static_cast<size_t>(frgCnt_) ? frgLen_ : lastFrgLen_;
+					memmove(arena + i * frgLen_, arena + i * kUnreliableDataLenLimit, len);
+					KCPP_COUNT_COPY(len);
+				}
+			frgCnt_ = 0;
+			arena_.hasWritten(Len());
+			return true;
+		}
+
+		const char* Data() const { return arena_.peek(); }
+		size_t Len() const { return frgLen_ * (rcvedCnt_ - 1) + lastFrgLen_; }
+		uint64_t DropCnt() const { return dropCnt_; }
+
+		// gives the arena back once the complete msg is handed over
+		void Release() { arena_.retrieveAll(); }
+
+	private:
+		static int32_t BaseSn(int32_t sn, int frgCnt, int frg) { return sn - (frgCnt - 1 - frg); }
+
+		// the pending msg is given up, `reason` 0 : a newer msg took over, 1 : malformed
+		void CountDrop(int reason)
+		{
+			IKCP_PROBE4(kcpp, fragment_drop, baseSn_, frgCnt_, rcvedCnt_, reason);
+			++dropCnt_;
+		}
+
+		bool IsRcved(size_t slot) const { return (rcvedBitmap_[slot / 32] >> (slot % 32)) & 1u; }
+
+		void Reset(int32_t baseSn, int frgCnt)
+		{
+			baseSn_ = baseSn;
+			frgCnt_ = frgCnt;
+			rcvedCnt_ = 0;
+			frgLen_ = 0;
+			lastFrgLen_ = 0;
+			memset(rcvedBitmap_, 0, sizeof rcvedBitmap_);
+			// a slot per fragment, kUnreliableDataLenLimit apart
+			arena_.retrieveAll();
+			arena_.ensureWritableBytes(static_cast<size_t>(frgCnt) * kUnreliableDataLenLimit);
+		}
+
+		Buf arena_;
+		uint32_t rcvedBitmap_[kMaxFrgCnt / 32];
+		int32_t baseSn_;
+		int frgCnt_; // 0 for no pending msg
+		int rcvedCnt_;
+		size_t frgLen_;
+		size_t lastFrgLen_;
+		uint64_t dropCnt_;
+	};
+
+	RecvFuncion rcvFunc_;
+	OutputPolicy userOutputFunc_;
+	History history_;
+	FrgReassembly frgReassembly_;
+	uint64_t datagramsOut_;
+	uint64_t datagramBytesOut_;
+	uint64_t redundantBytesOut_;
+	uint64_t fullSizeDatagramsOut_;
+	int32_t nextSndSn_;
+	int32_t nextRcvSn_;
+	bool isThisRoundFinished_;
+	bool on_;
+	size_t mss_;
+	size_t baseDatagramLen_;
+};
+
+typedef std::function<void(Buf*, int&, const char* data, int dataLen, PktTypeE)> RdcRecvFunction;
+typedef BasicRdc<UserOutputFunction, RdcRecvFunction> Rdc;
+
+
+
+// DPLPMTUD-style path mtu search (RFC 8899), driven by the session's Update().
+// probes are binary searched between the confirmed mtu and the upper bound,
+// a probe size counts as failed after kMaxProbes unanswered tries.
+// once done it sleeps kRaiseTimerMs before searching upwards again.
+// on a suspected black hole, or when it is time to confirm it again, the current mtu
+// is re-probed. if the path no longer carries it we fall back to the base mtu and
+// search again from there, as we do when the peer tells us it fell back.
+class Pmtud
+{
+public:
+	static const int kMaxProbes = 3;
+	static const int kSearchGranularity = 16;
+	static const int64_t kRaiseTimerMs = 600 * 1000;
+
+	Pmtud()
+		:
+		state_(kDisabled), stateBeforeConfirming_(kDisabled), baseMtu_(0), maxMtu_(0), mtu_(0), lowMtu_(0), highMtu_(0),
+		probeMtu_(0), probeCnt_(0), probeTimeoutTs_(0), raiseTs_(0)
+	{}
+
+	void Start(int baseMtu, int maxMtu, int64_t now)
+	{
+		assert(baseMtu <= maxMtu);
+		baseMtu_ = baseMtu; maxMtu_ = maxMtu; mtu_ = baseMtu;
+		StartSearch(now);
+	}
+
+	void Stop() { state_ = kDisabled; }
+
+	bool IsOn() const { return state_ != kDisabled; }
+
+	bool IsSearching() const { return state_ == kSearching; }
+
+	int GetMTU() const { return mtu_; }
+
+	int GetBaseMTU() const { return baseMtu_; }
+
+	// returns the probe size to send now, 0 for none
+	int PollProbe(int64_t now, int64_t probeTimeoutMs)
+	{
+		if (state_ == kSearchDone)
+		{
+			if (now < raiseTs_)
+				return 0;
+			StartSearch(now);
+		}
+		if (state_ != kSearching && state_ != kConfirming)
+			return 0;
+
+		if (probeMtu_ != 0 && now < probeTimeoutTs_)
+			return 0;
+		if (probeMtu_ != 0 && probeCnt_ >= kMaxProbes)
+		{
+			if (state_ == kConfirming)
+			{
+				// black hole confirmed, the path shrank under us, search again from the base
+				mtu_ = baseMtu_;
+				StartSearch(now);
+				return 0;
+			}
+			highMtu_ = probeMtu_ - 1;
+			probeMtu_ = 0;
+		}
+		if (probeMtu_ == 0)
+		{
+			if (state_ == kSearching && highMtu_ - lowMtu_ < kSearchGranularity)
+			{
+				FinishSearch(now);
+				return 0;
+			}
+			probeMtu_ = state_ == kConfirming ? mtu_ : (lowMtu_ + highMtu_ + 1) / 2;
+			probeCnt_ = 0;
+		}
+		++probeCnt_;
+		probeTimeoutTs_ = now + probeTimeoutMs;
+		return probeMtu_;
+	}
+
+	// returns true if the confirmed mtu changed
+	bool OnProbeAck(int ackedMtu, int64_t now)
+	{
+		if (probeMtu_ == 0 || ackedMtu != probeMtu_)
+			return false;
+		probeMtu_ = 0;
+		if (state_ == kConfirming)
+		{
+			// false alarm, carry on where we were
+			if (stateBeforeConfirming_ == kSearching)
+				state_ = kSearching;
+			else
+				FinishSearch(now);
+			return false;
+		}
+		if (state_ != kSearching)
+			return false;
+		lowMtu_ = ackedMtu;
+		bool changed = mtu_ != ackedMtu;
+		mtu_ = ackedMtu;
+		return changed;
+	}
+
+	// the peer's path mtu fell back, the path shrank both ways most likely.
+	// returns true if mtu_ was above the base mtu
+	bool OnPeerFallback(int64_t now)
+	{
+		if (state_ == kDisabled || mtu_ <= baseMtu_)
+			return false;
+		mtu_ = baseMtu_;
+		StartSearch(now);
+		return true;
+	}
+
+	// full-sized packets went unanswered, check if the path still carries mtu_
+	void OnBlackHoleSuspected()
+	{
+		if (state_ == kDisabled || state_ == kConfirming || mtu_ <= baseMtu_)
+			return;
+		stateBeforeConfirming_ = state_;
+		state_ = kConfirming;
+		probeMtu_ = 0;
+	}
+
+private:
+	enum StateE { kDisabled, kSearching, kSearchDone, kConfirming };
+
+	void StartSearch(int64_t now)
+	{
+		state_ = kSearching;
+		lowMtu_ = mtu_; highMtu_ = maxMtu_;
+		probeMtu_ = 0; probeCnt_ = 0;
+	}
+
+	void FinishSearch(int64_t now)
+	{
+		state_ = kSearchDone;
+		probeMtu_ = 0; probeCnt_ = 0;
+		raiseTs_ = now + kRaiseTimerMs;
+	}
+
+private:
+	StateE state_;
+	StateE stateBeforeConfirming_;
+	int baseMtu_;
+	int maxMtu_;
+	int mtu_;
+	int lowMtu_;
+	int highMtu_;
+	int probeMtu_;
+	int probeCnt_;
+	int64_t probeTimeoutTs_;
+	int64_t raiseTs_;
+};
+
+
+
+
+// LZ4 in its block format, the one lz4's LZ4_decompress_safe_usingDict() reads, with an optional
+// dictionary: samples of typical msgs both sides share, that the matches of a msg may reach back
+// into. greedy matching through a hash table, about what LZ4_compress_fast() does. a codec serves
+// one thread, it keeps its tables and scratch space from call to call
+class Lz4Codec
+{
+public:
+	static const size_t kMaxDictLen = 64 * 1024; // the longest offset, a longer dict keeps its end
+
+	explicit Lz4Codec(const std::string& dict = std::string())
+		: dictLen_(dict.size() < kMaxDictLen ? dict.size() : kMaxDictLen), dictTable_(kHashCnt, 0), table_(kHashCnt, 0), base_(0)
+	{
+		buf_.assign(dict.end() - dictLen_, dict.end());
+		for (size_t i = 0; i + kMinMatch <= dictLen_; ++i)
+			dictTable_[Hash(&buf_[i])] = static_cast<uint32_t>(i + 1);
+	}
+
+	// compresses `src` into `dst` if it comes out shorter than `len`, returns the compressed
+	// len, 0 if it doesn't. `dst` has room for `len` bytes
+	size_t Compress(const char* src, size_t len, char* dst)
+	{
+		if (len <= kMinInputLen || len > kMaxMsgLen)
+			return 0;
+		if (base_ > 0xffffffffu - kMaxMsgLen - len)
+		{
+			std::fill(table_.begin(), table_.end(), 0);
+			base_ = 0;
+		}
+		buf_.resize(dictLen_);
+		buf_.insert(buf_.end(), src, src + len);
+		KCPP_COUNT_COPY(len);
+		const char* in = &buf_[0];
+		const size_t end = dictLen_ + len;
+		const size_t matchLimit = end - kLastLiterals;
+		const size_t mfLimit = end - kMfLimit;
+		char* op = dst;
+		char* const opEnd = dst + len - 1;
+		size_t anchor = dictLen_;
+		size_t ip = dictLen_;
+		// table_ holds base_ + pos + 1 of this call's positions, older ones are below base_
+		const uint32_t base = base_ - static_cast<uint32_t>(dictLen_);
+		base_ += static_cast<uint32_t>(len + 1);
+
+		while (ip < mfLimit)
+		{
+			uint32_t h = Hash(in + ip);
+			size_t match = 0;
+			bool isFound = false;
+			uint32_t entry = table_[h];
+			table_[h] = base + static_cast<uint32_t>(ip) + 1;
+			if (entry > base + dictLen_ && (match = entry - base - 1) < ip && ip - match <= kMaxOffset
+				&& Read32(in + match) == Read32(in + ip))
+				isFound = true;
+			else if (dictTable_[h] != 0 && (match = dictTable_[h] - 1, ip - match <= kMaxOffset)
+				&& Read32(in + match) == Read32(in + ip))
+				isFound = true;
+			if (!isFound)
+			{
+				ip += 1 + ((ip - anchor) >> kSkipShift);
+				continue;
+			}
+
+			while (ip > anchor && match > 0 && in[ip - 1] == in[match - 1])
+			{
+				--ip;
+				--match;
+			}
+			size_t matchLen = kMinMatch;
+			while (ip + matchLen < matchLimit && in[ip + matchLen] == in[match + matchLen])
+				++matchLen;
+
+			size_t literalLen = ip - anchor;
+			if (op + 1 + literalLen / 255 + 1 + literalLen + 2 + (matchLen - kMinMatch) / 255 + 1 > opEnd)
+				return 0;
+			char* token = op++;
+			op = WriteLen(op, token, literalLen, 4);
+			memcpy(op, in + anchor, literalLen);
+			op += literalLen;
+			size_t offset = ip - match;
+			*op++ = static_cast<char>(offset);
+			*op++ = static_cast<char>(offset >> 8);
+			op = WriteLen(op, token, matchLen - kMinMatch, 0);
+
+			ip += matchLen;
+			anchor = ip;
+			if (ip - 2 >= dictLen_ && ip < mfLimit)
+				table_[Hash(in + ip - 2)] = base + static_cast<uint32_t>(ip - 2) + 1;
+		}
+
+		size_t literalLen = end - anchor;
+		if (op + 1 + literalLen / 255 + 1 + literalLen > opEnd)
+			return 0;
+		char* token = op++;
+		op = WriteLen(op, token, literalLen, 4);
+		memcpy(op, in + anchor, literalLen);
+		return static_cast<size_t>(op + literalLen - dst);
+	}
+
+	// decompresses `src` into `dst`, which takes exactly `dstLen` bytes. false if malformed
+	bool Decompress(const char* src, size_t len, char* dst, size_t dstLen)
+	{
+		if (dstLen > kMaxMsgLen)
+			return false;
+		buf_.resize(dictLen_ + dstLen);
+		char* const out = &buf_[0];
+		size_t op = dictLen_;
+		const size_t end = dictLen_ + dstLen;
+		const char* ip = src;
+		const char* const ipEnd = src + len;
+		for (;;)
+		{
+			if (ip == ipEnd)
+				return false;
+			uint8_t token = static_cast<uint8_t>(*ip++);
+			size_t literalLen = token >> 4;
+			if (literalLen == 15 && !ReadLen(ip, ipEnd, literalLen))
+				return false;
+			if (literalLen > static_cast<size_t>(ipEnd - ip) || literalLen > end - op)
+				return false;
+			memcpy(out + op, ip, literalLen);
+			ip += literalLen;
+			op += literalLen;
+			if (ip == ipEnd)
+				break; // the last sequence has no match
+			if (ipEnd - ip < 2)
+				return false;
+			size_t offset = static_cast<uint8_t>(ip[0]) | (static_cast<size_t>(static_cast<uint8_t>(ip[1])) << 8);
+			ip += 2;
+			size_t matchLen = token & 15;
+			if (matchLen == 15 && !ReadLen(ip, ipEnd, matchLen))
+				return false;
+			matchLen += kMinMatch;
+			if (offset == 0 || offset > op || matchLen > end - op)
+				return false;
+			if (offset >= matchLen)
+				memcpy(out + op, out + op - offset, matchLen);
+			else // overlaps what it writes, a short offset repeats the bytes it just wrote
+				for (size_t match = op - offset, i = 0; i < matchLen; ++i)
+					out[op + i] = out[match + i];
+			op += matchLen;
+		}
+		if (op != end)
+			return false;
+		memcpy(dst, out + dictLen_, dstLen);
+		KCPP_COUNT_COPY(dstLen);
+		return true;
+	}
+
+private:
+	static const size_t kMinMatch = 4;
+	static const size_t kLastLiterals = 5; // the format ends on literals
+	static const size_t kMfLimit = 12; // no match starts closer to the end
+	static const size_t kMinInputLen = kMfLimit;
+	static const size_t kMaxOffset = 65535;
+	static const size_t kMaxMsgLen = 1 << 30;
+	static const size_t kSkipShift = 6; // the longer without a match, the farther it jumps
+	static const int kHashBits = 12;
+	static const size_t kHashCnt = 1 << kHashBits;
+
+	static uint32_t Read32(const char* p)
+	{
+		uint32_t v;
+		memcpy(&v, p, sizeof v);
+		return v;
+	}
+
+	static uint32_t Hash(const char* p) { return (Read32(p) * 2654435761u) >> (32 - kHashBits); }
+
+	// a len's 4 bits in the token at `shift`, the rest in 255s after `op`
+	static char* WriteLen(char* op, char* token, size_t len, int shift)
+	{
+		if (shift == 4)
+			*token = 0;
+		if (len < 15)
+		{
+			*token = static_cast<char>(*token | (len << shift));
+			return op;
+		}
+		*token = static_cast<char>(*token | (15 << shift));
+		for (len -= 15; len >= 255; len -= 255)
+			*op++ = static_cast<char>(255);
+		*op++ = static_cast<char>(len);
+		return op;
+	}
+
+	static bool ReadLen(const char*& ip, const char* ipEnd, size_t& len)
+	{
+		uint8_t byte = 0;
+		do
+		{
+			if (ip == ipEnd || len > kMaxMsgLen)
+				return false;
+			byte = static_cast<uint8_t>(*ip++);
+			len += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	size_t dictLen_;
+	std::vector<uint32_t> dictTable_; // dict pos + 1, 0 : none
+	std::vector<uint32_t> table_;
+	uint32_t base_;
+	std::vector<char> buf_; // the dict, then the msg being compressed or decompressed
+};
+
+// servers hand out convs from one counter, whatever the session type.
+// settable, e.g. for a replay to hand out the conv a capture was made with
+inline IUINT32& NextKcpConv()
+{
+	static IUINT32 nextConv = 666;
+	return nextConv;
+}
+
+inline IUINT32 NewKcpConv() { return NextKcpConv()++; }
+
+// the policies are called as :
+// - OutputPolicy : void(const void* data, int len), sends a datagram
+// - InputPolicy : UserInputData(), polls a datagram, len_ below zero for error
+// - ClockPolicy : int64_t(), current timestamp in ms
+// and held by value. functors with inline call operators take the indirect calls off the
+// per packet path, KcpSession instantiates it with std::function for runtime callbacks.
+template <typename OutputPolicy, typename InputPolicy, typename ClockPolicy>
+class BasicKcpSession
+{
+private:
+	// Rdc hands packets straight to DoRecv()
+	struct RdcReceiver
+	{
+		explicit RdcReceiver(BasicKcpSession* session) : session_(session) {}
+		void operator()(Buf* userBuf, int& len, const char* data, int dataLen, PktTypeE pktType) const
+		{ session_->DoRecv(userBuf, len, data, dataLen, pktType); }
+		BasicKcpSession* session_;
+	};
+	typedef BasicRdc<OutputPolicy, RdcReceiver> RdcType;
+
+public:
+	BasicKcpSession(const RoleTypeE role,
+		const OutputPolicy& userOutputFunc,
+		const InputPolicy& userInputFunc,
+		const ClockPolicy& currentTimestampMsFunc)
+		:
+		role_(role),
+		conv_(0),
+		userInputFunc_(userInputFunc),
+		curTsMsFunc_(currentTimestampMsFunc),
+		kcp_(nullptr),
+		curConnState_(kConnecting),
+		outputBuf_(Buf::kInitialSize, RdcType::kMaxHeaderLen),
+		inputBuf_(Buf::kInitialSize, RdcType::kMaxHeaderLen),
+		rdc_(userOutputFunc, RdcReceiver(this)),
+		rdcMode_(kRdcDynamic),
+		nextUpdateTs_(0),
+		hasDataLeft_(false),
+		sndWnd_(128),
+		rcvWnd_(128),
+		waitSndCntLimit_(4 * sndWnd_),
+		nodelay_(1),
 		interval_(10),
 		fastresend_(1),
 		nocwnd_(1),
 		streamMode_(0),
 		mtu_(548),
-		rx_minrto_(10)
+		rx_minrto_(10),
+		pmtudOn_(false),
+		pmtudBaseMtu_(576),
+		pmtudMaxMtu_(static_cast<int>(RdcType::kMaxMTU)),
+		appliedMtu_(0),
+		pmtudAnsweredDatagrams_(0),
+		pmtudConfirmTs_(0),
+		intervalMin_(1),
+		intervalMax_(0),
+		ackEvery_(0),
+		ackDelay_(0),
+		coalesceOn_(false),
+		coalesceDelay_(2),
+		coalesceMaxBytes_(0),
+		streams_(1, Stream(0)),
+		streamOrder_(1, 0),
+		isMergingPsh_(false),
+		lastRcvStream_(0),
+		lastRcvMode_(kUnreliable),
+		lastRcvKey_(0),
+		stateSndSeq_(0),
+		pendingStateCnt_(0),
+		nextStateSweepTs_(0),
+		stats_(),
+		traceMask_(0),
+		compressMinLen_(0),
+		metrics_(nullptr),
+		nextMetricsTs_(0)
 	{
 		if (IsClient() && !IsConnected())
 			for (int i = 6; i > 0; --i)
@@ -917,13 +2186,23 @@ public:
 	// for Application-level Congestion Control
 	bool CheckCanSend() const
 	{
-		return (kcp_ ? ikcp_waitsnd(kcp_) < waitSndCntLimit_ : true)
-			&& (static_cast<int>(pendingSndDataDeque_.size()) < waitSndCntLimit_);
+		int waitSnd = 0;
+		for (const Stream& stream : streams_)
+			if (stream.kcp_)
+				waitSnd += ikcp_waitsnd(stream.kcp_);
+		return waitSnd < waitSndCntLimit_
+			&& (static_cast<int>(pendingSndDataDeque_.size() + pendingStreamSndDeque_.size()) < waitSndCntLimit_);
 	}
 
 	// returns below zero for error
-	int Send(const void* data, int len, TransmitModeE transmitMode = kReliable)
-	{ return SendImpl(data, len, transmitMode); }
+	// `ttlMs` > 0 : a reliable msg not yet delivered after `ttlMs` is given up and
+	// skipped by the peer instead of being retransmitted. ignored in stream mode, for unreliable
+	// msgs and for msgs queued before connected. the peer should be built with this kcpp version
+	// kReliableUnordered : reliable, handed to the peer's Recv() as soon as all of its fragments
+	// are in, ahead of earlier msgs held up by a loss. ordered in stream mode and when queued
+	// before connected. RecvBatch() tells it as kReliable. the peer should be built with this kcpp version
+	int Send(const void* data, int len, TransmitModeE transmitMode = kReliable, int ttlMs = 0)
+	{ return SendImpl(0, data, len, transmitMode, ttlMs); }
 
 	// update then returns next update timestamp in ms or returns below zero for error
 	int64_t Update() { return UpdateImpl(); }
@@ -931,6 +2210,13 @@ public:
 	// returns Is-Any-Data-Left, len below zero for error
 	bool Recv(Buf* userBuf, int& len) { return RecvImpl(userBuf, len); }
 
+	// polls the input till it has nothing left and appends every ready msg to `userBuf`
+	// back to back, up to `maxMsgCnt` of them described in `msgs`. returns the msg count,
+	// the views stay valid till `userBuf` is written or retrieved.
+	// `err` below zero for error, as Recv()'s len, the msgs before it are still returned
+	int RecvBatch(Buf* userBuf, RecvMsgView* msgs, int maxMsgCnt, int& err)
+	{ return RecvBatchImpl(userBuf, msgs, maxMsgCnt, err); }
+
 	/// ------ advanced APIs --------
 
 	bool IsServer() const { return role_ == kSrv; }
@@ -946,74 +2232,384 @@ public:
 	// - cli/srv role connected state
 	void setConnectionCallback(KcpSessionConnectionCallback cb) { connectionCallback_ = std::move(cb); }
 
+	// the ttl left to the msg at `idx` of the deque handed to the connection callback on reset,
+	// to send it again with on a new session, 0 if it was sent without one. the msgs already
+	// expired aren't handed back, those expiring since are given 1ms
+	int GetPendingTtlMs(size_t idx) const
+	{
+		assert(idx < pendingSndDeadlines_.size());
+		IUINT32 deadline = pendingSndDeadlines_[idx];
+		if (deadline == 0)
+			return 0;
+		IINT32 left = static_cast<IINT32>(deadline - static_cast<IUINT32>(curTsMsFunc_()));
+		return left > 0 ? static_cast<int>(left) : 1;
+	}
+
 	// should set before Send()
 	void SetConfig(const int mtu = 576, const int sndWnd = 128, const int rcvWnd = 128,
 		const int waitSndCntLimit = 512, const int nodelay = 1, const int interval = 10, const int fastresend = 1,
 		const int nocwnd = 1, const int streamMode = 0, const int rx_minrto = 10)
 	{
 		assert(waitSndCntLimit > sndWnd);
-		rdc_.SetMTU(mtu);
+		rdc_.SetMTU(mtu); rdc_.SetBaseMTU(mtu);
+		mtu_ = mtu - static_cast<int>(RdcType::kIpUdpHeaderLen); pmtudBaseMtu_ = mtu;
 		sndWnd_ = sndWnd; rcvWnd_ = rcvWnd; waitSndCntLimit_ = waitSndCntLimit;
 		nodelay_ = nodelay; interval_ = interval; fastresend_ = fastresend;
 		nocwnd_ = nocwnd; streamMode_ = streamMode; rx_minrto_ = rx_minrto;
 	}
 
-	~KcpSession() { if (kcp_) ikcp_release(kcp_); }
+	// path mtu discovery, probes upwards from SetConfig()'s mtu to `maxMtu` once connected
+	// and raises kcp's mss on the fly. both sides should be built with this kcpp version.
+	// should set before connected
+	void SetPathMtuDiscovery(bool on, int maxMtu = static_cast<int>(RdcType::kMaxMTU))
+	{
+		assert(maxMtu <= static_cast<int>(RdcType::kMaxMTU));
+		pmtudOn_ = on; pmtudMaxMtu_ = maxMtu;
+	}
+
+	// kRdcDynamic : the datagrams carry the recent ones again while kcp sees high loss and rtt
+	// (ikcp_rdc_check), kRdcOn / kRdcOff : always / never. only the sending side needs it
+	void SetRedundancy(RedundancyModeE mode) { rdcMode_ = mode; }
+
+	// the mtu currently in use, it only differs from SetConfig()'s when path mtu discovery is on
+	int GetPathMtu() const { return appliedMtu_ > 0 ? appliedMtu_ : pmtudBaseMtu_; }
+
+	// adaptive flush interval, kcp flushes every SetConfig()'s interval while there is traffic,
+	// stretches up to `intervalMax` ms when idle, and flushes as early as `intervalMin` ms
+	// for retransmissions due before the next flush. Update() returns the later timestamp
+	// while idle, so call Update() again after Send()/Recv() to get the pulled-in one.
+	// `intervalMax` 0 : disable. should set before connected
+	void SetAdaptiveInterval(int intervalMax, int intervalMin = 1)
+	{
+		assert(intervalMax == 0 || intervalMax >= interval_);
+		intervalMax_ = intervalMax; intervalMin_ = intervalMin;
+	}
+
+	// delayed ack, acks are sent once `every` segments are unacked or the oldest is `delayMs` old,
+	// right away on out-of-order segments, and ride along with outgoing data in between.
+	// keep `delayMs` well below rx_minrto. `every` 0 : disable(ack at every flush). should set before connected
+	void SetAckPolicy(int every, int delayMs)
+	{
+		assert(every >= 0 && delayMs >= 0);
+		ackEvery_ = every; ackDelay_ = delayMs;
+	}
+
+	// small msg coalescing, reliable msgs are packed into one kcp msg behind a varint len each,
+	// saving a kcp header and an ikcp_update() per msg. a batch goes out once the next msg
+	// would take it over `maxBatchBytes`(0 : kcp's mss, one segment) or `maxDelayMs` after its
+	// first msg, checked in Update(), whose returned timestamp accounts for it.
+	// Recv() splits the batches back. ignored in stream mode. should set on both sides before Send()
+	void SetCoalescing(bool on, int maxDelayMs = 2, int maxBatchBytes = 0)
+	{
+		assert(maxDelayMs >= 0 && maxBatchBytes >= 0);
+		coalesceOn_ = on; coalesceDelay_ = maxDelayMs; coalesceMaxBytes_ = maxBatchBytes;
+	}
+
+	/// ------ reliable streams --------
+
+	// adds a reliable stream ordered on its own, a lost msg holds up the msgs of its stream only.
+	// streams share the datagrams and the send window, which goes to higher `priority` streams first.
+	// Send() goes on the default stream 0 of priority 0. returns the stream id.
+	// the peer should be built with this kcpp version and add the same streams in the same order,
+	// should add before connected
+	int AddStream(int priority = 0)
+	{
+		assert(!kcp_ && streams_.size() < kMaxStreamCnt);
+		streams_.push_back(Stream(priority));
+		SortStreams();
+		return static_cast<int>(streams_.size()) - 1;
+	}
+
+	void SetStreamPriority(int stream, int priority)
+	{
+		assert(stream >= 0 && stream < static_cast<int>(streams_.size()));
+		streams_[stream].priority_ = priority;
+		SortStreams();
+	}
+
+	// Send() of a reliable msg on `stream`
+	int SendOnStream(int stream, const void* data, int len, int ttlMs = 0)
+	{ return SendImpl(stream, data, len, kReliable, ttlMs); }
+
+	// Recv() telling the stream a msg came on, 0 for unreliable msgs.
+	// ready msgs of higher priority streams come first
+	bool Recv(Buf* userBuf, int& len, int& stream)
+	{
+		bool isDataLeft = RecvImpl(userBuf, len);
+		stream = lastRcvStream_;
+		return isDataLeft;
+	}
+
+	/// ------ latest-only state --------
+
+	// an unreliable update of the state of `key`(an entity, a channel...), it replaces the
+	// update of the same key not yet sent. updates go out on the next Update(), packed together,
+	// and the peer's Recv() drops those older than the last it handed over for their key.
+	// returns -1 if it won't fit in a datagram of SetConfig()'s mtu. the peer should be built
+	// with this kcpp version
+	int SendState(uint32_t key, const void* data, int len)
+	{
+		assert(data != nullptr);
+		assert(len > 0);
+		const char* msg = static_cast<const char*>(data);
+		int msgLen = len;
+		if (IsCompressing(false))
+			DeflateMsg(msg, msgLen);
+		if (StateEntryLen(key, msgLen) + kStateSeqLen > MaxStateBodyLen(pmtudBaseMtu_))
+			return -1;
+		auto it = pendingStateIndex_.find(key);
+		if (it == pendingStateIndex_.end())
+		{
+			if (pendingStateCnt_ == pendingStates_.size())
+				pendingStates_.emplace_back();
+			it = pendingStateIndex_.emplace(key, pendingStateCnt_++).first;
+			pendingStates_[it->second].key_ = key;
+		}
+		pendingStates_[it->second].data_.assign(msg, msgLen);
+		pendingStates_[it->second].msgLen_ = len;
+		return 0;
+	}
+
+	// forgets the last update handed over of `key`, e.g. its entity is gone. keys quiet for
+	// kStateKeyIdleMs are forgotten anyway, and all of them on (re)connecting and on reset
+	void ForgetState(uint32_t key) { stateRcvSeq_.erase(key); }
+
+	// Recv() describing the msg in `msg` as RecvBatch() does, its key for kState msgs
+	bool Recv(Buf* userBuf, int& len, RecvMsgView& msg)
+	{
+		size_t offset = userBuf->readableBytes();
+		bool isDataLeft = RecvImpl(userBuf, len);
+		msg.data_ = userBuf->peek() + offset;
+		msg.offset_ = offset;
+		msg.len_ = len > 0 ? len : 0;
+		msg.transmitMode_ = lastRcvMode_;
+		msg.stream_ = lastRcvStream_;
+		msg.key_ = lastRcvKey_;
+		return isDataLeft;
+	}
+
+	/// ------ stats --------
+
+	// a snapshot of the counters and gauges, no more than a copy and a walk over the streams,
+	// fine to call every frame
+	KcpSessionStats GetStats() const
+	{
+		KcpSessionStats stats = stats_;
+		rdc_.GetStats(stats);
+		if (kcp_)
+		{
+			stats.srttMs_ = kcp_->rx_srtt;
+			stats.rttVarMs_ = kcp_->rx_rttval;
+			stats.rtoMs_ = kcp_->rx_rto;
+			stats.cwnd_ = static_cast<int>(kcp_->cwnd);
+			stats.rmtWnd_ = static_cast<int>(kcp_->rmt_wnd);
+		}
+		for (const Stream& stream : streams_)
+		{
+			if (!stream.kcp_)
+				continue;
+			stats.timeoutRetransmits_ += stream.kcp_->stat_resnd_timeout;
+			stats.fastRetransmits_ += stream.kcp_->stat_resnd_fast;
+			stats.duplicatesIn_ += stream.kcp_->stat_rcv_dup;
+			stats.sndQueue_ += static_cast<int>(stream.kcp_->nsnd_que);
+			stats.sndBuf_ += static_cast<int>(stream.kcp_->nsnd_buf);
+			stats.rcvQueue_ += static_cast<int>(stream.kcp_->nrcv_que);
+			stats.rcvBuf_ += static_cast<int>(stream.kcp_->nrcv_buf);
+		}
+		stats.pendingMsgs_ = static_cast<int>(pendingSndDataDeque_.size() + pendingStreamSndDeque_.size());
+		return stats;
+	}
+
+	/// ------ latency --------
+
+	// stamps every msg sent with the time(4 bytes), for the peer's Recv() to record its latency,
+	// and times the stages reliable segments go through in kcp, see KcpSessionLatency. reliable
+	// msgs aren't stamped in stream mode. the peer should be built with this kcpp version and
+	// turn it on too, Recv()'s len is -11 for a msg too short to be stamped. should set before connected
+	void SetLatencyTracking(bool on)
+	{
+		assert(!kcp_);
+		if (!on)
+			latency_.reset();
+		else if (!latency_)
+			latency_.reset(new KcpSessionLatency);
+	}
+
+	// nullptr unless SetLatencyTracking() is on. other threads may read and Merge() the histograms,
+	// Reset() them on the session's thread
+	KcpSessionLatency* GetLatency() const { return latency_.get(); }
+
+	/// ------ tracing --------
+
+	// binary trace of the kcp events in `mask`(IKCP_LOG_*, 0 : off) into the KcpTrace ring of
+	// the thread calling Update()/Recv()/Send(), looked up on every call, so the session may move
+	// between threads. cheap enough to leave on under load. should set before connected
+	void SetTracing(int mask)
+	{
+		assert(!kcp_);
+		traceMask_ = mask;
+	}
+
+	/// ------ compression --------
+
+	// compresses msgs of at least `minLen` bytes with LZ4 against `dict`, samples of typical msgs
+	// both sides share, see Lz4Codec. a msg goes behind a varint whose low bit tells if it is
+	// compressed, the rest its len then, and goes as it is when it doesn't come out shorter.
+	// every channel but reliable msgs in stream mode. Recv()'s len is -12 for a msg that doesn't
+	// decompress. the peer should be built with this kcpp version and turn it on with the same
+	// dict. should set before connected
+	void SetCompression(bool on, int minLen = 64, const std::string& dict = std::string())
+	{
+		assert(!kcp_);
+		codec_.reset(on ? new Lz4Codec(dict) : nullptr);
+		compressMinLen_ = minLen;
+	}
+
+	/// ------ metrics --------
+
+	// adds the session's counters to `shard` about once a second from Update() and when it is
+	// destroyed, samples its rtt and queue depths, and records its latencies there too while
+	// SetLatencyTracking() is on. the sessions of a shard are to be updated and destroyed
+	// on one thread. should set before connected
+	void SetMetrics(MetricsShard* shard)
+	{
+		assert(!kcp_ && !metrics_);
+		if (!shard)
+			return;
+		metrics_ = shard;
+		publishedStats_.reset(new KcpSessionStats());
+		MetricsShard::Add(metrics_->liveSessions_, static_cast<int64_t>(1));
+	}
+
+	~BasicKcpSession()
+	{
+		if (metrics_)
+		{
+			PublishMetrics();
+			if (IsConnected())
+				MetricsShard::Add(metrics_->connectedSessions_, static_cast<int64_t>(-1));
+			MetricsShard::Add(metrics_->liveSessions_, static_cast<int64_t>(-1));
+		}
+		for (Stream& stream : streams_)
+			if (stream.kcp_)
+				ikcp_release(stream.kcp_);
+	}
 
 private:
 
 	int64_t UpdateImpl()
 	{
+		BindTraceRing();
 		if (curConnState_ == kConnecting && IsClient())
 			SendSyn();
 
+		if (pendingStateCnt_ > 0)
+		{
+			int result = FlushStates();
+			if (result < 0)
+				return result;
+		}
+
 		IUINT32 curTimestamp = static_cast<IUINT32>(curTsMsFunc_());
+		if (metrics_ && static_cast<IINT32>(curTimestamp - nextMetricsTs_) >= 0)
+		{
+			PublishMetrics();
+			nextMetricsTs_ = curTimestamp + kMetricsIntervalMs;
+		}
+		if (!stateRcvSeq_.empty() && static_cast<IINT32>(curTimestamp - nextStateSweepTs_) >= 0)
+			ForgetQuietStates(curTimestamp);
 		if (kcp_ && IsConnected())
 		{
-			rdc_.Switch(ikcp_rdc_check(kcp_) == 1 ? true : false);
+			bool isRdcOn = RdcCheck();
+			rdc_.Switch(rdcMode_ == kRdcDynamic ? isRdcOn : rdcMode_ == kRdcOn);
+			if (pmtud_.IsOn())
+				HandlePmtud(curTimestamp);
 			int result = FlushSndQueueBeforeConned();
 			if (result < 0)
 				return result;
+			bool isCoalescing = false;
+			IUINT32 coalesceDeadlineTs = 0;
+			for (size_t i = 0; i < streams_.size(); ++i)
+			{
+				const Stream& stream = streams_[i];
+				if (stream.coalesceBuf_.readableBytes() == 0)
+					continue;
+				if (curTimestamp >= stream.coalesceDeadlineTs_)
+				{
+					result = FlushCoalesced(static_cast<int>(i), curTimestamp, 0);
+					if (result < 0)
+						return result;
+				}
+				else if (!isCoalescing || stream.coalesceDeadlineTs_ < coalesceDeadlineTs)
+				{
+					isCoalescing = true;
+					coalesceDeadlineTs = stream.coalesceDeadlineTs_;
+				}
+			}
 			if (curTimestamp >= nextUpdateTs_)
 			{
-				ikcp_update(kcp_, curTimestamp);
-				nextUpdateTs_ = ikcp_check(kcp_, curTimestamp);
+				UpdateStreams(curTimestamp);
+				nextUpdateTs_ = CheckStreams(curTimestamp);
 			}
+			if (isCoalescing && coalesceDeadlineTs < nextUpdateTs_)
+				return static_cast<int64_t>(coalesceDeadlineTs);
 			return static_cast<int64_t>(nextUpdateTs_);
 		}
 		else // not yet connected
 			return static_cast<int64_t>(curTimestamp) + interval_;
 	}
 
-	int SendImpl(const void* data, int len, TransmitModeE transmitMode = kReliable)
+	int SendImpl(int stream, const void* data, int len, TransmitModeE transmitMode, int ttlMs)
 	{
+		assert(stream >= 0 && stream < static_cast<int>(streams_.size()));
 		assert(data != nullptr);
 		assert(len > 0);
-		assert(transmitMode == kReliable || transmitMode == kUnreliable);
+		assert(transmitMode == kReliable || transmitMode == kUnreliable || transmitMode == kReliableUnordered); // kState : SendState()
+		BindTraceRing();
 
 		if (transmitMode == kUnreliable)
 		{
-			outputBuf_.append(data, len);
+			const char* msg = static_cast<const char*>(data);
+			int msgLen = len;
+			if (IsCompressing(false))
+				DeflateMsg(msg, msgLen);
+			if (latency_)
+				outputBuf_.appendInt32(static_cast<int32_t>(curTsMsFunc_()));
+			outputBuf_.append(msg, msgLen);
 			int error = OutputAfterCheckingRdc(static_cast<PktTypeE>(kUnreliable));
 			if (error)
 				return error;
+			CountMsg(stats_.unreliable_.msgsOut_, stats_.unreliable_.bytesOut_, len);
 		}
-		else if (transmitMode == kReliable)
+		else if (transmitMode == kReliable || transmitMode == kReliableUnordered)
 		{
 			if (!IsConnected() && IsClient())
 			{
-				pendingSndDataDeque_.emplace_back(std::string(static_cast<const char*>(data), len));
+				if (stream == 0)
+				{
+					pendingSndDataDeque_.emplace_back(std::string(static_cast<const char*>(data), len));
+					pendingSndDeadlines_.push_back(0);
+				}
+				else
+					pendingStreamSndDeque_.emplace_back(stream, std::string(static_cast<const char*>(data), len));
+				CountMsg(stats_.reliable_.msgsOut_, stats_.reliable_.bytesOut_, len);
 			}
 			else if (IsConnected())
 			{
 				int result = FlushSndQueueBeforeConned();
 				if (result < 0)
 					return result;
-				result = ikcp_send(kcp_, static_cast<const char*>(data), len);
+				IUINT32 curTimestamp = static_cast<IUINT32>(curTsMsFunc_());
+				IUINT32 deadline = 0;
+				if (ttlMs > 0)
+					deadline = (curTimestamp + ttlMs) | 1; // 0 stands for no deadline
+				if (transmitMode == kReliableUnordered)
+					result = KcpSendUnordered(stream, static_cast<const char*>(data), len, deadline, curTimestamp);
+				else
+					result = KcpSend(stream, static_cast<const char*>(data), len, deadline, curTimestamp);
 				if (result < 0)
 					return result; // ikcp_send err
-				else
-					ikcp_update(kcp_, static_cast<IUINT32>(curTsMsFunc_()));
+				CountMsg(stats_.reliable_.msgsOut_, stats_.reliable_.bytesOut_, len);
 			}
 		}
 		return 0;
@@ -1021,74 +2617,282 @@ private:
 
 	bool RecvImpl(Buf* userBuf, int& len)
 	{
+		BindTraceRing();
+		if (!hasDataLeft_ && rdc_.IsThisRoundFinished() && stateRcvBuf_.readableBytes() == 0 && !PollInput(len))
+			return false;
+		return RecvPolled(userBuf, len);
+	}
+
+	// appends a datagram of the user's input to inputBuf_, false with len -10 if there is none
+	bool PollInput(int& len)
+	{
+		const UserInputData& rawRecvdata = userInputFunc_();
+		if (rawRecvdata.len_ < 0)
+		{
+			len = -10;
+			return false;
+		}
+		else if (rawRecvdata.len_ > 0)
+		{
+			inputBuf_.append(rawRecvdata.data_, rawRecvdata.len_);
+			CountMsg(stats_.datagramsIn_, stats_.datagramBytesIn_, rawRecvdata.len_);
+		}
+		return true;
+	}
+
+	// one step of Recv() over the polled datagram, then over the msgs it completed in kcp
+	bool RecvPolled(Buf* userBuf, int& len)
+	{
+		if (stateRcvBuf_.readableBytes() > 0)
+		{
+			len = RecvState(userBuf);
+			return true;
+		}
 		if (hasDataLeft_)
 		{
 			assert(inputBuf_.readableBytes() == 0);
 			if (!IsConnected())
+			{
+				hasDataLeft_ = false; // nothing reached kcp, go on polling the input
 				return false;
+			}
 			len = KcpRecv(userBuf); // if err, -1, -2, -3
+			if (len > 0 && IsStampingReliable())
+				len = UnstampRcvedMsg(userBuf, len);
+			if (len > 0 && IsCompressing(true))
+				len = InflateRcvedMsg(userBuf, len);
+			lastRcvMode_ = kReliable;
+			lastRcvKey_ = 0;
 			hasDataLeft_ = len > 0;
+			if (len > 0)
+				CountMsg(stats_.reliable_.msgsIn_, stats_.reliable_.bytesIn_, len);
 			return hasDataLeft_;
 		}
 		else
 		{
-			if (rdc_.IsThisRoundFinished())
+			// DoRecv() only hands over unreliable msgs, reliable ones come out of kcp afterwards
+			lastRcvMode_ = static_cast<TransmitModeE>(kUnreliable);
+			lastRcvStream_ = 0;
+			lastRcvKey_ = 0;
+			if (!rdc_.Input(userBuf, len, &inputBuf_))
+				hasDataLeft_ = true;
+			if (len < 0)
+				++stats_.rejectedPktsIn_;
+			return true;
+		}
+	}
+
+	int RecvBatchImpl(Buf* userBuf, RecvMsgView* msgs, int maxMsgCnt, int& err)
+	{
+		assert(userBuf && (msgs || maxMsgCnt == 0));
+		BindTraceRing();
+		err = 0;
+		int msgCnt = 0;
+		while (msgCnt < maxMsgCnt)
+		{
+			if (!hasDataLeft_ && rdc_.IsThisRoundFinished() && stateRcvBuf_.readableBytes() == 0)
+			{
+				int len = 0;
+				if (!PollInput(len) || inputBuf_.readableBytes() == 0)
+					break; // the input is drained
+			}
+			size_t offset = userBuf->readableBytes();
+			int len = 0;
+			RecvPolled(userBuf, len);
+			if (len > 0)
+			{
+				RecvMsgView& msg = msgs[msgCnt++];
+				msg.offset_ = offset;
+				msg.len_ = len;
+				msg.transmitMode_ = lastRcvMode_;
+				msg.stream_ = lastRcvStream_;
+				msg.key_ = lastRcvKey_;
+			}
+			else if (len < 0)
+			{
+				err = len;
+				break;
+			}
+		}
+		// userBuf may move its data while growing, point into it once it is done
+		for (int i = 0; i < msgCnt; ++i)
+			msgs[i].data_ = userBuf->peek() + msgs[i].offset_;
+		return msgCnt;
+	}
+
+	int FlushSndQueueBeforeConned()
+	{
+		assert(kcp_ && IsConnected());
+		if (pendingSndDataDeque_.size() > 0)
+		{
+			for (auto it = pendingSndDataDeque_.begin(); it != pendingSndDataDeque_.end(); ++it)
 			{
-				const UserInputData& rawRecvdata = userInputFunc_();
-				if (rawRecvdata.len_ < 0)
+				int sendRet = KcpSend(0, it->c_str(), static_cast<int>(it->size()), 0,
+					static_cast<IUINT32>(curTsMsFunc_()));
+				if (sendRet < 0)
+					return sendRet; // ikcp_send err
+			}
+			pendingSndDataDeque_.clear();
+			pendingSndDeadlines_.clear();
+		}
+		if (pendingStreamSndDeque_.size() > 0)
+		{
+			for (auto it = pendingStreamSndDeque_.begin(); it != pendingStreamSndDeque_.end(); ++it)
+			{
+				int sendRet = KcpSend(it->first, it->second.c_str(), static_cast<int>(it->second.size()), 0,
+					static_cast<IUINT32>(curTsMsFunc_()));
+				if (sendRet < 0)
+					return sendRet; // ikcp_send err
+			}
+			pendingStreamSndDeque_.clear();
+		}
+		return 0;
+	}
+
+	void CopyKcpDataToSndQ()
+	{
+		assert(kcp_);
+		IKCPSEG *seg;
+		struct IQUEUEHEAD *p;
+		// msgs are joined back from their segments, the last one has frg 0(always in stream mode).
+		// the other streams' msgs follow stream 0's, a stream after another. a msg past its
+		// deadline is given up as kcp does, partly skipped or not, the others keep their deadline.
+		// a msg some fragments of which were acked already is given up too, the peer has those
+		IUINT32 curTimestamp = static_cast<IUINT32>(curTsMsFunc_());
+		std::string msg;
+		IUINT32 deadline = 0;
+		bool isExpired = false;
+		bool isOpen = false; // a msg is being joined
+		bool isWhole = false;
+		for (Stream& stream : streams_)
+		{
+			ikcpcb* kcp = stream.kcp_;
+			IQUEUEHEAD* queues[] = { &kcp->snd_buf, &kcp->snd_queue };
+			const IKCPSEG* prev = nullptr;
+			bool isPrevInBuf = false;
+			for (IQUEUEHEAD* queue : queues)
+			{
+				bool isInBuf = queue == &kcp->snd_buf;
+				for (p = queue->next; p != queue; p = p->next)
 				{
-					len = -10;
-					return false;
+					seg = iqueue_entry(p, IKCPSEG, node);
+					if (isOpen && !IsNextFrg(kcp, prev, isPrevInBuf, seg, isInBuf))
+					{
+						msg.clear(); // the rest of it was acked
+						deadline = 0;
+						isExpired = false;
+						isOpen = false;
+					}
+					if (!isOpen)
+					{
+						isOpen = true;
+						isWhole = seg->frg + 1 == seg->frg_cnt; // its first fragment wasn't acked
+					}
+					prev = seg;
+					isPrevInBuf = isInBuf;
+					msg.append(seg->data, seg->len);
+					// the fragments of a msg share its deadline, those already skipped(len 0) are past it
+					if (seg->deadline != 0)
+					{
+						deadline = seg->deadline;
+						isExpired = static_cast<IINT32>(curTimestamp - deadline) >= 0;
+					}
+					if (seg->frg != 0)
+						continue;
+					if (isWhole && !isExpired && IsCoalescing())
+						SplitBatchToSndQ(msg.data(), msg.size(), deadline);
+					else if (isWhole && !isExpired)
+						RestoreToSndQ(msg.data(), msg.size(), deadline);
+					msg.clear();
+					deadline = 0;
+					isExpired = false;
+					isOpen = false;
 				}
-				else if (rawRecvdata.len_ > 0)
-					inputBuf_.append(rawRecvdata.data_, rawRecvdata.len_);
 			}
-			if (!rdc_.Input(userBuf, len, &inputBuf_))
-				hasDataLeft_ = true;
-			return true;
+			// a msg whose last fragments were acked before the others
+			msg.clear();
+			deadline = 0;
+			isExpired = false;
+			isOpen = false;
+			SplitBatchToSndQ(stream.coalesceBuf_.peek(), stream.coalesceBuf_.readableBytes(), 0);
+			stream.coalesceBuf_.retrieveAll();
+		}
+		for (auto& streamMsg : pendingStreamSndDeque_)
+		{
+			pendingSndDataDeque_.emplace_back(std::move(streamMsg.second));
+			pendingSndDeadlines_.push_back(0);
 		}
+		pendingStreamSndDeque_.clear();
 	}
 
-	int FlushSndQueueBeforeConned()
+	// is `seg` the fragment of the same msg right after `prev`. the segments of snd_queue have
+	// no sn yet, the first of them follows the last moved into snd_buf
+	static bool IsNextFrg(const ikcpcb* kcp, const IKCPSEG* prev, bool isPrevInBuf, const IKCPSEG* seg, bool isInBuf)
 	{
-		assert(kcp_ && IsConnected());
-		if (pendingSndDataDeque_.size() > 0)
+		if (seg->frg + 1 != prev->frg)
+			return false;
+		if (isInBuf)
+			return seg->sn == prev->sn + 1;
+		return !isPrevInBuf || prev->sn + 1 == kcp->snd_nxt;
+	}
+
+	void SplitBatchToSndQ(const char* batch, size_t batchLen, IUINT32 deadline)
+	{
+		uint32_t msgLen = 0;
+		size_t prefixLen = 0;
+		while ((prefixLen = ReadVarint(batch, batchLen, msgLen)) > 0 && msgLen > 0
+			&& msgLen <= batchLen - prefixLen)
 		{
-			for (auto it = pendingSndDataDeque_.begin(); it != pendingSndDataDeque_.end(); ++it)
-			{
-				int sendRet = ikcp_send(kcp_, it->c_str(), static_cast<int>(it->size()));
-				if (sendRet < 0)
-					return sendRet; // ikcp_send err
-				ikcp_update(kcp_, static_cast<IUINT32>(curTsMsFunc_()));
-			}
-			pendingSndDataDeque_.clear();
+			RestoreToSndQ(batch + prefixLen, msgLen, deadline);
+			batch += prefixLen + msgLen;
+			batchLen -= prefixLen + msgLen;
 		}
-		return 0;
 	}
 
-	void CopyKcpDataToSndQ()
+	// a msg taken back out of kcp loses its send timestamp and is decompressed
+	void RestoreToSndQ(const char* msg, size_t msgLen, IUINT32 deadline)
 	{
-		assert(kcp_);
-		IKCPSEG *seg;
-		struct IQUEUEHEAD *p;
-		for (p = kcp_->snd_buf.next; p != &kcp_->snd_buf; p = p->next)
+		size_t stampLen = IsStampingReliable() && msgLen >= kSendTsLen ? kSendTsLen : 0;
+		if (!IsCompressing(true))
 		{
-			seg = iqueue_entry(p, IKCPSEG, node);
-			pendingSndDataDeque_.emplace_back(std::string(seg->data, seg->len));
+			pendingSndDataDeque_.emplace_back(std::string(msg + stampLen, msgLen - stampLen));
+			pendingSndDeadlines_.push_back(deadline);
+			return;
 		}
-		for (p = kcp_->snd_queue.next; p != &kcp_->snd_queue; p = p->next)
+		// sized for the msg up front and without prepend room, it is only copied out
+		Buf inflated(msgLen, 0);
+		inflated.ensureWritableBytes(msgLen);
+		if (AppendInflated(&inflated, msg + stampLen, msgLen - stampLen) > 0)
 		{
-			seg = iqueue_entry(p, IKCPSEG, node);
-			pendingSndDataDeque_.emplace_back(std::string(seg->data, seg->len));
+			pendingSndDataDeque_.emplace_back(std::string(inflated.peek(), inflated.readableBytes()));
+			pendingSndDeadlines_.push_back(deadline);
 		}
 	}
 
-	void DoRecv(Buf* userBuf, int& len, int readableLen, PktTypeE pktType)
+	void DoRecv(Buf* userBuf, int& len, const char* data, int readableLen, PktTypeE pktType)
 	{
 		if (pktType == static_cast<PktTypeE>(kUnreliable))
 		{
-			userBuf->append(inputBuf_.peek(), readableLen);
-			len = readableLen;
+			if (latency_)
+			{
+				if (readableLen <= static_cast<int>(kSendTsLen))
+				{
+					len = -11;
+					return;
+				}
+				RecordLatency(&KcpSessionLatency::unreliable_, data);
+				data += kSendTsLen;
+				readableLen -= static_cast<int>(kSendTsLen);
+			}
+			if (IsCompressing(false))
+				len = AppendInflated(userBuf, data, readableLen);
+			else
+			{
+				userBuf->append(data, readableLen);
+				len = readableLen;
+			}
+			if (len > 0)
+				CountMsg(stats_.unreliable_.msgsIn_, stats_.unreliable_.bytesIn_, len);
 		}
 		else if (pktType == kSyn)
 		{
@@ -1098,14 +2902,20 @@ private:
 				SetConnState(kConnected);
 				InitKcp(GetNewConv());
 			}
+			else
+				stateRcvSeq_.clear(); // the client may have restarted, its state seqs with it
 			SendAckAndConv();
 			len = 0;
 		}
 		else if (pktType == kAck)
 		{
 			assert(IsClient());
-			int32_t rcvConv = inputBuf_.readInt32();
-			readableLen -= 4;
+			if (readableLen < 4)
+			{
+				len = 0;
+				return;
+			}
+			int32_t rcvConv = PeekInt32(data);
 
 			if (curConnState_ == kConnecting)
 			{
@@ -1114,6 +2924,30 @@ private:
 			}
 			len = 0;
 		}
+		else if (pktType == kMtuProbe)
+		{
+			if (readableLen >= 2)
+				SendMtuProbeAck(PeekInt16(data));
+			len = 0;
+		}
+		else if (pktType == kMtuProbeAck)
+		{
+			if (readableLen >= 2 && pmtud_.IsOn())
+			{
+				int ackedMtu = PeekInt16(data);
+				if (ackedMtu >= pmtud_.GetMTU())
+					pmtudAnsweredDatagrams_ = rdc_.FullSizeDatagramsOut(); // the path carries them
+				pmtud_.OnProbeAck(ackedMtu, curTsMsFunc_());
+				ApplyPathMtu();
+			}
+			len = 0;
+		}
+		else if (pktType == kMtuFallback)
+		{
+			if (pmtud_.IsOn() && pmtud_.OnPeerFallback(curTsMsFunc_()))
+				ApplyPathMtu();
+			len = 0;
+		}
 		else if (pktType == kRst)
 		{
 			assert(IsClient());
@@ -1122,16 +2956,24 @@ private:
 				CopyKcpDataToSndQ();
 				SetConnState(kResetting);
 			}
+			stateRcvSeq_.clear(); // the server restarted, its state seqs with it
 			len = 0;
 		}
+		else if (pktType == kStatePkt)
+		{
+			len = KeepNewerStates(data, readableLen);
+		}
 		else if (pktType == kPsh)
 		{
 			if (IsConnected())
 			{
-				int result = ikcp_input(kcp_, inputBuf_.peek(), readableLen);
+				if (latency_)
+					for (Stream& stream : streams_)
+						stream.kcp_->ts_stage = static_cast<IUINT32>(curTsMsFunc_()); // the time segments reach rcv_buf
+				int result = KcpInput(data, readableLen);
 				if (result == 0)
 				{
-					ikcp_update(kcp_, static_cast<IUINT32>(curTsMsFunc_()));
+					KcpUpdate(static_cast<IUINT32>(curTsMsFunc_()));
 					len = 0;
 				}
 				else // if (result < 0)
@@ -1141,6 +2983,7 @@ private:
 			{
 				if (IsServer())
 					SendRst();
+				++stats_.rejectedPktsIn_;
 				len = 0;
 			}
 		}
@@ -1148,7 +2991,29 @@ private:
 		{
 			len = -7; // pktType err
 		}
-		inputBuf_.retrieve(readableLen);
+	}
+
+	static int16_t PeekInt16(const char* data)
+	{
+		int16_t be16 = 0;
+		::memcpy(&be16, data, sizeof be16);
+		return be16toh(be16);
+	}
+
+	static int32_t PeekInt32(const char* data)
+	{
+		int32_t be32 = 0;
+		::memcpy(&be32, data, sizeof be32);
+		return be32toh(be32);
+	}
+
+	// ikcp_update() out of Update()'s schedule, a stretched idle interval or a pending
+	// delayed ack may want Update() to come back earlier than it planned
+	void KcpUpdate(IUINT32 curTimestamp)
+	{
+		UpdateStreams(curTimestamp);
+		if (intervalMax_ > 0 || ackEvery_ > 0)
+			nextUpdateTs_ = CheckStreams(curTimestamp);
 	}
 
 	void SendRst()
@@ -1173,26 +3038,130 @@ private:
 	void InitKcp(const IUINT32 conv)
 	{
 		conv_ = conv;
-		kcp_ = ikcp_create(conv, this);
-		ikcp_wndsize(kcp_, sndWnd_, rcvWnd_);
-		ikcp_nodelay(kcp_, nodelay_, interval_, fastresend_, nocwnd_);
-		ikcp_setmtu(kcp_, mtu_);
-		kcp_->stream = streamMode_;
-		kcp_->rx_minrto = rx_minrto_;
-		kcp_->output = KcpSession::KcpPshOutputFuncRaw;
+		for (size_t i = 0; i < streams_.size(); ++i)
+			streams_[i].kcp_ = CreateKcp(StreamConv(static_cast<int>(i)));
+		kcp_ = streams_[0].kcp_;
+		if (pmtudOn_)
+			pmtud_.Start(pmtudBaseMtu_, pmtudMaxMtu_, curTsMsFunc_());
+		stateRcvSeq_.clear();
+	}
+
+	ikcpcb* CreateKcp(const IUINT32 conv)
+	{
+		ikcpcb* kcp = ikcp_create(conv, this);
+		ikcp_wndsize(kcp, sndWnd_, rcvWnd_);
+		ikcp_nodelay(kcp, nodelay_, interval_, fastresend_, nocwnd_);
+		ikcp_setmtu(kcp, mtu_);
+		kcp->stream = streamMode_;
+		kcp->rx_minrto = rx_minrto_;
+		kcp->output = BasicKcpSession::KcpPshOutputFuncRaw;
+		ikcp_interval_adaptive(kcp, intervalMin_, intervalMax_);
+		ikcp_ack_policy(kcp, ackEvery_, ackDelay_);
+		if (latency_)
+			ikcp_setstagetime(kcp, BasicKcpSession::KcpStageTimeFuncRaw);
+		if (traceMask_ != 0)
+			ikcp_settrace(kcp, KcpTrace::ThisThread(), traceMask_);
+		return kcp;
+	}
+
+	// the trace records go to the ring of the thread driving the session now, not the one
+	// it connected on, which may be gone
+	void BindTraceRing()
+	{
+		if (traceMask_ == 0 || !kcp_)
+			return;
+		IKCPTRACEBUF* ring = KcpTrace::ThisThread();
+		for (Stream& stream : streams_)
+			ikcp_settrace(stream.kcp_, ring, traceMask_);
+	}
+
+	// datagrams above the base mtu, of every kind and stream, count as unanswered till a probe
+	// of the current mtu comes back. the mtu is confirmed again by a probe once
+	// kMaxUnansweredDatagrams of them went out(a search probes upwards anyway), or a segment
+	// of any stream keeps timing out while they do, at most every kConfirmIntervalMs.
+	// a failed confirmation falls back to the base mtu, and the peer is told to fall back too,
+	// its full-size acks may be lost just as well
+	void HandlePmtud(IUINT32 curTimestamp)
+	{
+		assert(kcp_);
+		static const IUINT32 kBlackHoleXmitThreshold = 4;
+		static const uint64_t kMaxUnansweredDatagrams = 32;
+		static const IUINT32 kConfirmIntervalMs = 1000;
+		static const int64_t kMinProbeTimeoutMs = 100;
+
+		uint64_t unanswered = rdc_.FullSizeDatagramsOut() - pmtudAnsweredDatagrams_;
+		if (pmtud_.GetMTU() > pmtud_.GetBaseMTU() && unanswered > 0
+			&& static_cast<IINT32>(curTimestamp - pmtudConfirmTs_) >= 0
+			&& ((unanswered >= kMaxUnansweredDatagrams && !pmtud_.IsSearching())
+				|| HasStuckSegment(kBlackHoleXmitThreshold)))
+		{
+			pmtudConfirmTs_ = curTimestamp + kConfirmIntervalMs;
+			pmtud_.OnBlackHoleSuspected();
+		}
+		int probeMtu = pmtud_.PollProbe(curTimestamp,
+			std::max<int64_t>(2 * kcp_->rx_rto, kMinProbeTimeoutMs));
+		if (pmtud_.GetMTU() < GetPathMtu())
+		{
+			outputBuf_.appendInt16(static_cast<int16_t>(pmtud_.GetMTU()));
+			OutputAfterCheckingRdc(kMtuFallback);
+		}
+		ApplyPathMtu();
+		if (probeMtu > 0)
+			rdc_.OutputProbe(&outputBuf_, probeMtu);
+	}
+
+	bool HasStuckSegment(IUINT32 xmitThreshold) const
+	{
+		for (const Stream& stream : streams_)
+		{
+			const IQUEUEHEAD* sndBuf = &stream.kcp_->snd_buf;
+			for (const IQUEUEHEAD* p = sndBuf->next; p != sndBuf; p = p->next)
+				if (iqueue_entry(p, const IKCPSEG, node)->xmit >= xmitThreshold)
+					return true;
+		}
+		return false;
+	}
+
+	void ApplyPathMtu()
+	{
+		int mtu = pmtud_.GetMTU();
+		if (!kcp_ || mtu == GetPathMtu())
+			return;
+		// the base mtu keeps SetConfig()'s kcp mtu, probed ones are filled up exactly
+		int kcpMtu = mtu > pmtudBaseMtu_ ? mtu - static_cast<int>(RdcType::ReliableOverhead()) : mtu_;
+		if (ikcp_setmtu(kcp_, kcpMtu) == 0)
+		{
+			for (size_t i = 1; i < streams_.size(); ++i)
+				ikcp_setmtu(streams_[i].kcp_, kcpMtu);
+			rdc_.SetMTU(mtu);
+			appliedMtu_ = mtu;
+		}
+	}
+
+	void SendMtuProbeAck(int16_t probeMtu)
+	{
+		outputBuf_.appendInt16(probeMtu);
+		OutputAfterCheckingRdc(kMtuProbeAck);
 	}
 
 	IUINT32 GetNewConv()
 	{
 		assert(IsServer());
-		static IUINT32 newConv = 666;
-		return newConv++;
+		return NewKcpConv();
 	}
 
 	void SetConnState(const ConnectionStateE s)
 	{
 		ConnectionStateE lastState = curConnState_;
 		curConnState_ = s;
+		if (lastState != s)
+			IKCP_PROBE4(kcpp, conn_state, this, conv_, static_cast<int>(lastState), static_cast<int>(s));
+		if (metrics_ && lastState != s && (s == kConnected || lastState == kConnected))
+		{
+			MetricsShard::Add(metrics_->connectedSessions_, static_cast<int64_t>(s == kConnected ? 1 : -1));
+			if (s == kConnected)
+				MetricsShard::Add(metrics_->handshakes_, static_cast<uint64_t>(1));
+		}
 		if (connectionCallback_ && lastState != s)
 		{
 			if (s == kConnected)
@@ -1202,39 +3171,542 @@ private:
 		}
 	}
 
+	bool IsCoalescing() const { return coalesceOn_ && streamMode_ == 0; }
+
+	// hands a reliable msg over to the kcp of `stream`, into its pending batch when coalescing
+	int KcpSend(int stream, const char* data, int len, IUINT32 deadline, IUINT32 curTimestamp)
+	{
+		if (IsCompressing(true))
+			DeflateMsg(data, len);
+		StampMsg(stream, data, len, curTimestamp);
+		if (!IsCoalescing())
+		{
+			int result = ikcp_send_deadline(streams_[stream].kcp_, data, len, deadline);
+			if (result >= 0)
+				KcpUpdate(curTimestamp);
+			return result;
+		}
+
+		Buf& coalesceBuf = streams_[stream].coalesceBuf_;
+		size_t maxBatchLen = coalesceMaxBytes_ > 0 ? static_cast<size_t>(coalesceMaxBytes_) : kcp_->mss;
+		size_t framedLen = VarintLen(static_cast<uint32_t>(len)) + len;
+		// a msg with a deadline goes alone, its expiry must not take others along
+		if (coalesceBuf.readableBytes() + framedLen > maxBatchLen || deadline != 0)
+		{
+			int result = FlushCoalesced(stream, curTimestamp, 0);
+			if (result < 0)
+				return result;
+		}
+		if (coalesceBuf.readableBytes() == 0)
+			streams_[stream].coalesceDeadlineTs_ = curTimestamp + coalesceDelay_;
+		char prefix[kMaxVarintLen];
+		coalesceBuf.append(prefix, WriteVarint(prefix, static_cast<uint32_t>(len)));
+		coalesceBuf.append(data, len);
+		if (framedLen >= maxBatchLen || deadline != 0)
+			return FlushCoalesced(stream, curTimestamp, deadline);
+		return 0;
+	}
+
+	// an unordered msg never joins a batch, it goes alone, framed as a batch of one when coalescing
+	int KcpSendUnordered(int stream, const char* data, int len, IUINT32 deadline, IUINT32 curTimestamp)
+	{
+		if (IsCompressing(true))
+			DeflateMsg(data, len);
+		StampMsg(stream, data, len, curTimestamp);
+		int result = 0;
+		if (IsCoalescing())
+		{
+			char prefix[kMaxVarintLen];
+			unorderedFrameBuf_.append(prefix, WriteVarint(prefix, static_cast<uint32_t>(len)));
+			unorderedFrameBuf_.append(data, len);
+			result = ikcp_send_unordered(streams_[stream].kcp_, unorderedFrameBuf_.peek(),
+				static_cast<int>(unorderedFrameBuf_.readableBytes()), deadline);
+			unorderedFrameBuf_.retrieveAll();
+		}
+		else
+			result = ikcp_send_unordered(streams_[stream].kcp_, data, len, deadline);
+		if (result >= 0)
+			KcpUpdate(curTimestamp);
+		return result;
+	}
+
+	int FlushCoalesced(int stream, IUINT32 curTimestamp, IUINT32 deadline)
+	{
+		Buf& coalesceBuf = streams_[stream].coalesceBuf_;
+		if (coalesceBuf.readableBytes() == 0)
+			return 0;
+		int result = ikcp_send_deadline(streams_[stream].kcp_, coalesceBuf.peek(),
+			static_cast<int>(coalesceBuf.readableBytes()), deadline);
+		coalesceBuf.retrieveAll();
+		if (result < 0)
+			return result; // ikcp_send err
+		KcpUpdate(curTimestamp);
+		return 0;
+	}
+
+	static const size_t kSendTsLen = 4;
+
+	bool IsStampingReliable() const { return latency_ && streamMode_ == 0; }
+
+	// with latency tracking, a reliable msg goes into kcp behind its send timestamp
+	void StampMsg(int stream, const char*& data, int& len, IUINT32 curTimestamp)
+	{
+		if (!latency_)
+			return;
+		streams_[stream].kcp_->ts_stage = curTimestamp; // the time segments reach snd_queue
+		if (!IsStampingReliable())
+			return;
+		stampBuf_.retrieveAll();
+		stampBuf_.appendInt32(static_cast<int32_t>(curTimestamp));
+		stampBuf_.append(data, len);
+		data = stampBuf_.peek();
+		len = static_cast<int>(stampBuf_.readableBytes());
+	}
+
+	// takes the send timestamp off the msg just appended to `userBuf` and records its latency,
+	// -11 if it is too short to have one
+	int UnstampRcvedMsg(Buf* userBuf, int len)
+	{
+		char* msg = userBuf->beginWrite() - len;
+		if (len <= static_cast<int>(kSendTsLen))
+		{
+			userBuf->unwrite(len);
+			return -11;
+		}
+		RecordLatency(&KcpSessionLatency::reliable_, msg);
+		memmove(msg, msg + kSendTsLen, len - kSendTsLen);
+		userBuf->unwrite(kSendTsLen);
+		return len - static_cast<int>(kSendTsLen);
+	}
+
+	bool IsCompressing(bool isReliable) const { return codec_ && (!isReliable || streamMode_ == 0); }
+
+	// points `data` to the msg framed for the peer's AppendInflated() in deflateBuf_ :
+	// [varint len << 1 | 1][LZ4 block] if that is shorter, [0][msg] otherwise
+	void DeflateMsg(const char*& data, int& len)
+	{
+		size_t msgLen = static_cast<size_t>(len);
+		deflateBuf_.retrieveAll();
+		deflateBuf_.ensureWritableBytes(kMaxVarintLen + msgLen);
+		char* dst = deflateBuf_.beginWrite();
+		size_t prefixLen = VarintLen(static_cast<uint32_t>(msgLen << 1 | 1));
+		size_t compressedLen = 0;
+		if (len >= compressMinLen_)
+			compressedLen = codec_->Compress(data, msgLen, dst + prefixLen);
+		if (compressedLen > 0 && prefixLen + compressedLen < 1 + msgLen)
+		{
+			WriteVarint(dst, static_cast<uint32_t>(msgLen << 1 | 1));
+			deflateBuf_.hasWritten(prefixLen + compressedLen);
+		}
+		else
+		{
+			dst[0] = 0;
+			memcpy(dst + 1, data, msgLen);
+			KCPP_COUNT_COPY(msgLen);
+			deflateBuf_.hasWritten(1 + msgLen);
+		}
+		data = deflateBuf_.peek();
+		len = static_cast<int>(deflateBuf_.readableBytes());
+	}
+
+	// appends the msg DeflateMsg() framed to `userBuf` as it was sent, returns its len, -12 if malformed
+	int AppendInflated(Buf* userBuf, const char* data, size_t len)
+	{
+		static const size_t kMaxRatio = 255; // a LZ4 byte writes no more than 255 bytes
+		uint32_t v = 0;
+		size_t prefixLen = ReadVarint(data, len, v);
+		if (prefixLen == 0 || len == prefixLen)
+			return -12;
+		if ((v & 1) == 0)
+		{
+			if (v != 0)
+				return -12;
+			userBuf->append(data + 1, len - 1);
+			return static_cast<int>(len - 1);
+		}
+		size_t msgLen = v >> 1;
+		size_t compressedLen = len - prefixLen;
+		if (msgLen == 0 || msgLen / kMaxRatio > compressedLen)
+			return -12;
+		userBuf->ensureWritableBytes(msgLen);
+		if (!codec_->Decompress(data + prefixLen, compressedLen, userBuf->beginWrite(), msgLen))
+			return -12;
+		userBuf->hasWritten(msgLen);
+		return static_cast<int>(msgLen);
+	}
+
+	// decompresses the msg just appended to `userBuf` in its place
+	int InflateRcvedMsg(Buf* userBuf, int len)
+	{
+		deflateBuf_.retrieveAll();
+		deflateBuf_.append(userBuf->beginWrite() - len, len);
+		userBuf->unwrite(len);
+		return AppendInflated(userBuf, deflateBuf_.peek(), deflateBuf_.readableBytes());
+	}
+
+	// into the session's histogram `which` and its metrics shard's
+	void RecordLatency(LatencyHistogram KcpSessionLatency::* which, uint32_t ms)
+	{
+		(latency_.get()->*which).Record(ms);
+		if (metrics_)
+			(metrics_->latency_.*which).Record(ms);
+	}
+
+	void RecordLatency(LatencyHistogram KcpSessionLatency::* which, const char* stamp)
+	{
+		int32_t ms = static_cast<int32_t>(static_cast<uint32_t>(curTsMsFunc_()) - static_cast<uint32_t>(PeekInt32(stamp)));
+		RecordLatency(which, ms > 0 ? static_cast<uint32_t>(ms) : 0u);
+	}
+
+	static void KcpStageTimeFuncRaw(int stage, IUINT32 ms, IKCPCB* kcp, void* user)
+	{
+		BasicKcpSession* session = reinterpret_cast<BasicKcpSession *>(user);
+		if (stage == IKCP_STAGE_SND_QUEUE)
+			session->RecordLatency(&KcpSessionLatency::sndQueue_, ms);
+		else if (stage == IKCP_STAGE_SND_BUF)
+			session->RecordLatency(&KcpSessionLatency::sndBuf_, ms);
+		else
+			session->RecordLatency(&KcpSessionLatency::rcvBuf_, ms);
+	}
+
+	void PublishMetrics()
+	{
+		KcpSessionStats stats = GetStats();
+		metrics_->AddDelta(stats, *publishedStats_);
+		*publishedStats_ = stats;
+		if (IsConnected())
+			metrics_->Sample(stats);
+	}
+
+	static const size_t kMaxVarintLen = 5;
+
+	static size_t VarintLen(uint32_t v)
+	{
+		size_t len = 1;
+		for (; v >= 0x80; v >>= 7)
+			++len;
+		return len;
+	}
+
+	// LEB128, 7 bits a byte, low bits first
+	static size_t WriteVarint(char* dst, uint32_t v)
+	{
+		size_t len = 0;
+		for (; v >= 0x80; v >>= 7)
+			dst[len++] = static_cast<char>((v & 0x7f) | 0x80);
+		dst[len++] = static_cast<char>(v);
+		return len;
+	}
+
+	// returns the prefix len, 0 if `src` doesn't start with a whole varint
+	static size_t ReadVarint(const char* src, size_t srcLen, uint32_t& v)
+	{
+		v = 0;
+		for (size_t i = 0; i < srcLen && i < kMaxVarintLen; ++i)
+		{
+			uint8_t byte = static_cast<uint8_t>(src[i]);
+			v |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+			if ((byte & 0x80) == 0)
+				return i + 1;
+		}
+		return 0;
+	}
+
+	// the next ready msg of the highest priority stream having one
 	int KcpRecv(Buf* userBuf)
 	{
-		assert(kcp_); assert(userBuf);
-		int msgLen = ikcp_peeksize(kcp_);
+		for (int stream : streamOrder_)
+		{
+			int len = IsCoalescing() ? KcpRecvCoalesced(stream, userBuf) : KcpRecvRaw(streams_[stream].kcp_, userBuf);
+			if (len != 0)
+			{
+				lastRcvStream_ = stream;
+				return len;
+			}
+		}
+		return 0;
+	}
+
+	// a batch is taken out of kcp whole, then handed over a msg per call, -8 if malformed
+	int KcpRecvCoalesced(int stream, Buf* userBuf)
+	{
+		Buf& coalescedRcvBuf = streams_[stream].coalescedRcvBuf_;
+		if (coalescedRcvBuf.readableBytes() == 0 && KcpRecvRaw(streams_[stream].kcp_, &coalescedRcvBuf) <= 0)
+			return 0;
+		uint32_t msgLen = 0;
+		size_t prefixLen = ReadVarint(coalescedRcvBuf.peek(), coalescedRcvBuf.readableBytes(), msgLen);
+		if (prefixLen == 0 || msgLen == 0 || msgLen > coalescedRcvBuf.readableBytes() - prefixLen)
+		{
+			coalescedRcvBuf.retrieveAll();
+			return -8;
+		}
+		userBuf->append(coalescedRcvBuf.peek() + prefixLen, msgLen);
+		coalescedRcvBuf.retrieve(prefixLen + msgLen);
+		return static_cast<int>(msgLen);
+	}
+
+	static int KcpRecvRaw(ikcpcb* kcp, Buf* userBuf)
+	{
+		assert(kcp); assert(userBuf);
+		int msgLen = ikcp_peeksize(kcp);
 		if (msgLen <= 0)
 			return 0;
 		userBuf->ensureWritableBytes(msgLen);
-		ikcp_recv(kcp_, userBuf->beginWrite(), msgLen);
+		ikcp_recv(kcp, userBuf->beginWrite(), msgLen);
 		userBuf->hasWritten(msgLen); // cause the ret of ikcp_recv() equal to ikcp_peeksize()
 		return msgLen;
 	}
 
+	static const size_t kMaxStreamCnt = 256;
+	static const int kKcpHeaderLen = 24;
+
+	// stream 0 keeps the session's conv, the others flip its top byte
+	IUINT32 StreamConv(int stream) const { return conv_ ^ (static_cast<IUINT32>(stream) << 24); }
+
+	// -1 if `conv` is none of the streams'
+	int StreamOf(IUINT32 conv) const
+	{
+		IUINT32 diff = conv ^ conv_;
+		if ((diff & 0xffffff) != 0 || (diff >> 24) >= streams_.size())
+			return -1;
+		return static_cast<int>(diff >> 24);
+	}
+
+	void SortStreams()
+	{
+		streamOrder_.resize(streams_.size());
+		for (size_t i = 0; i < streamOrder_.size(); ++i)
+			streamOrder_[i] = static_cast<int>(i);
+		std::stable_sort(streamOrder_.begin(), streamOrder_.end(),
+			[this](int a, int b) { return streams_[a].priority_ > streams_[b].priority_; });
+	}
+
+	bool RdcCheck()
+	{
+		bool isOn = false;
+		for (Stream& stream : streams_)
+			isOn = ikcp_rdc_check(stream.kcp_) == 1 || isOn; // every stream's loss stats go on ticking
+		return isOn;
+	}
+
+	// a datagram carries segments of any stream, each run of one stream's segments goes to its kcp
+	int KcpInput(const char* data, int len)
+	{
+		if (streams_.size() == 1)
+			return ikcp_input(kcp_, data, len);
+		const char* runBegin = data;
+		int runStream = -1;
+		const char* p = data;
+		const char* end = data + len;
+		while (end - p >= kKcpHeaderLen)
+		{
+			IUINT32 conv = 0;
+			IUINT32 segLen = 0;
+			::memcpy(&conv, p, sizeof conv);
+			::memcpy(&segLen, p + 20, sizeof segLen);
+			conv = le32toh(conv);
+			segLen = le32toh(segLen);
+			int stream = StreamOf(conv);
+			if (stream < 0)
+				return -1; // as ikcp_input() on a wrong conv
+			if (segLen > static_cast<IUINT32>(end - p - kKcpHeaderLen))
+				return -2;
+			if (stream != runStream)
+			{
+				if (runStream >= 0)
+				{
+					int result = ikcp_input(streams_[runStream].kcp_, runBegin, static_cast<int>(p - runBegin));
+					if (result < 0)
+						return result;
+				}
+				runBegin = p;
+				runStream = stream;
+			}
+			p += kKcpHeaderLen + segLen;
+		}
+		if (runStream < 0)
+			return -1;
+		return ikcp_input(streams_[runStream].kcp_, runBegin, static_cast<int>(end - runBegin));
+	}
+
+	// ikcp_update() of every stream, highest priority first. a stream's snd_wnd covers what it
+	// has in flight and its queued segments while the session's send window lasts, the rest
+	// goes to the next stream. segments of all streams are merged into datagrams
+	void UpdateStreams(IUINT32 curTimestamp)
+	{
+		if (streams_.size() == 1)
+		{
+			ikcp_update(kcp_, curTimestamp);
+			return;
+		}
+		IUINT32 sndWnd = static_cast<IUINT32>(sndWnd_);
+		isMergingPsh_ = true;
+		for (int stream : streamOrder_)
+		{
+			ikcpcb* kcp = streams_[stream].kcp_;
+			IUINT32 wnd = std::min((kcp->snd_nxt - kcp->snd_una) + kcp->nsnd_que, sndWnd);
+			kcp->snd_wnd = wnd;
+			sndWnd -= wnd;
+			ikcp_update(kcp, curTimestamp);
+		}
+		isMergingPsh_ = false;
+		if (outputBuf_.readableBytes() > 0)
+			OutputAfterCheckingRdc(kPsh);
+	}
+
+	IUINT32 CheckStreams(IUINT32 curTimestamp) const
+	{
+		IUINT32 ts = ikcp_check(kcp_, curTimestamp);
+		for (size_t i = 1; i < streams_.size(); ++i)
+		{
+			IUINT32 streamTs = ikcp_check(streams_[i].kcp_, curTimestamp);
+			if (static_cast<int32_t>(streamTs - ts) < 0)
+				ts = streamTs;
+		}
+		return ts;
+	}
+
 	static int KcpPshOutputFuncRaw(const char* data, int len, IKCPCB* kcp, void* user)
 	{
-		(void)kcp;
-		auto thisPtr = reinterpret_cast<KcpSession *>(user);
+		auto thisPtr = reinterpret_cast<BasicKcpSession *>(user);
+		if (thisPtr->isMergingPsh_)
+		{
+			// the streams fill datagrams together, one goes out once the next segment won't fit.
+			// a segment cut for a larger mtu than the current one goes out alone, Rdc splits it
+			size_t pendingLen = thisPtr->outputBuf_.readableBytes();
+			if (pendingLen > 0 && pendingLen + len > kcp->mtu)
+				thisPtr->OutputAfterCheckingRdc(kPsh);
+			thisPtr->outputBuf_.append(data, len);
+			return 0;
+		}
 		thisPtr->outputBuf_.append(data, len);
 		return thisPtr->OutputAfterCheckingRdc(kPsh);
 	}
 
+	static const size_t kStateSeqLen = 4;
+
+	// a state packet is the seq of its Update() and the updates as [varint key][varint len][data]
+	static size_t StateEntryLen(uint32_t key, size_t len)
+	{ return VarintLen(key) + VarintLen(static_cast<uint32_t>(len)) + len; }
+
+	static size_t MaxStateBodyLen(int mtu) { return mtu - RdcType::ReliableOverhead(); }
+
+	int FlushStates()
+	{
+		size_t maxBodyLen = MaxStateBodyLen(GetPathMtu());
+		int result = 0;
+		// an Update() sends every key once, its packets share a seq
+		++stateSndSeq_;
+		for (size_t i = 0; i < pendingStateCnt_ && result >= 0; ++i)
+		{
+			const PendingState& state = pendingStates_[i];
+			if (outputBuf_.readableBytes() > 0
+				&& outputBuf_.readableBytes() + StateEntryLen(state.key_, state.data_.size()) > maxBodyLen)
+				result = OutputAfterCheckingRdc(kStatePkt);
+			if (outputBuf_.readableBytes() == 0)
+				outputBuf_.appendInt32(static_cast<int32_t>(stateSndSeq_));
+			char prefix[kMaxVarintLen];
+			outputBuf_.append(prefix, WriteVarint(prefix, state.key_));
+			outputBuf_.append(prefix, WriteVarint(prefix, static_cast<uint32_t>(state.data_.size())));
+			outputBuf_.append(state.data_.data(), state.data_.size());
+			CountMsg(stats_.state_.msgsOut_, stats_.state_.bytesOut_, state.msgLen_);
+		}
+		if (result >= 0 && outputBuf_.readableBytes() > 0)
+			result = OutputAfterCheckingRdc(kStatePkt);
+		outputBuf_.retrieveAll();
+		pendingStateCnt_ = 0;
+		pendingStateIndex_.clear();
+		return result;
+	}
+
+	// keeps the updates newer than the last handed over of their key, -9 if malformed
+	int KeepNewerStates(const char* data, int len)
+	{
+		if (len < static_cast<int>(kStateSeqLen))
+			return -9;
+		uint32_t seq = static_cast<uint32_t>(PeekInt32(data));
+		IUINT32 curTimestamp = static_cast<IUINT32>(curTsMsFunc_());
+		const char* p = data + kStateSeqLen;
+		size_t left = len - kStateSeqLen;
+		while (left > 0)
+		{
+			uint32_t key = 0;
+			uint32_t stateLen = 0;
+			size_t keyLen = ReadVarint(p, left, key);
+			size_t prefixLen = keyLen > 0 ? ReadVarint(p + keyLen, left - keyLen, stateLen) : 0;
+			if (prefixLen == 0 || stateLen == 0 || stateLen > left - keyLen - prefixLen)
+				return -9;
+			size_t entryLen = keyLen + prefixLen + stateLen;
+			auto it = stateRcvSeq_.find(key);
+			if (it == stateRcvSeq_.end() || static_cast<int32_t>(seq - it->second.seq_) > 0)
+			{
+				RcvStateSeq& last = stateRcvSeq_[key];
+				last.seq_ = seq;
+				last.ts_ = curTimestamp;
+				stateRcvBuf_.append(p, entryLen);
+			}
+			p += entryLen;
+			left -= entryLen;
+		}
+		return 0;
+	}
+
+	// a key quiet that long has gone or its peer restarted, an update of it later is handed
+	// over whatever its seq. swept every kStateKeyIdleMs, a key goes within twice that
+	static const IUINT32 kStateKeyIdleMs = 5000;
+
+	void ForgetQuietStates(IUINT32 curTimestamp)
+	{
+		for (auto it = stateRcvSeq_.begin(); it != stateRcvSeq_.end();)
+		{
+			if (static_cast<IINT32>(curTimestamp - it->second.ts_) >= static_cast<IINT32>(kStateKeyIdleMs))
+				it = stateRcvSeq_.erase(it);
+			else
+				++it;
+		}
+		nextStateSweepTs_ = curTimestamp + kStateKeyIdleMs;
+	}
+
+	int RecvState(Buf* userBuf)
+	{
+		uint32_t stateLen = 0;
+		size_t keyLen = ReadVarint(stateRcvBuf_.peek(), stateRcvBuf_.readableBytes(), lastRcvKey_);
+		size_t prefixLen = ReadVarint(stateRcvBuf_.peek() + keyLen, stateRcvBuf_.readableBytes() - keyLen, stateLen);
+		const char* state = stateRcvBuf_.peek() + keyLen + prefixLen;
+		int len = static_cast<int>(stateLen);
+		if (IsCompressing(false))
+			len = AppendInflated(userBuf, state, stateLen);
+		else
+			userBuf->append(state, stateLen);
+		stateRcvBuf_.retrieve(keyLen + prefixLen + stateLen);
+		lastRcvMode_ = kState;
+		lastRcvStream_ = 0;
+		if (len > 0)
+			CountMsg(stats_.state_.msgsIn_, stats_.state_.bytesIn_, len);
+		return len;
+	}
+
+	static void CountMsg(uint64_t& cnt, uint64_t& bytes, size_t len)
+	{
+		++cnt;
+		bytes += len;
+	}
+
 	int OutputAfterCheckingRdc(PktTypeE pktType) { return rdc_.Output(&outputBuf_, pktType); }
 
 private:
 	ikcpcb* kcp_;
-	UserInputFunction userInputFunc_;
+	InputPolicy userInputFunc_;
 	ConnectionStateE curConnState_;
 	Buf outputBuf_;
 	Buf inputBuf_;
-	CurrentTimestampMsFunction curTsMsFunc_;
+	ClockPolicy curTsMsFunc_;
 	IUINT32 conv_;
 	RoleTypeE role_;
 	std::deque<std::string> pendingSndDataDeque_;
-	Rdc rdc_;
+	std::deque<IUINT32> pendingSndDeadlines_; // of pendingSndDataDeque_'s msgs, 0 for none
+	RdcType rdc_;
+	RedundancyModeE rdcMode_;
 	IUINT32 nextUpdateTs_;
 	KcpSessionConnectionCallback connectionCallback_;
 	bool hasDataLeft_;
@@ -1251,6 +3723,93 @@ private:
 	int streamMode_;
 	int mtu_;
 	int rx_minrto_;
+
+private:
+	// path mtu discovery
+	Pmtud pmtud_;
+	bool pmtudOn_;
+	int pmtudBaseMtu_;
+	int pmtudMaxMtu_;
+	int appliedMtu_;
+	uint64_t pmtudAnsweredDatagrams_; // FullSizeDatagramsOut() as of the last probe ack of the mtu
+	IUINT32 pmtudConfirmTs_; // no confirmation before then
+
+private:
+	// adaptive flush interval
+	int intervalMin_;
+	int intervalMax_;
+
+private:
+	// delayed ack
+	int ackEvery_;
+	int ackDelay_;
+
+private:
+	// small msg coalescing
+	bool coalesceOn_;
+	int coalesceDelay_;
+	int coalesceMaxBytes_;
+	Buf unorderedFrameBuf_;
+
+private:
+	// reliable streams, streams_[0] is the default one whose kcp is kcp_
+	struct Stream
+	{
+		explicit Stream(int priority) : kcp_(nullptr), priority_(priority), coalesceDeadlineTs_(0) {}
+		ikcpcb* kcp_;
+		int priority_;
+		IUINT32 coalesceDeadlineTs_;
+		Buf coalesceBuf_;
+		Buf coalescedRcvBuf_;
+	};
+	std::vector<Stream> streams_;
+	std::vector<int> streamOrder_; // stream ids, highest priority first
+	std::deque<std::pair<int, std::string>> pendingStreamSndDeque_; // other streams' msgs sent before connected
+	bool isMergingPsh_;
+	int lastRcvStream_;
+
+private:
+	// latest-only state
+	struct PendingState
+	{
+		uint32_t key_;
+		std::string data_;
+		size_t msgLen_; // before compression
+	};
+	struct RcvStateSeq
+	{
+		uint32_t seq_; // of the last update handed over
+		IUINT32 ts_; // when it came
+	};
+	TransmitModeE lastRcvMode_;
+	uint32_t lastRcvKey_;
+	uint32_t stateSndSeq_;
+	std::vector<PendingState> pendingStates_; // the first pendingStateCnt_ ones, the others keep their capacity
+	size_t pendingStateCnt_;
+	std::unordered_map<uint32_t, size_t> pendingStateIndex_;
+	std::unordered_map<uint32_t, RcvStateSeq> stateRcvSeq_; // of every key not quiet for kStateKeyIdleMs
+	IUINT32 nextStateSweepTs_;
+	Buf stateRcvBuf_;
+
+private:
+	// counters of GetStats(), the gauges are read when it is called
+	KcpSessionStats stats_;
+
+private:
+	// latency tracking
+	std::unique_ptr<KcpSessionLatency> latency_;
+	Buf stampBuf_;
+
+	int traceMask_;
+
+	std::unique_ptr<Lz4Codec> codec_; // SetCompression()
+	int compressMinLen_;
+	Buf deflateBuf_;
+
+	static const IUINT32 kMetricsIntervalMs = 1000;
+	MetricsShard* metrics_;
+	std::unique_ptr<KcpSessionStats> publishedStats_; // the stats last added to metrics_
+	IUINT32 nextMetricsTs_;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kcpp.h"
+
+// capture of a session's datagrams at its output/input policies, for replaying a production
+// session offline(see test/KcppReplay.cpp). the session thread copies each datagram into a ring,
+// a writer thread empties it to the file, the session never waits on the disk nor on a lock:
+//	kcpp::capture::Writer writer("session.kcap", kcpp::kSrv);
+//	KcpSession session(kcpp::kSrv,
+//		kcpp::capture::MakeOutput(output, clock, &writer),
+//		kcpp::capture::MakeInput(input, clock, &writer), clock);
+// file : the 8 byte magic, the role byte of the captured session, then records of
+// ts(int64, the session's clock) | direction(uint8) | len(uint16) | datagram, little endian
+
+namespace kcpp
+{
+namespace capture
+{
+
+enum DirectionE { kOut, kIn };
+
+static const char kMagic[8] = { 'K', 'C', 'P', 'P', 'C', 'A', 'P', '1' };
+static const size_t kFileHeaderLen = sizeof kMagic + 1;
+static const size_t kRecordHeaderLen = 8 + 1 + 2;
+
+// one producer, the thread of the sessions it captures
+class Writer
+{
+public:
+	static const size_t kDefaultRingLen = 1 << 20;
+
+	// `ringLen` rounded up to a power of two, records not fitting the ring are dropped
+	Writer(const char* path, RoleTypeE role, size_t ringLen = kDefaultRingLen)
+		: file_(fopen(path, "wb")), mask_(0), head_(0), tail_(0), isStopping_(false), droppedCnt_(0)
+	{
+		size_t len = 1024;
+		while (len < ringLen)
+			len <<= 1;
+		ring_.resize(len);
+		mask_ = len - 1;
+		if (!file_)
+			return;
+		char header[kFileHeaderLen];
+		memcpy(header, kMagic, sizeof kMagic);
+		header[sizeof kMagic] = static_cast<char>(role);
+		fwrite(header, 1, sizeof header, file_);
+		thread_ = std::thread(&Writer::Run, this);
+	}
+
+	// writes what is left in the ring
+	~Writer()
+	{
+		if (!file_)
+			return;
+		isStopping_.store(true, std::memory_order_release);
+		thread_.join();
+		fclose(file_);
+	}
+
+	Writer(const Writer&) = delete;
+	Writer& operator=(const Writer&) = delete;
+
+	bool IsOpen() const { return file_ != nullptr; }
+
+	void Record(int64_t ts, DirectionE direction, const void* data, int len)
+	{
+		size_t recordLen = kRecordHeaderLen + len;
+		uint64_t head = head_.load(std::memory_order_relaxed);
+		if (!file_ || len < 0 || len > 0xffff
+			|| recordLen > ring_.size() - (head - tail_.load(std::memory_order_acquire)))
+		{
+			droppedCnt_.store(droppedCnt_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+		char header[kRecordHeaderLen];
+		for (int i = 0; i < 8; ++i)
+			header[i] = static_cast<char>(static_cast<uint64_t>(ts) >> (8 * i));
+		header[8] = static_cast<char>(direction);
+		header[9] = static_cast<char>(len);
+		header[10] = static_cast<char>(len >> 8);
+		Put(head, header, kRecordHeaderLen);
+		Put(head + kRecordHeaderLen, static_cast<const char*>(data), len);
+		head_.store(head + recordLen, std::memory_order_release);
+	}
+
+	// records that found the ring full
+	uint64_t DroppedCnt() const { return droppedCnt_.load(std::memory_order_relaxed); }
+
+private:
+	void Put(uint64_t pos, const char* data, size_t len)
+	{
+		size_t offset = static_cast<size_t>(pos & mask_);
+		size_t firstLen = std::min(len, ring_.size() - offset);
+		memcpy(&ring_[offset], data, firstLen);
+		memcpy(&ring_[0], data + firstLen, len - firstLen);
+	}
+
+	void Run()
+	{
+		for (;;)
+		{
+			bool isStopping = isStopping_.load(std::memory_order_acquire);
+			uint64_t tail = tail_.load(std::memory_order_relaxed);
+			uint64_t head = head_.load(std::memory_order_acquire);
+			if (head != tail)
+			{
+				size_t offset = static_cast<size_t>(tail & mask_);
+				size_t len = static_cast<size_t>(head - tail);
+				size_t firstLen = std::min(len, ring_.size() - offset);
+				fwrite(&ring_[offset], 1, firstLen, file_);
+				fwrite(&ring_[0], 1, len - firstLen, file_);
+				tail_.store(head, std::memory_order_release);
+			}
+			else if (isStopping)
+				break;
+			else
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+		fflush(file_);
+	}
+
+	FILE* file_;
+	std::vector<char> ring_;
+	size_t mask_;
+	std::atomic<uint64_t> head_; // written by the session thread
+	std::atomic<uint64_t> tail_; // written by the writer thread
+	std::atomic<bool> isStopping_;
+	std::atomic<uint64_t> droppedCnt_;
+	std::thread thread_;
+};
+
+// the session's policies with the datagrams recorded on the way, no capture if `writer` is null
+template <typename OutputPolicy, typename ClockPolicy>
+struct Output
+{
+	Output(const OutputPolicy& output, const ClockPolicy& clock, Writer* writer)
+		: output_(output), clock_(clock), writer_(writer)
+	{}
+
+	void operator()(const void* data, int len) const
+	{
+		if (writer_)
+			writer_->Record(clock_(), kOut, data, len);
+		output_(data, len);
+	}
+
+	OutputPolicy output_;
+	ClockPolicy clock_;
+	Writer* writer_;
+};
+
+template <typename InputPolicy, typename ClockPolicy>
+struct Input
+{
+	Input(const InputPolicy& input, const ClockPolicy& clock, Writer* writer)
+		: input_(input), clock_(clock), writer_(writer)
+	{}
+
+	UserInputData operator()() const
+	{
+		UserInputData data = input_();
+		if (writer_ && data.len_ > 0)
+			writer_->Record(clock_(), kIn, data.data_, data.len_);
+		return data;
+	}
+
+	InputPolicy input_;
+	ClockPolicy clock_;
+	Writer* writer_;
+};
+
+template <typename OutputPolicy, typename ClockPolicy>
+Output<OutputPolicy, ClockPolicy> MakeOutput(const OutputPolicy& output, const ClockPolicy& clock, Writer* writer)
+{ return Output<OutputPolicy, ClockPolicy>(output, clock, writer); }
+
+template <typename InputPolicy, typename ClockPolicy>
+Input<InputPolicy, ClockPolicy> MakeInput(const InputPolicy& input, const ClockPolicy& clock, Writer* writer)
+{ return Input<InputPolicy, ClockPolicy>(input, clock, writer); }
+
+struct Record
+{
+	int64_t ts_;
+	DirectionE direction_;
+	std::string datagram_;
+};
+
+class Reader
+{
+public:
+	explicit Reader(const char* path) : file_(fopen(path, "rb")), role_(kSrv), isValid_(false)
+	{
+		char header[kFileHeaderLen];
+		if (file_ && fread(header, 1, sizeof header, file_) == sizeof header
+			&& memcmp(header, kMagic, sizeof kMagic) == 0)
+		{
+			role_ = static_cast<RoleTypeE>(header[sizeof kMagic]);
+			isValid_ = true;
+		}
+	}
+
+	~Reader()
+	{
+		if (file_)
+			fclose(file_);
+	}
+
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+
+	bool IsValid() const { return isValid_; }
+	RoleTypeE Role() const { return role_; }
+
+	// false at the end of the file or at a truncated record
+	bool Next(Record& record)
+	{
+		unsigned char header[kRecordHeaderLen];
+		if (!isValid_ || fread(header, 1, sizeof header, file_) != sizeof header)
+			return false;
+		uint64_t ts = 0;
+		for (int i = 7; i >= 0; --i)
+			ts = (ts << 8) | header[i];
+		record.ts_ = static_cast<int64_t>(ts);
+		record.direction_ = static_cast<DirectionE>(header[8]);
+		size_t len = header[9] | (static_cast<size_t>(header[10]) << 8);
+		record.datagram_.resize(len);
+		return len == 0 || fread(&record.datagram_[0], 1, len, file_) == len;
+	}
+
+private:
+	FILE* file_;
+	RoleTypeE role_;
+	bool isValid_;
+};
+
+}
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kcpp.h"
+
+#if !defined(_WIN32)
+#	include <arpa/inet.h>
+#	include <netinet/in.h>
+#	include <poll.h>
+#	include <sys/socket.h>
+#	include <sys/time.h>
+#	include <unistd.h>
+#	if !defined(MSG_NOSIGNAL)
+#		define MSG_NOSIGNAL 0 // SO_NOSIGPIPE instead, see MetricsHttpServer::Serve()
+#	endif
+#endif
+
+// server wide metrics in the Prometheus text format. a shard per network thread, its sessions add
+// to it(SetMetrics()) with relaxed stores and never wait on a scrape, a scrape sums the shards:
+//	kcpp::MetricsRegistry registry;
+//	kcpp::MetricsShard* shard = registry.AddShard(); // on each network thread's behalf
+//	session.SetMetrics(shard);
+//	kcpp::MetricsHttpServer http(registry, 9100); // or registry.Render() into your own endpoint
+// packets per second, redundancy overhead and retransmit ratio are left to the queries, e.g.
+//	rate(kcpp_redundant_bytes_total[1m]) / rate(kcpp_datagram_bytes_total{direction="out"}[1m])
+//	sum(rate(kcpp_retransmits_total[1m])) / rate(kcpp_datagrams_total{direction="out"}[1m])
+
+namespace kcpp
+{
+
+class MetricsRegistry
+{
+public:
+	MetricsRegistry() {}
+
+	MetricsRegistry(const MetricsRegistry&) = delete;
+	MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+	// owned by the registry, valid as long as it is
+	MetricsShard* AddShard()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		shards_.emplace_back(new MetricsShard());
+		return shards_.back().get();
+	}
+
+	std::string Render() const
+	{
+		std::string out;
+		Render(out);
+		return out;
+	}
+
+	// appends the text exposition of every shard summed up to `out`
+	void Render(std::string& out) const
+	{
+		int64_t liveSessions = 0;
+		int64_t connectedSessions = 0;
+		const Counter* defs = Counters();
+		uint64_t counters[kCounterCnt] = {};
+		LatencyHistogram srttMs;
+		LatencyHistogram sndQueue;
+		LatencyHistogram sndBuf;
+		KcpSessionLatency latency;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (const std::unique_ptr<MetricsShard>& shard : shards_)
+			{
+				liveSessions += shard->liveSessions_.load(std::memory_order_relaxed);
+				connectedSessions += shard->connectedSessions_.load(std::memory_order_relaxed);
+				for (size_t i = 0; i < kCounterCnt; ++i)
+					counters[i] += ((*shard).*defs[i].counter_).load(std::memory_order_relaxed);
+				srttMs.Merge(shard->srttMs_);
+				sndQueue.Merge(shard->sndQueue_);
+				sndBuf.Merge(shard->sndBuf_);
+				latency.Merge(shard->latency_);
+			}
+		}
+
+		AppendHeader(out, "kcpp_sessions", "gauge", "Sessions set on a shard and not yet destroyed.");
+		AppendValue(out, "kcpp_sessions", "", liveSessions);
+		AppendHeader(out, "kcpp_sessions_connected", "gauge", "Sessions connected.");
+		AppendValue(out, "kcpp_sessions_connected", "", connectedSessions);
+		for (size_t i = 0; i < kCounterCnt; ++i)
+		{
+			if (i == 0 || strcmp(defs[i].name_, defs[i - 1].name_) != 0)
+				AppendHeader(out, defs[i].name_, "counter", defs[i].help_);
+			AppendValue(out, defs[i].name_, defs[i].labels_, static_cast<int64_t>(counters[i]));
+		}
+
+		AppendHeader(out, "kcpp_srtt_ms", "histogram", "Smoothed rtt of the connected sessions, sampled once a second.");
+		AppendHistogram(out, "kcpp_srtt_ms", "", srttMs);
+		AppendHeader(out, "kcpp_snd_queue_segments", "histogram",
+			"Segments waiting for the send window, sampled once a second.");
+		AppendHistogram(out, "kcpp_snd_queue_segments", "", sndQueue);
+		AppendHeader(out, "kcpp_snd_buf_segments", "histogram", "Segments in flight, sampled once a second.");
+		AppendHistogram(out, "kcpp_snd_buf_segments", "", sndBuf);
+		AppendHeader(out, "kcpp_msg_latency_ms", "histogram", "Send() to the peer's Recv(), sessions tracking latency.");
+		AppendHistogram(out, "kcpp_msg_latency_ms", "channel=\"unreliable\"", latency.unreliable_);
+		AppendHistogram(out, "kcpp_msg_latency_ms", "channel=\"reliable\"", latency.reliable_);
+		AppendHeader(out, "kcpp_stage_ms", "histogram", "Time reliable segments spend in kcp's queues, sessions tracking latency.");
+		AppendHistogram(out, "kcpp_stage_ms", "stage=\"snd_queue\"", latency.sndQueue_);
+		AppendHistogram(out, "kcpp_stage_ms", "stage=\"snd_buf\"", latency.sndBuf_);
+		AppendHistogram(out, "kcpp_stage_ms", "stage=\"rcv_buf\"", latency.rcvBuf_);
+	}
+
+private:
+	struct Counter
+	{
+		const char* name_; // the counters of a name are next to each other
+		const char* labels_;
+		const char* help_;
+		std::atomic<uint64_t> MetricsShard::* counter_;
+	};
+
+	static const size_t kCounterCnt = 15;
+
+	// in the order they are rendered
+	static const Counter* Counters()
+	{
+		static const Counter counters[kCounterCnt] =
+		{
+			{ "kcpp_handshakes_total", "", "Sessions that got connected.", &MetricsShard::handshakes_ },
+			{ "kcpp_rejected_packets_total", "", "Packets dropped as malformed or for a session not connected.", &MetricsShard::rejectedPktsIn_ },
+			{ "kcpp_datagrams_total", "direction=\"out\"", "Datagrams through the sessions' callbacks.", &MetricsShard::datagramsOut_ },
+			{ "kcpp_datagrams_total", "direction=\"in\"", "", &MetricsShard::datagramsIn_ },
+			{ "kcpp_datagram_bytes_total", "direction=\"out\"", "Bytes of the datagrams.", &MetricsShard::datagramBytesOut_ },
+			{ "kcpp_datagram_bytes_total", "direction=\"in\"", "", &MetricsShard::datagramBytesIn_ },
+			{ "kcpp_redundant_bytes_total", "", "Previous packets resent along with the latest while redundancy is on.", &MetricsShard::redundantBytesOut_ },
+			{ "kcpp_msgs_total", "direction=\"out\"", "User msgs, every channel.", &MetricsShard::msgsOut_ },
+			{ "kcpp_msgs_total", "direction=\"in\"", "", &MetricsShard::msgsIn_ },
+			{ "kcpp_msg_bytes_total", "direction=\"out\"", "Payload bytes of the user msgs.", &MetricsShard::msgBytesOut_ },
+			{ "kcpp_msg_bytes_total", "direction=\"in\"", "", &MetricsShard::msgBytesIn_ },
+			{ "kcpp_retransmits_total", "kind=\"timeout\"", "Kcp segments resent.", &MetricsShard::timeoutRetransmits_ },
+			{ "kcpp_retransmits_total", "kind=\"fast\"", "", &MetricsShard::fastRetransmits_ },
+			{ "kcpp_duplicate_segments_total", "", "Kcp segments received more than once.", &MetricsShard::duplicatesIn_ },
+			{ "kcpp_reassembly_drops_total", "", "Fragmented msgs given up with fragments missing.", &MetricsShard::reassemblyDrops_ },
+		};
+		return counters;
+	}
+
+	static void AppendHeader(std::string& out, const char* name, const char* type, const char* help)
+	{
+		out += "# HELP ";
+		out += name;
+		out += ' ';
+		out += help;
+		out += "\n# TYPE ";
+		out += name;
+		out += ' ';
+		out += type;
+		out += '\n';
+	}
+
+	static void AppendValue(std::string& out, const char* name, const char* labels, int64_t value)
+	{
+		char line[256];
+		snprintf(line, sizeof line, labels[0] ? "%s{%s} %lld\n" : "%s%s %lld\n", name, labels,
+			static_cast<long long>(value));
+		out += line;
+	}
+
+	// buckets at 2^n - 1, where LatencyHistogram counts exactly
+	static void AppendHistogram(std::string& out, const char* name, const char* labels, const LatencyHistogram& histogram)
+	{
+		static const int kMaxBucketBits = 15;
+		std::string bucketName = std::string(name) + "_bucket";
+		std::string bucketLabels = labels;
+		if (!bucketLabels.empty())
+			bucketLabels += ',';
+		char le[48];
+		for (int bits = 0; bits <= kMaxBucketBits; ++bits)
+		{
+			uint32_t value = (1u << bits) - 1;
+			snprintf(le, sizeof le, "le=\"%u\"", value);
+			AppendValue(out, bucketName.c_str(), (bucketLabels + le).c_str(),
+				static_cast<int64_t>(histogram.CountAtMost(value)));
+		}
+		uint64_t count = histogram.Count();
+		AppendValue(out, bucketName.c_str(), (bucketLabels + "le=\"+Inf\"").c_str(), static_cast<int64_t>(count));
+		AppendValue(out, (std::string(name) + "_sum").c_str(), labels, static_cast<int64_t>(histogram.Sum()));
+		AppendValue(out, (std::string(name) + "_count").c_str(), labels, static_cast<int64_t>(count));
+	}
+
+	mutable std::mutex mutex_; // guards shards_, never taken by the network threads
+	std::vector<std::unique_ptr<MetricsShard>> shards_;
+};
+
+#if !defined(_WIN32)
+
+// serves registry.Render() to any request on 127.0.0.1:`port`(0 : any free port, see Port())
+// from a thread of its own, one connection at a time. not on windows, serve Render() from yours there
+class MetricsHttpServer
+{
+public:
+	MetricsHttpServer(const MetricsRegistry& registry, int port)
+		: registry_(registry), fd_(socket(AF_INET, SOCK_STREAM, 0)), port_(0), isStopping_(false)
+	{
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(static_cast<uint16_t>(port));
+		socklen_t addrLen = sizeof addr;
+		int reuse = 1;
+		if (fd_ < 0
+			|| setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse) != 0
+			|| bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0
+			|| listen(fd_, 16) != 0
+			|| getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &addrLen) != 0)
+		{
+			if (fd_ >= 0)
+				close(fd_);
+			fd_ = -1;
+			return;
+		}
+		port_ = ntohs(addr.sin_port);
+		thread_ = std::thread(&MetricsHttpServer::Run, this);
+	}
+
+	~MetricsHttpServer()
+	{
+		if (fd_ < 0)
+			return;
+		isStopping_.store(true, std::memory_order_relaxed);
+		thread_.join();
+		close(fd_);
+	}
+
+	MetricsHttpServer(const MetricsHttpServer&) = delete;
+	MetricsHttpServer& operator=(const MetricsHttpServer&) = delete;
+
+	bool IsListening() const { return fd_ >= 0; }
+	int Port() const { return port_; }
+
+private:
+	void Run()
+	{
+		static const int kPollMs = 100;
+		while (!isStopping_.load(std::memory_order_relaxed))
+		{
+			pollfd pfd;
+			pfd.fd = fd_;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, kPollMs) <= 0)
+				continue;
+			int conn = accept(fd_, nullptr, nullptr);
+			if (conn < 0)
+				continue;
+			Serve(conn);
+			close(conn);
+		}
+	}
+
+	// the request isn't looked at, every path gets the metrics
+	void Serve(int conn) const
+	{
+		timeval timeout;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+#if defined(SO_NOSIGPIPE)
+		int noSigPipe = 1;
+		setsockopt(conn, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof noSigPipe);
+#endif
+		char request[4096];
+		if (recv(conn, request, sizeof request, 0) <= 0)
+			return;
+
+		std::string body = registry_.Render();
+		char header[160];
+		snprintf(header, sizeof header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %u\r\nConnection: close\r\n\r\n", static_cast<unsigned>(body.size()));
+		std::string response = header + body;
+		for (size_t sent = 0; sent < response.size(); )
+		{
+			ssize_t n = send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			sent += static_cast<size_t>(n);
+		}
+	}
+
+	const MetricsRegistry& registry_;
+	int fd_;
+	int port_;
+	std::atomic<bool> isStopping_;
+	std::thread thread_;
+};
+
+#endif
+
+}
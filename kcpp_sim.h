@@ -0,0 +1,259 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "kcpp.h"
+
+// an in-process network for benchmarks and regression runs of kcpp : a virtual clock and one-way
+// links emulating latency, jitter, bandwidth, a bottleneck queue, Gilbert-Elliott burst loss,
+// reordering, duplication and a path mtu. the links plug in as a session's output/input policies
+// and the clock as its clock policy, nothing waits on real time and a seed gives the same run every time
+
+namespace kcpp
+{
+namespace sim
+{
+
+// virtual time in ms, only moves when told to
+class Clock
+{
+public:
+	explicit Clock(int64_t now = 1000) : now_(now) {}
+
+	int64_t Now() const { return now_; }
+	void Advance(int64_t ms) { now_ += ms; }
+	void AdvanceTo(int64_t ts) { now_ = std::max(now_, ts); }
+
+private:
+	int64_t now_;
+};
+
+struct LinkConfig
+{
+	LinkConfig()
+		: delayMs_(20), jitterMs_(0), bandwidth_(0), queueBytes_(0),
+		lossRate_(0), burstLossRate_(0), goodToBadRate_(0), badToGoodRate_(1),
+		reorderRate_(0), reorderDelayMs_(0), duplicateRate_(0), mtu_(0), seed_(1)
+	{}
+
+	int delayMs_; // one-way propagation delay
+	int jitterMs_; // extra delay uniform in [0, jitterMs_], it doesn't reorder by itself
+	int64_t bandwidth_; // bytes per second, 0 : unlimited
+	size_t queueBytes_; // bottleneck queue, datagrams finding it full are dropped, 0 : unlimited
+
+	// Gilbert-Elliott loss, a good and a bad state losing `lossRate_` and `burstLossRate_`
+	// of the datagrams, going good to bad with `goodToBadRate_` per datagram and back with
+	// `badToGoodRate_`. `goodToBadRate_` 0 : independent loss of `lossRate_`
+	double lossRate_;
+	double burstLossRate_;
+	double goodToBadRate_;
+	double badToGoodRate_;
+
+	double reorderRate_; // held back `reorderDelayMs_` more, the datagrams after it pass it
+	int reorderDelayMs_;
+	double duplicateRate_; // delivered twice
+	int mtu_; // the largest datagram carried, ip and udp headers included, 0 : unlimited
+	uint32_t seed_;
+};
+
+struct LinkStats
+{
+	LinkStats() : sent_(0), lost_(0), queueDrops_(0), mtuDrops_(0), reordered_(0), duplicated_(0), delivered_(0), deliveredBytes_(0) {}
+
+	uint64_t sent_; // datagrams handed to the link
+	uint64_t lost_;
+	uint64_t queueDrops_;
+	uint64_t mtuDrops_; // above the path mtu
+	uint64_t reordered_;
+	uint64_t duplicated_;
+	uint64_t delivered_; // datagrams handed out by Recv(), duplicates included
+	uint64_t deliveredBytes_;
+};
+
+// one direction of a path
+class Link
+{
+public:
+	explicit Link(const Clock* clock, const LinkConfig& config = LinkConfig())
+		: clock_(clock), config_(config), rng_(config.seed_), isBad_(false),
+		busyUntilUs_(0), lastArrivalTs_(0), nextSeq_(0)
+	{}
+
+	void Send(const void* data, int len)
+	{
+		++stats_.sent_;
+		if (config_.mtu_ > 0 && len + static_cast<int>(Rdc::kIpUdpHeaderLen) > config_.mtu_)
+		{
+			++stats_.mtuDrops_;
+			return;
+		}
+		int64_t nowUs = clock_->Now() * 1000;
+		int64_t departureUs = nowUs;
+		if (config_.bandwidth_ > 0)
+		{
+			int64_t startUs = std::max(nowUs, busyUntilUs_);
+			int64_t queuedBytes = (startUs - nowUs) * config_.bandwidth_ / 1000000;
+			if (config_.queueBytes_ > 0 && queuedBytes + len > static_cast<int64_t>(config_.queueBytes_))
+			{
+				++stats_.queueDrops_;
+				return;
+			}
+			busyUntilUs_ = startUs + static_cast<int64_t>(len) * 1000000 / config_.bandwidth_;
+			departureUs = busyUntilUs_;
+		}
+		if (IsLost())
+		{
+			++stats_.lost_;
+			return;
+		}
+
+		int64_t arrivalTs = (departureUs + 999) / 1000 + config_.delayMs_ + Jitter();
+		if (Chance(config_.reorderRate_))
+		{
+			++stats_.reordered_;
+			Push(arrivalTs + config_.reorderDelayMs_, data, len);
+		}
+		else
+		{
+			arrivalTs = std::max(arrivalTs, lastArrivalTs_);
+			lastArrivalTs_ = arrivalTs;
+			Push(arrivalTs, data, len);
+		}
+		if (Chance(config_.duplicateRate_))
+		{
+			++stats_.duplicated_;
+			Push(arrivalTs + Jitter(), data, len);
+		}
+	}
+
+	// the next datagram arrived by now, len -1 as a non-blocking recvfrom() if none.
+	// the data stays valid till the next Recv()
+	UserInputData Recv()
+	{
+		if (inFlight_.empty() || inFlight_.front().arrivalTs_ > clock_->Now())
+			return UserInputData(nullptr, -1);
+		std::pop_heap(inFlight_.begin(), inFlight_.end(), LaterFirst());
+		received_.swap(inFlight_.back().data_);
+		inFlight_.pop_back();
+		++stats_.delivered_;
+		stats_.deliveredBytes_ += received_.size();
+		return UserInputData(&received_[0], static_cast<int>(received_.size()));
+	}
+
+	// -1 if nothing is in flight
+	int64_t NextArrivalTs() const { return inFlight_.empty() ? -1 : inFlight_.front().arrivalTs_; }
+
+	size_t InFlightCnt() const { return inFlight_.size(); }
+	const LinkStats& Stats() const { return stats_; }
+	const LinkConfig& Config() const { return config_; }
+
+	// takes effect for the datagrams sent from now on, the random sequence goes on
+	void SetConfig(const LinkConfig& config) { config_ = config; }
+
+private:
+	struct Datagram
+	{
+		int64_t arrivalTs_;
+		uint64_t seq_; // same arrival, first sent first out
+		std::string data_;
+	};
+
+	struct LaterFirst
+	{
+		bool operator()(const Datagram& lhs, const Datagram& rhs) const
+		{ return lhs.arrivalTs_ != rhs.arrivalTs_ ? lhs.arrivalTs_ > rhs.arrivalTs_ : lhs.seq_ > rhs.seq_; }
+	};
+
+	void Push(int64_t arrivalTs, const void* data, int len)
+	{
+		inFlight_.push_back(Datagram());
+		Datagram& datagram = inFlight_.back();
+		datagram.arrivalTs_ = arrivalTs;
+		datagram.seq_ = nextSeq_++;
+		datagram.data_.assign(static_cast<const char*>(data), len);
+		std::push_heap(inFlight_.begin(), inFlight_.end(), LaterFirst());
+	}
+
+	bool IsLost()
+	{
+		if (config_.goodToBadRate_ <= 0)
+			return Chance(config_.lossRate_);
+		isBad_ = Chance(isBad_ ? 1 - config_.badToGoodRate_ : config_.goodToBadRate_);
+		return Chance(isBad_ ? config_.burstLossRate_ : config_.lossRate_);
+	}
+
+	// mt19937's output is the same everywhere, unlike the std distributions built on it
+	bool Chance(double rate) { return rate > 0 && rng_() < rate * 4294967296.0; }
+	int Jitter() { return config_.jitterMs_ > 0 ? static_cast<int>(rng_() % (config_.jitterMs_ + 1)) : 0; }
+
+	const Clock* clock_;
+	LinkConfig config_;
+	std::mt19937 rng_;
+	bool isBad_;
+	int64_t busyUntilUs_; // the bottleneck is sending till then
+	int64_t lastArrivalTs_;
+	uint64_t nextSeq_;
+	std::vector<Datagram> inFlight_; // a heap, the next to arrive at the front
+	std::string received_;
+	LinkStats stats_;
+};
+
+// the policies of a session on a link
+struct LinkOutput
+{
+	explicit LinkOutput(Link* link) : link_(link) {}
+	void operator()(const void* data, int len) const { link_->Send(data, len); }
+	Link* link_;
+};
+
+struct LinkInput
+{
+	explicit LinkInput(Link* link) : link_(link) {}
+	UserInputData operator()() const { return link_->Recv(); }
+	Link* link_;
+};
+
+struct ClockNow
+{
+	explicit ClockNow(const Clock* clock) : clock_(clock) {}
+	int64_t operator()() const { return clock_->Now(); }
+	const Clock* clock_;
+};
+
+typedef BasicKcpSession<LinkOutput, LinkInput, ClockNow> Session;
+
+// a client and a server linked both ways on a shared clock :
+//	sim::Path path(c2sConfig, s2cConfig);
+//	sim::Session cli(kCli, path.CliOutput(), path.CliInput(), path.Now());
+//	sim::Session srv(kSrv, path.SrvOutput(), path.SrvInput(), path.Now());
+// then a loop of Update()s, Recv()s and clock_.Advance()
+struct Path
+{
+	Path(const LinkConfig& c2s, const LinkConfig& s2c) : c2s_(&clock_, c2s), s2c_(&clock_, s2c) {}
+
+	LinkOutput CliOutput() { return LinkOutput(&c2s_); }
+	LinkInput CliInput() { return LinkInput(&s2c_); }
+	LinkOutput SrvOutput() { return LinkOutput(&s2c_); }
+	LinkInput SrvInput() { return LinkInput(&c2s_); }
+	ClockNow Now() const { return ClockNow(&clock_); }
+
+	// the next datagram arrival either way, -1 if nothing is in flight
+	int64_t NextArrivalTs() const
+	{
+		int64_t c2sTs = c2s_.NextArrivalTs();
+		int64_t s2cTs = s2c_.NextArrivalTs();
+		if (c2sTs < 0 || s2cTs < 0)
+			return std::max(c2sTs, s2cTs);
+		return std::min(c2sTs, s2cTs);
+	}
+
+	Clock clock_;
+	Link c2s_;
+	Link s2c_;
+};
+
+}
+}
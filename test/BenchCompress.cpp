@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../kcpp.h"
+
+// compression ratio and speed of Lz4Codec, the codec of SetCompression(), over a msg corpus:
+//	BenchCompress [corpus] [minLen] [dict]
+// a corpus file is the msgs one after another, each behind its len as a little endian uint32.
+// without one, game state like msgs are made up : json entity updates and packed binary ones.
+// the msgs are counted as the session frames them, with the varint flag prefix, and those
+// below `minLen` or not getting shorter go as they are. the second half of the corpus is
+// compressed without a dict, with the `dict` file if given, and with one trained on the first half
+
+struct Result
+{
+	uint64_t msgCnt_;
+	uint64_t compressedCnt_;
+	uint64_t rawBytes_;
+	uint64_t framedBytes_;
+	double compressNs_;
+	double decompressNs_;
+};
+
+static bool LoadCorpus(const char* path, std::vector<std::string>& msgs)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+	unsigned char header[4];
+	while (fread(header, 1, sizeof header, file) == sizeof header)
+	{
+		uint32_t len = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+		std::string msg(len, '\0');
+		if (len == 0 || fread(&msg[0], 1, len, file) != len)
+			break;
+		msgs.push_back(msg);
+	}
+	fclose(file);
+	return !msgs.empty();
+}
+
+static std::string MakeJsonMsg(uint32_t& seed, uint32_t id)
+{
+	char msg[512];
+	seed = seed * 1103515245 + 12345;
+	int len = snprintf(msg, sizeof msg,
+		"{\"type\":\"entity_update\",\"id\":%u,\"pos\":{\"x\":%d.%02d,\"y\":%d.%02d,\"z\":0.00},"
+		"\"vel\":{\"x\":%d,\"y\":%d},\"hp\":%u,\"state\":\"%s\",\"team\":%u,\"weapon\":\"rifle\",\"ammo\":%u}",
+		id, (seed >> 8) % 1000, (seed >> 4) % 100, (seed >> 12) % 1000, (seed >> 2) % 100,
+		static_cast<int>((seed >> 16) % 20) - 10, static_cast<int>((seed >> 20) % 20) - 10,
+		(seed >> 24) % 101, (seed & 1) ? "running" : "idle", id % 2, (seed >> 6) % 31);
+	return std::string(msg, len);
+}
+
+// a header, then per entity an id, a field mask and fixed point fields, most of them unchanged
+static std::string MakeBinaryMsg(uint32_t& seed, uint32_t frame)
+{
+	std::string msg;
+	msg.append("\x04\x00\x00\x00", 4);
+	msg.append(reinterpret_cast<const char*>(&frame), 4);
+	for (uint32_t entity = 0; entity < 16; ++entity)
+	{
+		seed = seed * 1103515245 + 12345;
+		int32_t fields[6] = { 1000 + static_cast<int32_t>(entity) * 64, static_cast<int32_t>((seed >> 8) % 4096),
+			static_cast<int32_t>((seed >> 12) % 4096), 0, 100, static_cast<int32_t>(entity % 2) };
+		msg.append(reinterpret_cast<const char*>(&entity), 2);
+		msg.append("\x3f\x00", 2);
+		msg.append(reinterpret_cast<const char*>(fields), sizeof fields);
+	}
+	return msg;
+}
+
+static void MakeCorpus(std::vector<std::string>& msgs)
+{
+	uint32_t seed = 1;
+	for (uint32_t i = 0; i < 20000; ++i)
+		msgs.push_back(i % 4 == 3 ? MakeBinaryMsg(seed, i) : MakeJsonMsg(seed, i % 64));
+}
+
+static size_t VarintLen(uint32_t v)
+{
+	size_t len = 1;
+	for (; v >= 0x80; v >>= 7)
+		++len;
+	return len;
+}
+
+static Result Bench(const std::vector<std::string>& msgs, size_t begin, const std::string& dict, int minLen)
+{
+	static const int kRounds = 5;
+	kcpp::Lz4Codec codec(dict);
+	Result result = Result();
+	std::vector<std::string> compressed(msgs.size());
+	std::string dst;
+	auto t0 = std::chrono::steady_clock::now();
+	for (int round = 0; round < kRounds; ++round)
+		for (size_t i = begin; i < msgs.size(); ++i)
+		{
+			const std::string& msg = msgs[i];
+			dst.resize(msg.size());
+			size_t len = static_cast<int>(msg.size()) >= minLen ? codec.Compress(msg.data(), msg.size(), &dst[0]) : 0;
+			size_t prefixLen = VarintLen(static_cast<uint32_t>(msg.size() << 1 | 1));
+			if (len > 0 && prefixLen + len < 1 + msg.size())
+				compressed[i].assign(dst.data(), len);
+			else
+				compressed[i].clear();
+		}
+	auto t1 = std::chrono::steady_clock::now();
+	std::string out;
+	for (int round = 0; round < kRounds; ++round)
+		for (size_t i = begin; i < msgs.size(); ++i)
+		{
+			if (compressed[i].empty())
+				continue;
+			out.resize(msgs[i].size());
+			if (!codec.Decompress(compressed[i].data(), compressed[i].size(), &out[0], out.size()) || out != msgs[i])
+			{
+				fprintf(stderr, "msg %u doesn't decompress back\n", static_cast<unsigned>(i));
+				exit(1);
+			}
+		}
+	auto t2 = std::chrono::steady_clock::now();
+
+	for (size_t i = begin; i < msgs.size(); ++i)
+	{
+		++result.msgCnt_;
+		result.rawBytes_ += msgs[i].size();
+		if (compressed[i].empty())
+			result.framedBytes_ += 1 + msgs[i].size();
+		else
+		{
+			++result.compressedCnt_;
+			result.framedBytes_ += VarintLen(static_cast<uint32_t>(msgs[i].size() << 1 | 1)) + compressed[i].size();
+		}
+	}
+	double rawBytes = static_cast<double>(result.rawBytes_) * kRounds;
+	result.compressNs_ = std::chrono::duration<double, std::nano>(t1 - t0).count() / rawBytes;
+	result.decompressNs_ = std::chrono::duration<double, std::nano>(t2 - t1).count() / rawBytes;
+	return result;
+}
+
+static void Print(const char* name, const Result& result)
+{
+	printf("%-22s : %6llu msgs, %5.1f%% compressed, %9llu -> %9llu bytes, ratio %.3f, "
+		"compress %.2f ns/byte, decompress %.2f ns/byte\n",
+		name, static_cast<unsigned long long>(result.msgCnt_),
+		100.0 * result.compressedCnt_ / result.msgCnt_,
+		static_cast<unsigned long long>(result.rawBytes_), static_cast<unsigned long long>(result.framedBytes_),
+		static_cast<double>(result.rawBytes_) / result.framedBytes_, result.compressNs_, result.decompressNs_);
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> msgs;
+	if (argc > 1 && strcmp(argv[1], "-") != 0)
+	{
+		if (!LoadCorpus(argv[1], msgs))
+		{
+			fprintf(stderr, "no msgs in %s\n", argv[1]);
+			return 1;
+		}
+	}
+	else
+		MakeCorpus(msgs);
+	int minLen = argc > 2 ? atoi(argv[2]) : 64;
+
+	size_t half = msgs.size() / 2;
+	Print("no dict", Bench(msgs, half, std::string(), minLen));
+	if (argc > 3)
+	{
+		FILE* file = fopen(argv[3], "rb");
+		std::string dict;
+		char chunk[4096];
+		size_t n = 0;
+		while (file && (n = fread(chunk, 1, sizeof chunk, file)) > 0)
+			dict.append(chunk, n);
+		if (file)
+			fclose(file);
+		Print("given dict", Bench(msgs, half, dict, minLen));
+	}
+	// the latest msgs of the first half, as much as the codec takes
+	std::string trained;
+	for (size_t i = half; i > 0 && trained.size() + msgs[i - 1].size() <= kcpp::Lz4Codec::kMaxDictLen; --i)
+		trained.insert(0, msgs[i - 1]);
+	Print("trained dict", Bench(msgs, half, trained, minLen));
+	return 0;
+}
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "../kcpp.h"
+
+// a client sending reliable msgs to a server over loopback udp, the same run on raw ikcp and on
+// KcpSession with the redundancy off, dynamic and forced on. both ends live in this process and
+// wait in select() between their updates, so the cpu time is what the stacks cost.
+// loss is dropped in the senders, both ways. kcp runs kcpp's default config on both stacks.
+// `BenchLoopback [msgBytes] [msgsPerSec, 0 : as fast as the window allows] [loss %] [seconds]`
+
+struct Options
+{
+	int msgBytes_;
+	int msgsPerSec_;
+	double lossPercent_;
+	int seconds_;
+};
+
+static const int kRcvBufLen = 2048;
+static const IUINT32 kConv = 0x11223344;
+// a msg starts with its send time in us, the latency histograms hold us here
+static const int kMinMsgBytes = 8;
+
+static std::chrono::steady_clock::time_point gStart = std::chrono::steady_clock::now();
+
+static int64_t NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - gStart).count();
+}
+
+static int64_t NowMs() { return NowUs() / 1000; }
+
+static int64_t CpuUs()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// a bound non-blocking udp socket and where it sends to
+struct Endpoint
+{
+	Endpoint(double lossRate, uint32_t seed) : fd_(-1), lossRate_(lossRate), rng_(seed), datagrams_(0), bytes_(0), drops_(0)
+	{
+		fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+		int bufLen = 4 * 1024 * 1024;
+		setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &bufLen, sizeof bufLen);
+		setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &bufLen, sizeof bufLen);
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL, 0) | O_NONBLOCK);
+		memset(&addr_, 0, sizeof addr_);
+		addr_.sin_family = AF_INET;
+		addr_.sin_addr.s_addr = inet_addr("127.0.0.1");
+		addr_.sin_port = 0;
+		bind(fd_, reinterpret_cast<struct sockaddr*>(&addr_), sizeof addr_);
+		socklen_t addrLen = sizeof addr_;
+		getsockname(fd_, reinterpret_cast<struct sockaddr*>(&addr_), &addrLen);
+		peer_ = addr_;
+	}
+
+	~Endpoint() { close(fd_); }
+
+	void ConnectTo(const Endpoint& peer) { peer_ = peer.addr_; }
+
+	void Send(const void* data, int len)
+	{
+		++datagrams_;
+		bytes_ += len;
+		if (lossRate_ > 0 && rng_() < lossRate_ * 4294967296.0)
+		{
+			++drops_;
+			return;
+		}
+		::sendto(fd_, data, len, 0, reinterpret_cast<const struct sockaddr*>(&peer_), sizeof peer_);
+	}
+
+	// -1 if nothing to read
+	int Recv() { return static_cast<int>(::recvfrom(fd_, rcvBuf_, sizeof rcvBuf_, 0, nullptr, nullptr)); }
+
+	int fd_;
+	struct sockaddr_in addr_;
+	struct sockaddr_in peer_;
+	double lossRate_;
+	std::mt19937 rng_;
+	uint64_t datagrams_;
+	uint64_t bytes_;
+	uint64_t drops_;
+	char rcvBuf_[kRcvBufLen];
+};
+
+struct Result
+{
+	Result() : sentMsgs_(0), rcvedMsgs_(0), rcvedBytes_(0), durationUs_(0), cpuUs_(0), datagrams_(0), wireBytes_(0) {}
+
+	uint64_t sentMsgs_;
+	uint64_t rcvedMsgs_;
+	uint64_t rcvedBytes_;
+	int64_t durationUs_; // from the first send to the last msg received
+	int64_t cpuUs_;
+	uint64_t datagrams_; // both ways, the dropped ones included
+	uint64_t wireBytes_; // of those datagrams, udp payload
+	kcpp::LatencyHistogram latencyUs_;
+};
+
+static void OnMsg(Result* result, const char* data, int len)
+{
+	int64_t sendUs = 0;
+	memcpy(&sendUs, data, sizeof sendUs);
+	++result->rcvedMsgs_;
+	result->rcvedBytes_ += len;
+	result->latencyUs_.Record(static_cast<uint32_t>(NowUs() - sendUs));
+}
+
+/// ------ the two stacks, the same interface for Run() --------
+
+static int IkcpOutput(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+	static_cast<Endpoint*>(user)->Send(buf, len);
+	return 0;
+}
+
+class IkcpPair
+{
+public:
+	IkcpPair(Endpoint* cliEnd, Endpoint* srvEnd)
+		: cliEnd_(cliEnd), srvEnd_(srvEnd), cli_(CreateKcp(cliEnd)), srv_(CreateKcp(srvEnd))
+	{}
+
+	~IkcpPair() { ikcp_release(cli_); ikcp_release(srv_); }
+
+	bool IsConnected() const { return true; }
+	bool CanSend() const { return ikcp_waitsnd(cli_) < kWaitSndCntLimit; }
+
+	void Send(const char* data, int len)
+	{
+		ikcp_send(cli_, data, len);
+		ikcp_update(cli_, static_cast<IUINT32>(NowMs())); // as KcpSession::Send() does
+	}
+
+	// returns the next update timestamp in ms
+	int64_t Update()
+	{
+		IUINT32 now = static_cast<IUINT32>(NowMs());
+		ikcp_update(cli_, now);
+		ikcp_update(srv_, now);
+		return std::min(ikcp_check(cli_, now), ikcp_check(srv_, now));
+	}
+
+	void Poll(Result* result)
+	{
+		int len = 0;
+		while ((len = srvEnd_->Recv()) > 0)
+			ikcp_input(srv_, srvEnd_->rcvBuf_, len);
+		while ((len = cliEnd_->Recv()) > 0)
+			ikcp_input(cli_, cliEnd_->rcvBuf_, len);
+		while ((len = ikcp_recv(srv_, msgBuf_, sizeof msgBuf_)) > 0)
+			OnMsg(result, msgBuf_, len);
+	}
+
+private:
+	static const int kWaitSndCntLimit = 512;
+
+	static ikcpcb* CreateKcp(Endpoint* end)
+	{
+		// kcpp's default config
+		ikcpcb* kcp = ikcp_create(kConv, end);
+		ikcp_setoutput(kcp, IkcpOutput);
+		ikcp_wndsize(kcp, 128, 128);
+		ikcp_nodelay(kcp, 1, 10, 1, 1);
+		kcp->rx_minrto = 10;
+		ikcp_setmtu(kcp, 548);
+		return kcp;
+	}
+
+	Endpoint* cliEnd_;
+	Endpoint* srvEnd_;
+	ikcpcb* cli_;
+	ikcpcb* srv_;
+	char msgBuf_[64 * 1024];
+};
+
+class KcppPair
+{
+public:
+	KcppPair(Endpoint* cliEnd, Endpoint* srvEnd, kcpp::RedundancyModeE rdcMode)
+		: cli_(kcpp::kCli, Output(cliEnd), Input(cliEnd), NowMs),
+		srv_(kcpp::kSrv, Output(srvEnd), Input(srvEnd), NowMs)
+	{
+		cli_.SetRedundancy(rdcMode);
+		srv_.SetRedundancy(rdcMode);
+	}
+
+	bool IsConnected() const { return cli_.IsConnected(); }
+	bool CanSend() const { return cli_.CheckCanSend(); }
+	void Send(const char* data, int len) { cli_.Send(data, len); }
+	int64_t Update() { return std::min(cli_.Update(), srv_.Update()); }
+
+	void Poll(Result* result)
+	{
+		int len = 0;
+		do
+		{
+			while (srv_.Recv(&buf_, len))
+			{
+				if (len > 0)
+					OnMsg(result, buf_.peek(), len);
+				buf_.retrieveAll();
+			}
+		} while (len != -10);
+		do
+		{
+			while (cli_.Recv(&buf_, len))
+				buf_.retrieveAll();
+		} while (len != -10);
+	}
+
+private:
+	static kcpp::UserOutputFunction Output(Endpoint* end)
+	{
+		return [end](const void* data, int len) { end->Send(data, len); };
+	}
+
+	static kcpp::UserInputFunction Input(Endpoint* end)
+	{
+		return [end]() { return kcpp::UserInputData(end->rcvBuf_, end->Recv()); };
+	}
+
+	kcpp::KcpSession cli_;
+	kcpp::KcpSession srv_;
+	kcpp::Buf buf_;
+};
+
+// till the next timestamp in ms or a datagram arriving
+static void Wait(const Endpoint& cliEnd, const Endpoint& srvEnd, int64_t untilUs)
+{
+	int64_t waitUs = untilUs - NowUs();
+	if (waitUs <= 0)
+		return;
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(cliEnd.fd_, &fds);
+	FD_SET(srvEnd.fd_, &fds);
+	struct timeval timeout;
+	timeout.tv_sec = static_cast<long>(waitUs / 1000000);
+	timeout.tv_usec = static_cast<long>(waitUs % 1000000);
+	select(std::max(cliEnd.fd_, srvEnd.fd_) + 1, &fds, nullptr, nullptr, &timeout);
+}
+
+template <typename Pair>
+static void Run(Pair& pair, Endpoint& cliEnd, Endpoint& srvEnd, const Options& options, Result* result)
+{
+	for (int64_t deadlineUs = NowUs() + 3000000; !pair.IsConnected() && NowUs() < deadlineUs;)
+	{
+		Wait(cliEnd, srvEnd, pair.Update() * 1000);
+		pair.Poll(result);
+	}
+	if (!pair.IsConnected())
+		return;
+	cliEnd.datagrams_ = cliEnd.bytes_ = 0;
+	srvEnd.datagrams_ = srvEnd.bytes_ = 0;
+
+	std::string msg(options.msgBytes_, 'm');
+	const int64_t sendIntervalUs = options.msgsPerSec_ > 0 ? 1000000 / options.msgsPerSec_ : 0;
+	const int64_t startUs = NowUs();
+	const int64_t sendEndUs = startUs + options.seconds_ * 1000000LL;
+	const int64_t startCpuUs = CpuUs();
+	int64_t nextSendUs = startUs;
+	int64_t lastRcvUs = startUs;
+	// sends for `seconds_`, then waits up to 3 s for the rest to arrive
+	while (NowUs() < sendEndUs || (result->rcvedMsgs_ < result->sentMsgs_ && NowUs() < sendEndUs + 3000000))
+	{
+		int64_t nowUs = NowUs();
+		while (nowUs < sendEndUs && nowUs >= nextSendUs && pair.CanSend())
+		{
+			memcpy(&msg[0], &nowUs, sizeof nowUs);
+			pair.Send(msg.data(), options.msgBytes_);
+			++result->sentMsgs_;
+			nextSendUs = sendIntervalUs > 0 ? nextSendUs + sendIntervalUs : nowUs;
+		}
+		int64_t untilUs = pair.Update() * 1000;
+		if (nowUs < sendEndUs && pair.CanSend())
+			untilUs = std::min(untilUs, nextSendUs);
+		Wait(cliEnd, srvEnd, untilUs);
+		uint64_t rcvedMsgs = result->rcvedMsgs_;
+		pair.Poll(result);
+		if (result->rcvedMsgs_ > rcvedMsgs)
+			lastRcvUs = NowUs();
+	}
+	result->durationUs_ = lastRcvUs - startUs;
+	result->cpuUs_ = CpuUs() - startCpuUs;
+	result->datagrams_ = cliEnd.datagrams_ + srvEnd.datagrams_;
+	result->wireBytes_ = cliEnd.bytes_ + srvEnd.bytes_;
+}
+
+static void Report(const char* name, const Result& result)
+{
+	double seconds = result.durationUs_ > 0 ? result.durationUs_ / 1e6 : 1;
+	double rcvedMsgs = result.rcvedMsgs_ > 0 ? static_cast<double>(result.rcvedMsgs_) : 1;
+	printf("%-16s : %9.0f msgs/s %8.2f MB/s, cpu %6.2f us/msg, %5.2f datagrams %6.1f wire bytes/msg, "
+		"latency p50 %6u p99 %6u p999 %6u us, got %llu/%llu\n",
+		name, result.rcvedMsgs_ / seconds, result.rcvedBytes_ / seconds / 1024 / 1024,
+		result.cpuUs_ / rcvedMsgs, result.datagrams_ / rcvedMsgs, result.wireBytes_ / rcvedMsgs,
+		result.latencyUs_.ValueAtPercentile(50), result.latencyUs_.ValueAtPercentile(99),
+		result.latencyUs_.ValueAtPercentile(99.9),
+		static_cast<unsigned long long>(result.rcvedMsgs_), static_cast<unsigned long long>(result.sentMsgs_));
+}
+
+template <typename Pair, typename... Args>
+static void Bench(const char* name, const Options& options, Args... args)
+{
+	Endpoint cliEnd(options.lossPercent_ / 100, 1);
+	Endpoint srvEnd(options.lossPercent_ / 100, 2);
+	cliEnd.ConnectTo(srvEnd);
+	srvEnd.ConnectTo(cliEnd);
+	Pair pair(&cliEnd, &srvEnd, args...);
+	Result result;
+	Run(pair, cliEnd, srvEnd, options, &result);
+	Report(name, result);
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	options.msgBytes_ = argc > 1 ? atoi(argv[1]) : 200;
+	options.msgsPerSec_ = argc > 2 ? atoi(argv[2]) : 10000;
+	options.lossPercent_ = argc > 3 ? atof(argv[3]) : 0;
+	options.seconds_ = argc > 4 ? atoi(argv[4]) : 5;
+	if (options.msgBytes_ < kMinMsgBytes)
+		options.msgBytes_ = kMinMsgBytes;
+	if (options.seconds_ <= 0)
+		options.seconds_ = 5;
+
+	printf("%d byte msgs, %d msgs/s, %.1f%% loss each way, %d s\n",
+		options.msgBytes_, options.msgsPerSec_, options.lossPercent_, options.seconds_);
+	Bench<IkcpPair>("ikcp", options);
+	Bench<KcppPair>("kcpp rdc off", options, kcpp::kRdcOff);
+	Bench<KcppPair>("kcpp rdc dynamic", options, kcpp::kRdcDynamic);
+	Bench<KcppPair>("kcpp rdc on", options, kcpp::kRdcOn);
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../kcpp.h"
+
+// micro benchmark of Rdc, the redundancy layer every datagram goes through.
+// - Output : ns and heap allocations per Output() call, with the redundancy switched on and off.
+// - Fragments : ns per datagram of unreliable msgs of 1 to 127 fragments.
+// - Input : reassembly throughput of fragmented unreliable msgs.
+
+static size_t gAllocCnt = 0;
+
+void* operator new(size_t size)
+{
+	++gAllocCnt;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static size_t gOutputCnt = 0;
+static size_t gOutputBytes = 0;
+
+static void CountOutput(const void* data, int len) { ++gOutputCnt; gOutputBytes += len; }
+static void IgnoreRecv(kcpp::Buf* userBuf, int& len, const char* data, int dataLen, kcpp::PktTypeE pktType) {}
+
+static std::vector<std::string> gDatagrams;
+static void KeepOutput(const void* data, int len) { gDatagrams.emplace_back(static_cast<const char*>(data), len); }
+
+static size_t gRcvedBytes = 0;
+// hands the msg over as KcpSession does
+static void CountRecv(kcpp::Buf* userBuf, int& len, const char* data, int dataLen, kcpp::PktTypeE pktType)
+{
+	userBuf->append(data, dataLen);
+	userBuf->retrieveAll();
+	gRcvedBytes += dataLen;
+	len = dataLen;
+}
+
+static void BenchOutput(const char* name, bool rdcOn, kcpp::PktTypeE pktType, size_t msgLen, int loops)
+{
+	kcpp::Rdc rdc(CountOutput, IgnoreRecv);
+	rdc.SetMTU(576);
+	rdc.Switch(rdcOn);
+
+	std::string msg(msgLen, 'k');
+	kcpp::Buf oBuf;
+
+	// warm up, let the history and the buffers reach their steady size
+	for (int i = 0; i < 1000; ++i)
+	{
+		oBuf.append(msg.data(), msg.size());
+		rdc.Output(&oBuf, pktType);
+	}
+
+	gOutputCnt = 0;
+	gOutputBytes = 0;
+	size_t allocCntBefore = gAllocCnt;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < loops; ++i)
+	{
+		oBuf.append(msg.data(), msg.size());
+		rdc.Output(&oBuf, pktType);
+	}
+	auto end = std::chrono::steady_clock::now();
+	size_t allocCnt = gAllocCnt - allocCntBefore;
+
+	double ns = static_cast<double>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	printf("%-28s rdc %-3s msg %5d B : %8.1f ns/send, %5.2f allocs/send, %5.2f datagrams/send, %7.1f B/send\n",
+		name, rdcOn ? "on" : "off", static_cast<int>(msgLen), ns / loops,
+		1.0 * allocCnt / loops, 1.0 * gOutputCnt / loops, 1.0 * gOutputBytes / loops);
+}
+
+static void BenchFragments(int frgCnt, int loops)
+{
+	static const size_t kUnreliableFrgDataLen = 1472 - 9; // kMaxMSS - unreliable header
+	kcpp::Rdc rdc(CountOutput, IgnoreRecv);
+	std::string msg(frgCnt > 1 ? frgCnt * kUnreliableFrgDataLen : 1000, 'k');
+	kcpp::Buf oBuf;
+
+	gOutputCnt = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < loops; ++i)
+	{
+		oBuf.append(msg.data(), msg.size());
+		rdc.Output(&oBuf, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable));
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double ns = static_cast<double>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	printf("unreliable msg of %3d frgs : %7.1f ns/datagram\n", frgCnt, ns / gOutputCnt);
+}
+
+static void BenchInput(size_t msgLen, size_t totalBytes)
+{
+	kcpp::Rdc snd(KeepOutput, IgnoreRecv);
+	kcpp::Rdc rcv(CountOutput, CountRecv);
+
+	std::string msg(msgLen, 'k');
+	kcpp::Buf oBuf;
+	size_t msgCnt = totalBytes / msgLen + 1;
+	gDatagrams.clear();
+	for (size_t i = 0; i < msgCnt; ++i)
+	{
+		oBuf.append(msg.data(), msg.size());
+		snd.Output(&oBuf, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable));
+	}
+	size_t frgCnt = gDatagrams.size() / msgCnt;
+
+	kcpp::Buf iBuf;
+	kcpp::Buf userBuf;
+	int len = 0;
+	gRcvedBytes = 0;
+	size_t allocCntBefore = gAllocCnt;
+	auto begin = std::chrono::steady_clock::now();
+	for (const std::string& datagram : gDatagrams)
+	{
+		iBuf.append(datagram.data(), datagram.size());
+		while (rcv.Input(&userBuf, len, &iBuf))
+			;
+	}
+	auto end = std::chrono::steady_clock::now();
+	size_t allocCnt = gAllocCnt - allocCntBefore;
+
+	double ns = static_cast<double>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	printf("reassembly msg %6d B (%3d frgs) : %9.1f ns/msg, %7.1f MB/s, %5.2f allocs/msg, %s\n",
+		static_cast<int>(msgLen), static_cast<int>(frgCnt), ns / msgCnt,
+		gRcvedBytes / (ns / 1e9) / (1024 * 1024), 1.0 * allocCnt / msgCnt,
+		gRcvedBytes == msgCnt * msgLen ? "all delivered" : "LOST MSGS");
+}
+
+int main(int argc, char* argv[])
+{
+	int loops = argc > 1 ? atoi(argv[1]) : 1000000;
+	if (loops <= 0)
+		loops = 1000000;
+
+	const bool rdcOnOff[] = { false, true };
+	for (bool on : rdcOnOff)
+	{
+		BenchOutput("reliable(kcp segment)", on, kcpp::kPsh, 32, loops);
+		BenchOutput("reliable(kcp segment)", on, kcpp::kPsh, 200, loops);
+		BenchOutput("reliable(kcp segment)", on, kcpp::kPsh, 540, loops);
+		BenchOutput("unreliable", on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 100, loops);
+		BenchOutput("unreliable(fragmented)", on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 4000, loops / 4);
+	}
+
+	const int frgCnts[] = { 1, 2, 4, 8, 16, 32, 64, 127 };
+	for (int frgCnt : frgCnts)
+		BenchFragments(frgCnt, loops / frgCnt);
+
+	const size_t msgLens[] = { 4 * 1024, 16 * 1024, 64 * 1024, 150 * 1024 };
+	for (size_t msgLen : msgLens)
+		BenchInput(msgLen, 64 * 1024 * 1024);
+	return 0;
+}
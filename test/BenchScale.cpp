@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "../kcpp.h"
+
+// N client/server KcpSession pairs in one process over an in-memory transport, a game like
+// mix on every pair : the client sends a 48 byte input 33 times a second unreliably and a 128 byte
+// event twice a second reliably, the server a 200 byte snapshot 33 times a second unreliably.
+// virtual 10 ms ticks, each session updated when its Update() said. per N :
+// - memory per pair : resident set growth, and the live heap split into ikcp's allocations
+//   (ikcpcb, segments) and the rest(Bufs, the Rdc history, deques...)
+// - wall time per tick, the Update() pass of it per session, and its cache misses per session
+//   from the perf counters where the kernel lets us
+// - msgs delivered per wall second
+// `BenchScale [seconds of virtual time] [N...]`, N 1000 10000 by default
+
+static const int64_t kTickMs = 10;
+static int64_t gNow = 1000;
+
+/// ------ heap accounting, a size header in front of every block --------
+
+static const size_t kHeaderLen = 16; // keeps the blocks 16 byte aligned
+static size_t gLiveNewBytes = 0;
+static size_t gLiveIkcpBytes = 0;
+
+static void* Allocate(size_t size, size_t& liveBytes)
+{
+	char* block = static_cast<char*>(malloc(size + kHeaderLen));
+	if (!block)
+		return nullptr;
+	memcpy(block, &size, sizeof size);
+	liveBytes += size;
+	return block + kHeaderLen;
+}
+
+static void Free(void* p, size_t& liveBytes)
+{
+	if (!p)
+		return;
+	char* block = static_cast<char*>(p) - kHeaderLen;
+	size_t size = 0;
+	memcpy(&size, block, sizeof size);
+	liveBytes -= size;
+	free(block);
+}
+
+void* operator new(size_t size)
+{
+	void* p = Allocate(size ? size : 1, gLiveNewBytes);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept { Free(p, gLiveNewBytes); }
+void operator delete(void* p, size_t) noexcept { Free(p, gLiveNewBytes); }
+
+static void* IkcpMalloc(size_t size) { return Allocate(size, gLiveIkcpBytes); }
+static void IkcpFree(void* p) { Free(p, gLiveIkcpBytes); }
+
+static size_t ResidentBytes()
+{
+	size_t bytes = 0;
+#ifdef __linux__
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm)
+	{
+		unsigned long totalPages = 0;
+		unsigned long residentPages = 0;
+		if (fscanf(statm, "%lu %lu", &totalPages, &residentPages) == 2)
+			bytes = residentPages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		fclose(statm);
+	}
+#endif
+	return bytes;
+}
+
+// last level cache misses of this thread in user space, IsOn() false where not permitted
+class CacheMissCounter
+{
+public:
+	CacheMissCounter() : fd_(-1)
+	{
+#ifdef __linux__
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd_ = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+	}
+
+	~CacheMissCounter()
+	{
+#ifdef __linux__
+		if (fd_ >= 0)
+			close(fd_);
+#endif
+	}
+
+	bool IsOn() const { return fd_ >= 0; }
+
+	void Start()
+	{
+#ifdef __linux__
+		if (fd_ >= 0)
+			ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	void Stop()
+	{
+#ifdef __linux__
+		if (fd_ >= 0)
+			ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	}
+
+	uint64_t Count() const
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		if (fd_ >= 0 && read(fd_, &count, sizeof count) != sizeof count)
+			count = 0;
+#endif
+		return count;
+	}
+
+private:
+	int fd_;
+};
+
+/// ------ transport --------
+
+// datagrams sent during a tick arrive on the next one, back to back in one string
+struct Link
+{
+	Link() : head_(0), offset_(0) {}
+
+	void Send(const void* data, int len)
+	{
+		sendingBytes_.append(static_cast<const char*>(data), len);
+		sendingLens_.push_back(len);
+	}
+
+	kcpp::UserInputData Recv()
+	{
+		if (head_ == arrivedLens_.size())
+			return kcpp::UserInputData(nullptr, -1);
+		int len = arrivedLens_[head_++];
+		char* data = &arrivedBytes_[offset_];
+		offset_ += len;
+		return kcpp::UserInputData(data, len);
+	}
+
+	bool HasArrived() const { return head_ < arrivedLens_.size(); }
+
+	void Tick()
+	{
+		arrivedBytes_.swap(sendingBytes_);
+		arrivedLens_.swap(sendingLens_);
+		sendingBytes_.clear();
+		sendingLens_.clear();
+		head_ = 0;
+		offset_ = 0;
+	}
+
+	std::string sendingBytes_;
+	std::vector<int> sendingLens_;
+	std::string arrivedBytes_;
+	std::vector<int> arrivedLens_;
+	size_t head_;
+	size_t offset_;
+};
+
+struct Pair
+{
+	// the sessions keep `this`, a Pair stays where it was built
+	Pair()
+		:
+		cli_(kcpp::kCli,
+			[this](const void* data, int len) { c2s_.Send(data, len); },
+			[this]() { return s2c_.Recv(); },
+			[]() { return gNow; }),
+		srv_(kcpp::kSrv,
+			[this](const void* data, int len) { s2c_.Send(data, len); },
+			[this]() { return c2s_.Recv(); },
+			[]() { return gNow; }),
+		cliNextUpdateTs_(0),
+		srvNextUpdateTs_(0)
+	{}
+
+	Link c2s_;
+	Link s2c_;
+	kcpp::KcpSession cli_;
+	kcpp::KcpSession srv_;
+	int64_t cliNextUpdateTs_;
+	int64_t srvNextUpdateTs_;
+};
+
+static uint64_t gRcvedMsgs = 0;
+
+static void Drain(kcpp::KcpSession& session, kcpp::Buf& buf)
+{
+	int len = 0;
+	do
+	{
+		while (session.Recv(&buf, len))
+		{
+			if (len > 0)
+				++gRcvedMsgs;
+			buf.retrieveAll();
+		}
+	} while (len != -10);
+}
+
+static void Bench(int pairCnt, int seconds)
+{
+	size_t residentBefore = ResidentBytes();
+	size_t newBytesBefore = gLiveNewBytes;
+	size_t ikcpBytesBefore = gLiveIkcpBytes;
+
+	auto createBegin = std::chrono::steady_clock::now();
+	std::vector<std::unique_ptr<Pair>> pairs;
+	pairs.reserve(pairCnt);
+	for (int i = 0; i < pairCnt; ++i)
+		pairs.push_back(std::unique_ptr<Pair>(new Pair()));
+	auto createEnd = std::chrono::steady_clock::now();
+
+	const std::string input(48, 'i');
+	const std::string event(128, 'e');
+	const std::string snapshot(200, 's');
+	kcpp::Buf buf;
+	CacheMissCounter cacheMisses;
+	uint64_t updateNs = 0;
+	uint64_t updateCnt = 0;
+	uint64_t tickNs = 0;
+	uint64_t measuredRcvedMsgs = 0;
+	int connectedCnt = 0;
+
+	// the first virtual second connects and warms up, not measured
+	const int warmupTicks = static_cast<int>(1000 / kTickMs);
+	const int ticks = warmupTicks + static_cast<int>(seconds * 1000 / kTickMs);
+	for (int tick = 0; tick < ticks; ++tick)
+	{
+		bool isMeasured = tick >= warmupTicks;
+		gNow += kTickMs;
+		uint64_t rcvedMsgsBefore = gRcvedMsgs;
+		auto tickBegin = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < pairCnt; ++i)
+		{
+			Pair& pair = *pairs[i];
+			if (!pair.cli_.IsConnected())
+				continue;
+			int phase = (tick + i) % 3; // spreads the sends of the pairs over the ticks
+			if (phase == 0 && pair.cli_.CheckCanSend())
+				pair.cli_.Send(input.data(), static_cast<int>(input.size()), kcpp::kUnreliable);
+			if (phase == 1)
+				pair.srv_.Send(snapshot.data(), static_cast<int>(snapshot.size()), kcpp::kUnreliable);
+			if ((tick + i) % 50 == 0 && pair.cli_.CheckCanSend())
+				pair.cli_.Send(event.data(), static_cast<int>(event.size()));
+		}
+		for (int i = 0; i < pairCnt; ++i)
+		{
+			pairs[i]->c2s_.Tick();
+			pairs[i]->s2c_.Tick();
+		}
+		for (int i = 0; i < pairCnt; ++i)
+		{
+			Pair& pair = *pairs[i];
+			if (pair.c2s_.HasArrived())
+				Drain(pair.srv_, buf);
+			if (pair.s2c_.HasArrived())
+				Drain(pair.cli_, buf);
+		}
+
+		auto updateBegin = std::chrono::steady_clock::now();
+		if (isMeasured)
+			cacheMisses.Start();
+		uint64_t tickUpdateCnt = 0;
+		for (int i = 0; i < pairCnt; ++i)
+		{
+			Pair& pair = *pairs[i];
+			if (gNow >= pair.cliNextUpdateTs_)
+			{
+				pair.cliNextUpdateTs_ = pair.cli_.Update();
+				++tickUpdateCnt;
+			}
+			if (gNow >= pair.srvNextUpdateTs_)
+			{
+				pair.srvNextUpdateTs_ = pair.srv_.Update();
+				++tickUpdateCnt;
+			}
+		}
+		if (isMeasured)
+			cacheMisses.Stop();
+		auto tickEnd = std::chrono::steady_clock::now();
+
+		if (isMeasured)
+		{
+			updateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(tickEnd - updateBegin).count();
+			tickNs += std::chrono::duration_cast<std::chrono::nanoseconds>(tickEnd - tickBegin).count();
+			updateCnt += tickUpdateCnt;
+			measuredRcvedMsgs += gRcvedMsgs - rcvedMsgsBefore;
+		}
+	}
+	for (int i = 0; i < pairCnt; ++i)
+		connectedCnt += pairs[i]->cli_.IsConnected() ? 1 : 0;
+
+	size_t residentGrowth = ResidentBytes() - residentBefore;
+	double measuredTicks = ticks - warmupTicks;
+	char cacheMissText[32] = "n/a";
+	if (cacheMisses.IsOn() && updateCnt > 0)
+		snprintf(cacheMissText, sizeof cacheMissText, "%.1f", static_cast<double>(cacheMisses.Count()) / updateCnt);
+	printf("%6d pairs(%d connected) : create %5.0f ms, rss %6.1f KB, heap %6.1f KB(ikcp %5.1f KB) per pair, "
+		"tick %8.0f us, update %6.0f ns per session update(%4.2f per session per tick), cache misses %s per update, "
+		"%9.0f msgs/s wall\n",
+		pairCnt, connectedCnt,
+		std::chrono::duration_cast<std::chrono::microseconds>(createEnd - createBegin).count() / 1000.0,
+		residentGrowth / 1024.0 / pairCnt,
+		(gLiveNewBytes - newBytesBefore + gLiveIkcpBytes - ikcpBytesBefore) / 1024.0 / pairCnt,
+		(gLiveIkcpBytes - ikcpBytesBefore) / 1024.0 / pairCnt,
+		tickNs / 1000.0 / measuredTicks,
+		updateCnt > 0 ? static_cast<double>(updateNs) / updateCnt : 0,
+		updateCnt / measuredTicks / (2.0 * pairCnt),
+		cacheMissText,
+		tickNs > 0 ? measuredRcvedMsgs / (tickNs / 1e9) : 0);
+}
+
+int main(int argc, char* argv[])
+{
+	ikcp_allocator(IkcpMalloc, IkcpFree);
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+	if (seconds <= 0)
+		seconds = 2;
+	std::vector<int> pairCnts;
+	for (int i = 2; i < argc; ++i)
+		if (atoi(argv[i]) > 0)
+			pairCnts.push_back(atoi(argv[i]));
+	if (pairCnts.empty())
+	{
+		pairCnts.push_back(1000);
+		pairCnts.push_back(10000);
+	}
+
+	printf("sizeof KcpSession %d, ikcpcb %d, Buf %d bytes\n", static_cast<int>(sizeof(kcpp::KcpSession)),
+		static_cast<int>(sizeof(ikcpcb)), static_cast<int>(sizeof(kcpp::Buf)));
+	for (int pairCnt : pairCnts)
+		Bench(pairCnt, seconds);
+	return 0;
+}
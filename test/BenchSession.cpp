@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#include "../kcpp.h"
+
+// micro benchmark of the per packet cost of a client/server pair over an in-memory link,
+// the same functors either inlined as BasicKcpSession policies or wrapped in std::function
+// as KcpSession does, the server draining its msgs with Recv() or RecvBatch().
+
+using kcpp::UserInputData;
+
+static int64_t gNow = 1000;
+
+// a fixed ring of datagrams, never allocates
+struct Link
+{
+	static const size_t kSlotCnt = 1024;
+	static const size_t kSlotLen = 1500;
+
+	Link() : head_(0), tail_(0) {}
+
+	void Push(const void* data, int len)
+	{
+		if (tail_ - head_ == kSlotCnt || len > static_cast<int>(kSlotLen))
+			return; // dropped as a full socket buffer would
+		size_t slot = tail_++ % kSlotCnt;
+		memcpy(slots_[slot], data, len);
+		lens_[slot] = len;
+	}
+
+	UserInputData Pop()
+	{
+		if (head_ == tail_)
+			return UserInputData(nullptr, -1); // as a non-blocking recvfrom() with nothing to read
+		size_t slot = head_++ % kSlotCnt;
+		return UserInputData(slots_[slot], lens_[slot]);
+	}
+
+	char slots_[kSlotCnt][kSlotLen];
+	int lens_[kSlotCnt];
+	size_t head_;
+	size_t tail_;
+};
+
+struct LinkOutput
+{
+	explicit LinkOutput(Link* link) : link_(link) {}
+	void operator()(const void* data, int len) const { link_->Push(data, len); }
+	Link* link_;
+};
+
+struct LinkInput
+{
+	explicit LinkInput(Link* link) : link_(link) {}
+	UserInputData operator()() const { return link_->Pop(); }
+	Link* link_;
+};
+
+struct ManualClock
+{
+	int64_t operator()() const { return gNow; }
+};
+
+typedef kcpp::BasicKcpSession<LinkOutput, LinkInput, ManualClock> InlineSession;
+
+static Link gC2S;
+static Link gS2C;
+
+template <typename Session>
+static size_t Drain(Session& session, kcpp::Buf& buf)
+{
+	// each round of Recv() takes one datagram, go on till the input has nothing left(-10)
+	size_t msgCnt = 0;
+	int len = 0;
+	do
+	{
+		while (session.Recv(&buf, len))
+		{
+			if (len > 0)
+			{
+				++msgCnt;
+				buf.retrieveAll();
+			}
+		}
+	} while (len != -10);
+	return msgCnt;
+}
+
+template <typename Session>
+static size_t DrainBatch(Session& session, kcpp::Buf& buf)
+{
+	static const int kMaxMsgCnt = 64;
+	kcpp::RecvMsgView msgs[kMaxMsgCnt];
+	size_t msgCnt = 0;
+	int err = 0;
+	int batchMsgCnt = 0;
+	do
+	{
+		batchMsgCnt = session.RecvBatch(&buf, msgs, kMaxMsgCnt, err);
+		msgCnt += batchMsgCnt;
+		buf.retrieveAll();
+	} while (batchMsgCnt == kMaxMsgCnt && err == 0);
+	return msgCnt;
+}
+
+template <typename Session>
+static void Bench(const char* name, kcpp::TransmitModeE transmitMode, bool batch, int loops)
+{
+	gC2S = Link();
+	gS2C = Link();
+	Session cli(kcpp::kCli, LinkOutput(&gC2S), LinkInput(&gS2C), ManualClock());
+	Session srv(kcpp::kSrv, LinkOutput(&gS2C), LinkInput(&gC2S), ManualClock());
+	kcpp::Buf buf;
+	for (int i = 0; i < 100 && !cli.IsConnected(); ++i)
+	{
+		gNow += 10;
+		cli.Update(); srv.Update();
+		Drain(srv, buf); Drain(cli, buf);
+	}
+
+	// a burst of msgs per loop, ready together on the server side
+	static const int kBurstMsgCnt = 16;
+	std::string msg(100, 'k');
+	size_t rcvedCnt = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < loops; ++i)
+	{
+		++gNow;
+		for (int j = 0; j < kBurstMsgCnt && cli.CheckCanSend(); ++j)
+			cli.Send(msg.data(), static_cast<int>(msg.size()), transmitMode);
+		cli.Update();
+		rcvedCnt += batch ? DrainBatch(srv, buf) : Drain(srv, buf);
+		srv.Update();
+		Drain(cli, buf);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double ns = static_cast<double>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	printf("%-26s %-10s %-9s : %7.1f ns/msg, %d msgs delivered in %d loops\n", name,
+		transmitMode == kcpp::kReliable ? "reliable" : "unreliable", batch ? "RecvBatch" : "Recv", ns / rcvedCnt,
+		static_cast<int>(rcvedCnt), loops);
+}
+
+int main(int argc, char* argv[])
+{
+	int loops = argc > 1 ? atoi(argv[1]) : 100000;
+	if (loops <= 0)
+		loops = 100000;
+
+	const kcpp::TransmitModeE modes[] = { kcpp::kUnreliable, kcpp::kReliable };
+	const bool batchOnOff[] = { false, true };
+	for (kcpp::TransmitModeE mode : modes)
+	{
+		for (bool batch : batchOnOff)
+		{
+			Bench<kcpp::KcpSession>("KcpSession(std::function)", mode, batch, loops);
+			Bench<InlineSession>("BasicKcpSession(inline)", mode, batch, loops);
+		}
+	}
+	return 0;
+}
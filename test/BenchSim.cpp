@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+#include "../kcpp_sim.h"
+
+// a saturated reliable flow over the link profiles of kcpp_sim.h, each run a minute of virtual
+// time. the sessions stamp their msgs(SetLatencyTracking()), both sides reading the same clock.
+// the numbers only depend on the seeds, the wall time shows what a run costs.
+
+using kcpp::sim::LinkConfig;
+
+struct Profile
+{
+	const char* name_;
+	LinkConfig config_;
+};
+
+static void Bench(const Profile& profile, int seconds)
+{
+	kcpp::sim::Path path(profile.config_, profile.config_);
+	kcpp::sim::Session cli(kcpp::kCli, path.CliOutput(), path.CliInput(), path.Now());
+	kcpp::sim::Session srv(kcpp::kSrv, path.SrvOutput(), path.SrvInput(), path.Now());
+	cli.SetLatencyTracking(true);
+	srv.SetLatencyTracking(true);
+
+	std::string msg(1000, 'm');
+	uint64_t rcvedBytes = 0;
+	kcpp::Buf buf;
+	int len = 0;
+	auto begin = std::chrono::steady_clock::now();
+	const int64_t endTs = path.clock_.Now() + seconds * 1000;
+	for (; path.clock_.Now() < endTs; path.clock_.Advance(1))
+	{
+		while (cli.IsConnected() && cli.CheckCanSend())
+			cli.Send(msg.data(), static_cast<int>(msg.size()));
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len))
+			{
+				if (len > 0)
+					rcvedBytes += len;
+				buf.retrieveAll();
+			}
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	const kcpp::LatencyHistogram& latency = srv.GetLatency()->reliable_;
+	kcpp::KcpSessionStats stats = cli.GetStats();
+	const kcpp::sim::LinkStats& link = path.c2s_.Stats();
+	printf("%-24s : %7.1f KB/s, latency p50 %4u p99 %4u p999 %4u ms, retransmits %6d, lost %6d dropped %6d of %7d, %4d ms wall\n",
+		profile.name_, rcvedBytes / 1024.0 / seconds,
+		latency.ValueAtPercentile(50), latency.ValueAtPercentile(99), latency.ValueAtPercentile(99.9),
+		static_cast<int>(stats.timeoutRetransmits_ + stats.fastRetransmits_),
+		static_cast<int>(link.lost_), static_cast<int>(link.queueDrops_), static_cast<int>(link.sent_),
+		static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()));
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 60;
+	if (seconds <= 0)
+		seconds = 60;
+
+	Profile profiles[5];
+	profiles[0].name_ = "20ms";
+
+	profiles[1].name_ = "20ms, 2% loss";
+	profiles[1].config_.lossRate_ = 0.02;
+
+	// about 1.6% loss on average, in bursts of 3 or so
+	profiles[2].name_ = "20ms, burst loss";
+	profiles[2].config_.goodToBadRate_ = 0.01;
+	profiles[2].config_.badToGoodRate_ = 0.3;
+	profiles[2].config_.burstLossRate_ = 0.5;
+
+	profiles[3].name_ = "20ms, 2Mbps, 16KB queue";
+	profiles[3].config_.bandwidth_ = 250000;
+	profiles[3].config_.queueBytes_ = 16 * 1024;
+
+	profiles[4].name_ = "20ms+-10, reorder, dup";
+	profiles[4].config_.jitterMs_ = 10;
+	profiles[4].config_.reorderRate_ = 0.02;
+	profiles[4].config_.reorderDelayMs_ = 20;
+	profiles[4].config_.duplicateRate_ = 0.01;
+
+	for (const Profile& profile : profiles)
+		Bench(profile, seconds);
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../kcpp_sim.h"
+
+// head-of-line blocking of reliable msgs over a lossy link.
+// - streams : a critical msg flow sharing a session with bulk traffic, the critical msgs sent
+//   on the bulk's stream or on a stream of their own of higher priority.
+//   paced : bulk well below the send window, the critical msgs only wait on the bulk's losses.
+//   saturated : bulk keeps the send window full, the critical msgs wait on it too.
+// - unordered : independent msgs, some of them fragmented, sent kReliable or kReliableUnordered.
+// the link and the clock are kcpp_sim.h's, every run gives the same numbers.
+
+typedef kcpp::sim::Session Session;
+
+// delivers every datagram 30ms later but a seeded share of them
+static kcpp::sim::LinkConfig LossyLink(double loss)
+{
+	kcpp::sim::LinkConfig config;
+	config.delayMs_ = 30;
+	config.lossRate_ = loss;
+	return config;
+}
+
+static const char kCritical = 'c';
+static const char kBulk = 'b';
+
+static int64_t Percentile(std::vector<int64_t>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = static_cast<size_t>(p * (sorted.size() - 1));
+	return sorted[i];
+}
+
+static void Bench(double loss, bool saturated, bool ownStream, int seconds)
+{
+	kcpp::sim::Path path(LossyLink(loss), LossyLink(loss));
+	Session cli(kcpp::kCli, path.CliOutput(), path.CliInput(), path.Now());
+	Session srv(kcpp::kSrv, path.SrvOutput(), path.SrvInput(), path.Now());
+	int criticalStream = 0;
+	if (ownStream)
+	{
+		criticalStream = cli.AddStream(1);
+		srv.AddStream(1);
+	}
+
+	std::string critical(32, kCritical);
+	std::string bulk(500, kBulk);
+	std::vector<int64_t> latencies;
+	size_t bulkCnt = 0;
+	kcpp::Buf buf;
+	int len = 0;
+	const int64_t endTs = path.clock_.Now() + seconds * 1000;
+	for (; path.clock_.Now() < endTs; path.clock_.Advance(1))
+	{
+		int64_t now = path.clock_.Now();
+		if (cli.IsConnected())
+		{
+			if (now % 20 == 0)
+			{
+				memcpy(&critical[1], &now, sizeof now);
+				cli.SendOnStream(criticalStream, critical.data(), static_cast<int>(critical.size()));
+			}
+			// paced : a msg every 2ms, about a sixth of what the send window lets through
+			if (saturated)
+			{
+				while (cli.CheckCanSend())
+					cli.Send(bulk.data(), static_cast<int>(bulk.size()));
+			}
+			else if (now % 2 == 0)
+				cli.Send(bulk.data(), static_cast<int>(bulk.size()));
+		}
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len))
+			{
+				if (len > 0 && buf.peek()[0] == kCritical)
+				{
+					int64_t sentTs = 0;
+					memcpy(&sentTs, buf.peek() + 1, sizeof sentTs);
+					latencies.push_back(now - sentTs);
+				}
+				else if (len > 0)
+					++bulkCnt;
+				buf.retrieveAll();
+			}
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("loss %4.1f%% %-9s critical on %-21s : p50 %4d ms, p99 %5d ms, max %5d ms, %5d critical %6d bulk msgs\n",
+		loss * 100, saturated ? "saturated" : "paced", ownStream ? "its own stream(prio 1)" : "the bulk's stream",
+		static_cast<int>(Percentile(latencies, 0.5)), static_cast<int>(Percentile(latencies, 0.99)),
+		static_cast<int>(latencies.empty() ? 0 : latencies.back()),
+		static_cast<int>(latencies.size()), static_cast<int>(bulkCnt));
+}
+
+static void BenchUnordered(double loss, kcpp::TransmitModeE transmitMode, int seconds)
+{
+	kcpp::sim::Path path(LossyLink(loss), LossyLink(loss));
+	Session cli(kcpp::kCli, path.CliOutput(), path.CliInput(), path.Now());
+	Session srv(kcpp::kSrv, path.SrvOutput(), path.SrvInput(), path.Now());
+
+	// every 8th msg takes 3 segments
+	std::string small(100, 'u');
+	std::string large(1200, 'u');
+	std::vector<int64_t> latencies;
+	std::vector<bool> rcved;
+	int badCnt = 0;
+	kcpp::Buf buf;
+	int len = 0;
+	const int64_t endTs = path.clock_.Now() + seconds * 1000;
+	for (; path.clock_.Now() < endTs; path.clock_.Advance(1))
+	{
+		int64_t now = path.clock_.Now();
+		if (cli.IsConnected() && now % 5 == 0)
+		{
+			std::string& msg = rcved.size() % 8 == 7 ? large : small;
+			uint32_t id = static_cast<uint32_t>(rcved.size());
+			memcpy(&msg[0], &now, sizeof now);
+			memcpy(&msg[sizeof now], &id, sizeof id);
+			cli.Send(msg.data(), static_cast<int>(msg.size()), transmitMode);
+			rcved.push_back(false);
+		}
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len))
+			{
+				if (len > 0)
+				{
+					int64_t sentTs = 0;
+					uint32_t id = 0;
+					memcpy(&sentTs, buf.peek(), sizeof sentTs);
+					memcpy(&id, buf.peek() + sizeof sentTs, sizeof id);
+					if (id >= rcved.size() || rcved[id] || (len != 100 && len != 1200))
+						++badCnt;
+					else
+						rcved[id] = true;
+					latencies.push_back(now - sentTs);
+				}
+				buf.retrieveAll();
+			}
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("loss %4.1f%% %-18s : p50 %4d ms, p90 %4d ms, p99 %5d ms, max %5d ms, %5d/%5d msgs delivered, %d bad\n",
+		loss * 100, transmitMode == kcpp::kReliable ? "kReliable" : "kReliableUnordered",
+		static_cast<int>(Percentile(latencies, 0.5)), static_cast<int>(Percentile(latencies, 0.9)),
+		static_cast<int>(Percentile(latencies, 0.99)),
+		static_cast<int>(latencies.empty() ? 0 : latencies.back()),
+		static_cast<int>(latencies.size()), static_cast<int>(rcved.size()), badCnt);
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 30;
+	if (seconds <= 0)
+		seconds = 30;
+
+	const double losses[] = { 0, 0.02, 0.1 };
+	const bool saturatedOnOff[] = { false, true };
+	for (bool saturated : saturatedOnOff)
+	{
+		for (double loss : losses)
+		{
+			Bench(loss, saturated, false, seconds);
+			Bench(loss, saturated, true, seconds);
+		}
+	}
+
+	const kcpp::TransmitModeE modes[] = { kcpp::kReliable, kcpp::kReliableUnordered };
+	for (double loss : losses)
+		for (kcpp::TransmitModeE mode : modes)
+			BenchUnordered(loss, mode, seconds);
+	return 0;
+}
@@ -0,0 +1,473 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../kcpp.h"
+
+// micro benchmarks of the hot paths, one function each at a time :
+// - ikcp_input : a receive window of data segments, in order or with some of them late
+// - ikcp_flush : sending a window of new segments, scanning a full snd_buf, retransmitting part of it
+// - ikcp_check : over a full snd_buf
+// - Rdc::Output / Rdc::Input : kcp segments and unreliable msgs, redundancy on and off
+// - Buf : append/retrieve, prepend, growth
+// prints a JSON document : ns, heap allocations(operator new and ikcp's malloc) and payload
+// bytes copied(built with KCPP_COUNT_COPIES and IKCP_COUNT_COPIES) per op of each benchmark,
+// only the timed sections counted. `kcpp_bench [scale]`, scale multiplies the op counts.
+
+static uint64_t gAllocCnt = 0;
+
+void* operator new(size_t size)
+{
+	++gAllocCnt;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static void* CountingMalloc(size_t size)
+{
+	++gAllocCnt;
+	return malloc(size);
+}
+
+static uint64_t CopiedBytes()
+{
+	uint64_t bytes = 0;
+#ifdef KCPP_COUNT_COPIES
+	bytes += kcpp::CopiedBytes();
+#endif
+#ifdef IKCP_COUNT_COPIES
+	bytes += ikcp_copied_bytes;
+#endif
+	return bytes;
+}
+
+// accumulates the timed sections of a benchmark
+class Meter
+{
+public:
+	Meter() : ns_(0), allocCnt_(0), copiedBytes_(0), ops_(0), allocCntBefore_(0), copiedBytesBefore_(0) {}
+
+	void Start()
+	{
+		allocCntBefore_ = gAllocCnt;
+		copiedBytesBefore_ = CopiedBytes();
+		begin_ = std::chrono::steady_clock::now();
+	}
+
+	void Stop(uint64_t ops)
+	{
+		auto end = std::chrono::steady_clock::now();
+		ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin_).count();
+		allocCnt_ += gAllocCnt - allocCntBefore_;
+		copiedBytes_ += CopiedBytes() - copiedBytesBefore_;
+		ops_ += ops;
+	}
+
+	uint64_t ns_;
+	uint64_t allocCnt_;
+	uint64_t copiedBytes_;
+	uint64_t ops_;
+
+private:
+	std::chrono::steady_clock::time_point begin_;
+	uint64_t allocCntBefore_;
+	uint64_t copiedBytesBefore_;
+};
+
+static bool gIsFirstResult = true;
+
+// `params` : the members of a JSON object
+static void Report(const char* name, const std::string& params, const Meter& meter)
+{
+	double ops = meter.ops_ > 0 ? static_cast<double>(meter.ops_) : 1;
+	printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"ops\": %llu, \"ns_per_op\": %.1f, "
+		"\"allocs_per_op\": %.3f, \"bytes_copied_per_op\": %.1f}",
+		gIsFirstResult ? "" : ",", name, params.c_str(), static_cast<unsigned long long>(meter.ops_),
+		meter.ns_ / ops, meter.allocCnt_ / ops, meter.copiedBytes_ / ops);
+	gIsFirstResult = false;
+}
+
+static std::string Params(const char* fmt, ...)
+{
+	char params[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(params, sizeof params, fmt, args);
+	va_end(args);
+	return params;
+}
+
+/// ------ kcp --------
+
+static const IUINT32 kConv = 0x11223344;
+static const int kCmdPush = 81;
+static const int kCmdWins = 84;
+static const int kKcpOverhead = 24;
+static const int kMtu = 1400;
+
+static int DiscardOutput(const char* buf, int len, ikcpcb* kcp, void* user) { return 0; }
+
+static char* Encode32(char* p, IUINT32 v)
+{
+	p[0] = static_cast<char>(v); p[1] = static_cast<char>(v >> 8);
+	p[2] = static_cast<char>(v >> 16); p[3] = static_cast<char>(v >> 24);
+	return p + 4;
+}
+
+// a segment as ikcp_encode_seg() lays it out, then its data
+static void AppendSegment(std::string* datagram, int cmd, IUINT32 wnd, IUINT32 sn, IUINT32 una, size_t len)
+{
+	char header[kKcpOverhead];
+	char* p = Encode32(header, kConv);
+	*p++ = static_cast<char>(cmd);
+	*p++ = 0; // frg
+	*p++ = static_cast<char>(wnd); *p++ = static_cast<char>(wnd >> 8);
+	p = Encode32(p, 0); // ts
+	p = Encode32(p, sn);
+	p = Encode32(p, una);
+	Encode32(p, static_cast<IUINT32>(len));
+	datagram->append(header, kKcpOverhead);
+	datagram->append(len, 'k');
+}
+
+static ikcpcb* CreateKcp(int wnd)
+{
+	ikcpcb* kcp = ikcp_create(kConv, nullptr);
+	ikcp_setoutput(kcp, DiscardOutput);
+	ikcp_wndsize(kcp, wnd, wnd);
+	ikcp_nodelay(kcp, 1, 10, 2, 1);
+	ikcp_setmtu(kcp, kMtu);
+	ikcp_update(kcp, 0);
+	kcp->rmt_wnd = wnd;
+	return kcp;
+}
+
+enum LossE { kNoLoss, kRandomLoss, kBurstLoss };
+static const char* const kLossNames[] = { "none", "random 2%", "bursts of 5, 2%" };
+
+// the segments of a window in arrival order, the lost ones coming last as their retransmits would
+static std::vector<IUINT32> ArrivalOrder(IUINT32 baseSn, int wnd, LossE loss, unsigned* seed)
+{
+	std::vector<IUINT32> inOrder;
+	std::vector<IUINT32> late;
+	int burstLeft = 0;
+	for (int i = 0; i < wnd; ++i)
+	{
+		*seed = *seed * 1103515245 + 12345;
+		bool isLost = false;
+		if (loss == kRandomLoss)
+			isLost = (*seed >> 16) % 50 == 0;
+		else if (loss == kBurstLoss)
+		{
+			if (burstLeft == 0 && (*seed >> 16) % 250 == 0)
+				burstLeft = 5;
+			isLost = burstLeft > 0;
+			if (burstLeft > 0)
+				--burstLeft;
+		}
+		(isLost ? late : inOrder).push_back(baseSn + i);
+	}
+	inOrder.insert(inOrder.end(), late.begin(), late.end());
+	return inOrder;
+}
+
+static void BenchInput(int wnd, size_t msgLen, LossE loss, int rounds)
+{
+	ikcpcb* kcp = CreateKcp(wnd);
+	std::vector<char> rcvBuf(msgLen);
+	unsigned seed = 1;
+	IUINT32 baseSn = 0;
+	Meter meter;
+	for (int round = 0; round < rounds; ++round, baseSn += wnd)
+	{
+		// datagrams of up to mtu bytes, packed in arrival order as kcp packs them
+		std::vector<std::string> datagrams(1);
+		for (IUINT32 sn : ArrivalOrder(baseSn, wnd, loss, &seed))
+		{
+			if (datagrams.back().size() + kKcpOverhead + msgLen > static_cast<size_t>(kMtu))
+				datagrams.push_back(std::string());
+			AppendSegment(&datagrams.back(), kCmdPush, wnd, sn, 0, msgLen);
+		}
+
+		meter.Start();
+		for (const std::string& datagram : datagrams)
+			ikcp_input(kcp, datagram.data(), static_cast<long>(datagram.size()));
+		meter.Stop(wnd);
+
+		while (ikcp_recv(kcp, &rcvBuf[0], static_cast<int>(msgLen)) > 0)
+			;
+		ikcp_flush(kcp); // the acks
+	}
+	ikcp_release(kcp);
+	Report("ikcp_input", Params("\"unit\": \"segment\", \"wnd\": %d, \"msg_bytes\": %d, \"loss\": \"%s\"",
+		wnd, static_cast<int>(msgLen), kLossNames[loss]), meter);
+}
+
+// acks everything sent, as a window update carrying una
+static void AckAll(ikcpcb* kcp)
+{
+	std::string datagram;
+	AppendSegment(&datagram, kCmdWins, kcp->snd_wnd, 0, kcp->snd_nxt, 0);
+	ikcp_input(kcp, datagram.data(), static_cast<long>(datagram.size()));
+}
+
+static void FillSndBuf(ikcpcb* kcp, int wnd, size_t msgLen)
+{
+	std::string msg(msgLen, 'k');
+	for (int i = 0; i < wnd; ++i)
+		ikcp_send(kcp, msg.data(), static_cast<int>(msgLen));
+	ikcp_flush(kcp);
+}
+
+static void BenchFlushNew(int wnd, size_t msgLen, int rounds)
+{
+	ikcpcb* kcp = CreateKcp(wnd);
+	std::string msg(msgLen, 'k');
+	Meter meter;
+	for (int round = 0; round < rounds; ++round)
+	{
+		for (int i = 0; i < wnd; ++i)
+			ikcp_send(kcp, msg.data(), static_cast<int>(msgLen));
+		meter.Start();
+		ikcp_flush(kcp);
+		meter.Stop(wnd);
+		AckAll(kcp);
+	}
+	ikcp_release(kcp);
+	Report("ikcp_flush", Params("\"unit\": \"segment\", \"case\": \"new window\", \"wnd\": %d, \"msg_bytes\": %d",
+		wnd, static_cast<int>(msgLen)), meter);
+}
+
+// `resendEvery` 0 : nothing due, a scan of snd_buf
+static void BenchFlushSndBuf(int wnd, size_t msgLen, int resendEvery, int rounds)
+{
+	ikcpcb* kcp = CreateKcp(wnd);
+	FillSndBuf(kcp, wnd, msgLen);
+	Meter meter;
+	for (int round = 0; round < rounds; ++round)
+	{
+		if (resendEvery > 0)
+		{
+			int i = 0;
+			for (IQUEUEHEAD* p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next, ++i)
+			{
+				IKCPSEG* seg = iqueue_entry(p, IKCPSEG, node);
+				seg->xmit = 1;
+				seg->rto = kcp->rx_rto;
+				if (i % resendEvery == 0)
+					seg->resendts = kcp->current;
+			}
+		}
+		meter.Start();
+		ikcp_flush(kcp);
+		meter.Stop(1);
+	}
+	ikcp_release(kcp);
+	Report("ikcp_flush", Params("\"unit\": \"flush\", \"case\": \"%s\", \"wnd\": %d, \"msg_bytes\": %d, \"resend_every\": %d",
+		resendEvery > 0 ? "retransmit" : "full snd_buf", wnd, static_cast<int>(msgLen), resendEvery), meter);
+}
+
+static void BenchCheck(int wnd, int rounds)
+{
+	ikcpcb* kcp = CreateKcp(wnd);
+	FillSndBuf(kcp, wnd, 100);
+	IUINT32 sum = 0;
+	Meter meter;
+	meter.Start();
+	for (int round = 0; round < rounds; ++round)
+		sum += ikcp_check(kcp, static_cast<IUINT32>(round & 7));
+	meter.Stop(rounds);
+	ikcp_release(kcp);
+	Report("ikcp_check", Params("\"unit\": \"call\", \"wnd\": %d, \"checksum\": %u", wnd, sum), meter);
+}
+
+/// ------ Rdc --------
+
+static std::vector<std::string> gDatagrams;
+static void KeepOutput(const void* data, int len) { gDatagrams.emplace_back(static_cast<const char*>(data), len); }
+static void IgnoreOutput(const void* data, int len) {}
+
+static void IgnoreRecv(kcpp::Buf* userBuf, int& len, const char* data, int dataLen, kcpp::PktTypeE pktType) { len = 0; }
+
+// hands the msg over as KcpSession does
+static void AppendRecv(kcpp::Buf* userBuf, int& len, const char* data, int dataLen, kcpp::PktTypeE pktType)
+{
+	userBuf->append(data, dataLen);
+	userBuf->retrieveAll();
+	len = dataLen;
+}
+
+static const char* PktTypeName(kcpp::PktTypeE pktType) { return pktType == kcpp::kPsh ? "kcp" : "unreliable"; }
+
+static void BenchRdcOutput(bool rdcOn, kcpp::PktTypeE pktType, size_t msgLen, int loops)
+{
+	kcpp::Rdc rdc(IgnoreOutput, IgnoreRecv);
+	rdc.SetMTU(576);
+	rdc.Switch(rdcOn);
+	std::string msg(msgLen, 'k');
+	kcpp::Buf oBuf;
+	for (int i = 0; i < 1000; ++i) // the history and the buffers reach their steady size
+	{
+		oBuf.append(msg.data(), msg.size());
+		rdc.Output(&oBuf, pktType);
+	}
+
+	Meter meter;
+	for (int i = 0; i < loops; ++i)
+	{
+		oBuf.append(msg.data(), msg.size()); // the caller's, not timed
+		meter.Start();
+		rdc.Output(&oBuf, pktType);
+		meter.Stop(1);
+	}
+	Report("Rdc::Output", Params("\"unit\": \"msg\", \"pkt\": \"%s\", \"rdc\": %s, \"msg_bytes\": %d",
+		PktTypeName(pktType), rdcOn ? "true" : "false", static_cast<int>(msgLen)), meter);
+}
+
+static void BenchRdcInput(bool rdcOn, kcpp::PktTypeE pktType, size_t msgLen, int msgCnt)
+{
+	kcpp::Rdc snd(KeepOutput, IgnoreRecv);
+	snd.SetMTU(576);
+	snd.Switch(rdcOn);
+	std::string msg(msgLen, 'k');
+	kcpp::Buf oBuf;
+	gDatagrams.clear();
+	for (int i = 0; i < msgCnt; ++i)
+	{
+		oBuf.append(msg.data(), msg.size());
+		snd.Output(&oBuf, pktType);
+	}
+
+	kcpp::Rdc rcv(IgnoreOutput, AppendRecv);
+	kcpp::Buf iBuf;
+	kcpp::Buf userBuf;
+	int len = 0;
+	Meter meter;
+	for (const std::string& datagram : gDatagrams)
+	{
+		iBuf.append(datagram.data(), datagram.size()); // the recvfrom()'s, not timed
+		meter.Start();
+		while (rcv.Input(&userBuf, len, &iBuf))
+			;
+		meter.Stop(1);
+	}
+	Report("Rdc::Input", Params("\"unit\": \"datagram\", \"pkt\": \"%s\", \"rdc\": %s, \"msg_bytes\": %d",
+		PktTypeName(pktType), rdcOn ? "true" : "false", static_cast<int>(msgLen)), meter);
+}
+
+/// ------ Buf --------
+
+static void BenchBufAppend(size_t len, int loops)
+{
+	std::string data(len, 'k');
+	kcpp::Buf buf;
+	Meter meter;
+	meter.Start();
+	for (int i = 0; i < loops; ++i)
+	{
+		buf.append(data.data(), len);
+		buf.retrieveAll();
+	}
+	meter.Stop(loops);
+	Report("Buf", Params("\"unit\": \"append+retrieveAll\", \"bytes\": %d", static_cast<int>(len)), meter);
+}
+
+static void BenchBufPrepend(size_t len, int loops)
+{
+	std::string data(len, 'k');
+	kcpp::Buf buf(kcpp::Buf::kInitialSize, 16);
+	Meter meter;
+	meter.Start();
+	for (int i = 0; i < loops; ++i)
+	{
+		buf.append(data.data(), len);
+		buf.prependInt32(i);
+		buf.retrieveAll();
+	}
+	meter.Stop(loops);
+	Report("Buf", Params("\"unit\": \"append+prependInt32+retrieveAll\", \"bytes\": %d", static_cast<int>(len)), meter);
+}
+
+// a fresh Buf growing to `len` bytes a chunk at a time, as a large msg being reassembled
+static void BenchBufGrowth(size_t len, int loops)
+{
+	std::string chunk(1024, 'k');
+	Meter meter;
+	meter.Start();
+	for (int i = 0; i < loops; ++i)
+	{
+		kcpp::Buf buf;
+		for (size_t appended = 0; appended < len; appended += chunk.size())
+			buf.append(chunk.data(), chunk.size());
+	}
+	meter.Stop(loops);
+	Report("Buf", Params("\"unit\": \"grow from empty\", \"bytes\": %d", static_cast<int>(len)), meter);
+}
+
+int main(int argc, char* argv[])
+{
+	double scale = argc > 1 ? atof(argv[1]) : 1;
+	if (scale <= 0)
+		scale = 1;
+	ikcp_allocator(CountingMalloc, free);
+
+	printf("{\n  \"copies_counted\": %s,\n  \"benchmarks\": [",
+#if defined(KCPP_COUNT_COPIES) && defined(IKCP_COUNT_COPIES)
+		"true"
+#else
+		"false"
+#endif
+		);
+
+	const int wnds[] = { 32, 128, 512 };
+	const size_t segLens[] = { 64, 512, 1376 };
+	const LossE losses[] = { kNoLoss, kRandomLoss, kBurstLoss };
+	for (int wnd : wnds)
+		for (size_t segLen : segLens)
+			for (LossE loss : losses)
+				BenchInput(wnd, segLen, loss, static_cast<int>(scale * 256 * 1024 / wnd));
+
+	for (int wnd : wnds)
+	{
+		for (size_t segLen : segLens)
+			BenchFlushNew(wnd, segLen, static_cast<int>(scale * 256 * 1024 / wnd));
+		BenchFlushSndBuf(wnd, 512, 0, static_cast<int>(scale * 4 * 1024 * 1024 / wnd));
+		BenchFlushSndBuf(wnd, 512, 50, static_cast<int>(scale * 4 * 1024 * 1024 / wnd));
+		BenchFlushSndBuf(wnd, 512, 10, static_cast<int>(scale * 1024 * 1024 / wnd));
+		BenchCheck(wnd, static_cast<int>(scale * 16 * 1024 * 1024 / wnd));
+	}
+
+	const bool rdcOnOff[] = { false, true };
+	for (bool on : rdcOnOff)
+	{
+		BenchRdcOutput(on, kcpp::kPsh, 200, static_cast<int>(scale * 500000));
+		BenchRdcOutput(on, kcpp::kPsh, 540, static_cast<int>(scale * 500000));
+		BenchRdcOutput(on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 100, static_cast<int>(scale * 500000));
+		BenchRdcOutput(on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 4000, static_cast<int>(scale * 100000));
+		BenchRdcInput(on, kcpp::kPsh, 200, static_cast<int>(scale * 200000));
+		BenchRdcInput(on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 100, static_cast<int>(scale * 200000));
+		BenchRdcInput(on, static_cast<kcpp::PktTypeE>(kcpp::kUnreliable), 4000, static_cast<int>(scale * 50000));
+	}
+
+	const size_t bufLens[] = { 64, 512, 1400 };
+	for (size_t len : bufLens)
+	{
+		BenchBufAppend(len, static_cast<int>(scale * 2000000));
+		BenchBufPrepend(len, static_cast<int>(scale * 2000000));
+	}
+	BenchBufGrowth(64 * 1024, static_cast<int>(scale * 20000));
+	BenchBufGrowth(256 * 1024, static_cast<int>(scale * 5000));
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../kcpp_capture.h"
+#include "../kcpp_sim.h"
+
+// feeds a capture of kcpp_capture.h back through a session under a virtual clock : the inbound
+// datagrams arrive at their recorded timestamps, the outbound ones are counted against the
+// recorded ones. the peer doesn't react to the replayed session, so what changes with -r is
+// this side's handling of the real traffic : the receive path, acks, redundancy.
+//	KcppReplay replay <file> [-r off|on|dynamic] [-s streams] [-c] [-l]
+//		-s, -c, -l : the captured session's setup, its stream count, coalescing, latency tracking
+//	KcppReplay record <file> [loss %] [seconds] [srv]
+//		captures the client, or the server, of a kcpp_sim.h run to try replay on
+
+using kcpp::capture::Record;
+
+static const int kSimSeconds = 10;
+
+/// ------ record --------
+
+typedef kcpp::BasicKcpSession<kcpp::capture::Output<kcpp::sim::LinkOutput, kcpp::sim::ClockNow>,
+	kcpp::capture::Input<kcpp::sim::LinkInput, kcpp::sim::ClockNow>, kcpp::sim::ClockNow> CapturedSession;
+
+static int RecordSim(const char* path, double lossPercent, int seconds, kcpp::RoleTypeE role)
+{
+	kcpp::capture::Writer writer(path, role);
+	if (!writer.IsOpen())
+	{
+		printf("can't open %s\n", path);
+		return 1;
+	}
+	kcpp::capture::Writer* cliWriter = role == kcpp::kCli ? &writer : nullptr;
+	kcpp::capture::Writer* srvWriter = role == kcpp::kSrv ? &writer : nullptr;
+	kcpp::sim::LinkConfig config;
+	config.lossRate_ = lossPercent / 100;
+	kcpp::sim::Path path_(config, config);
+	CapturedSession cli(kcpp::kCli,
+		kcpp::capture::MakeOutput(path_.CliOutput(), path_.Now(), cliWriter),
+		kcpp::capture::MakeInput(path_.CliInput(), path_.Now(), cliWriter), path_.Now());
+	CapturedSession srv(kcpp::kSrv,
+		kcpp::capture::MakeOutput(path_.SrvOutput(), path_.Now(), srvWriter),
+		kcpp::capture::MakeInput(path_.SrvInput(), path_.Now(), srvWriter), path_.Now());
+
+	std::string reliable(200, 'r');
+	std::string unreliable(100, 'u');
+	kcpp::Buf buf;
+	int len = 0;
+	for (int tick = 0; tick < seconds * 100; ++tick, path_.clock_.Advance(10))
+	{
+		if (cli.IsConnected() && cli.CheckCanSend())
+			cli.Send(reliable.data(), static_cast<int>(reliable.size()));
+		if (srv.IsConnected() && tick % 3 == 0)
+			srv.Send(unreliable.data(), static_cast<int>(unreliable.size()), kcpp::kUnreliable);
+		if (srv.IsConnected() && tick % 5 == 0 && srv.CheckCanSend())
+			srv.Send(reliable.data(), static_cast<int>(reliable.size()));
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+	}
+
+	kcpp::KcpSessionStats stats = role == kcpp::kCli ? cli.GetStats() : srv.GetStats();
+	printf("recorded %s : %llu datagrams out, %llu in, the %s got %llu reliable and %llu unreliable msgs, %llu records dropped\n",
+		path, static_cast<unsigned long long>(stats.datagramsOut_), static_cast<unsigned long long>(stats.datagramsIn_),
+		role == kcpp::kCli ? "client" : "server", static_cast<unsigned long long>(stats.reliable_.msgsIn_),
+		static_cast<unsigned long long>(stats.unreliable_.msgsIn_), static_cast<unsigned long long>(writer.DroppedCnt()));
+	return 0;
+}
+
+/// ------ replay --------
+
+struct ReplayOptions
+{
+	ReplayOptions() : rdcMode_(kcpp::kRdcDynamic), streamCnt_(1), isCoalescing_(false), isTrackingLatency_(false) {}
+
+	kcpp::RedundancyModeE rdcMode_;
+	int streamCnt_;
+	bool isCoalescing_;
+	bool isTrackingLatency_;
+};
+
+struct Replay
+{
+	explicit Replay(const std::vector<Record>* records) : records_(records), next_(0), outCnt_(0), outBytes_(0) {}
+
+	// the next inbound datagram recorded by now
+	const Record* NextIn(int64_t now)
+	{
+		while (next_ < records_->size() && (*records_)[next_].direction_ != kcpp::capture::kIn)
+			++next_;
+		if (next_ == records_->size() || (*records_)[next_].ts_ > now)
+			return nullptr;
+		return &(*records_)[next_++];
+	}
+
+	// -1 once every inbound datagram is in
+	int64_t NextInTs()
+	{
+		for (size_t i = next_; i < records_->size(); ++i)
+			if ((*records_)[i].direction_ == kcpp::capture::kIn)
+				return (*records_)[i].ts_;
+		return -1;
+	}
+
+	const std::vector<Record>* records_;
+	size_t next_;
+	uint64_t outCnt_;
+	uint64_t outBytes_;
+	std::string received_;
+};
+
+struct ReplayOutput
+{
+	explicit ReplayOutput(Replay* replay) : replay_(replay) {}
+	void operator()(const void* data, int len) const { ++replay_->outCnt_; replay_->outBytes_ += len; }
+	Replay* replay_;
+};
+
+struct ReplayInput
+{
+	ReplayInput(Replay* replay, const kcpp::sim::Clock* clock) : replay_(replay), clock_(clock) {}
+
+	kcpp::UserInputData operator()() const
+	{
+		const Record* record = replay_->NextIn(clock_->Now());
+		if (!record || record->datagram_.empty())
+			return kcpp::UserInputData(nullptr, -1);
+		replay_->received_ = record->datagram_; // the session may write into it, the record stays as it was
+		return kcpp::UserInputData(&replay_->received_[0], static_cast<int>(replay_->received_.size()));
+	}
+
+	Replay* replay_;
+	const kcpp::sim::Clock* clock_;
+};
+
+typedef kcpp::BasicKcpSession<ReplayOutput, ReplayInput, kcpp::sim::ClockNow> ReplaySession;
+
+static IUINT32 gCapturedConv = 0;
+
+static void FindConv(kcpp::Buf* userBuf, int& len, const char* data, int dataLen, kcpp::PktTypeE pktType)
+{
+	if (pktType == kcpp::kPsh && gCapturedConv == 0 && dataLen >= 4)
+		gCapturedConv = ikcp_getconv(data) & 0xffffff; // the top byte tells the stream
+	len = 0;
+}
+
+// the conv the captured server handed out, from the first kcp datagram its client sent
+static IUINT32 CapturedConv(const std::vector<Record>& records)
+{
+	kcpp::Rdc rdc([](const void*, int) {}, FindConv);
+	kcpp::Buf iBuf;
+	kcpp::Buf userBuf;
+	int len = 0;
+	for (const Record& record : records)
+	{
+		if (record.direction_ != kcpp::capture::kIn || gCapturedConv != 0)
+			continue;
+		iBuf.append(record.datagram_.data(), record.datagram_.size());
+		while (rdc.Input(&userBuf, len, &iBuf))
+			;
+		iBuf.retrieveAll();
+	}
+	return gCapturedConv;
+}
+
+static int ReplayCapture(const char* path, const ReplayOptions& options)
+{
+	kcpp::capture::Reader reader(path);
+	if (!reader.IsValid())
+	{
+		printf("%s is not a kcpp capture\n", path);
+		return 1;
+	}
+	std::vector<Record> records;
+	Record record;
+	uint64_t capturedOutCnt = 0;
+	uint64_t capturedOutBytes = 0;
+	while (reader.Next(record))
+	{
+		if (record.direction_ == kcpp::capture::kOut)
+		{
+			++capturedOutCnt;
+			capturedOutBytes += record.datagram_.size();
+		}
+		records.push_back(record);
+	}
+	if (records.empty())
+	{
+		printf("%s has no datagrams\n", path);
+		return 1;
+	}
+	if (reader.Role() == kcpp::kSrv)
+	{
+		IUINT32 conv = CapturedConv(records);
+		if (conv != 0)
+			kcpp::NextKcpConv() = conv;
+	}
+
+	kcpp::sim::Clock clock(records.front().ts_);
+	Replay replay(&records);
+	ReplaySession session(reader.Role(), ReplayOutput(&replay), ReplayInput(&replay, &clock), kcpp::sim::ClockNow(&clock));
+	session.SetRedundancy(options.rdcMode_);
+	for (int i = 1; i < options.streamCnt_; ++i)
+		session.AddStream();
+	if (options.isCoalescing_)
+		session.SetCoalescing(true);
+	if (options.isTrackingLatency_)
+		session.SetLatencyTracking(true);
+
+	kcpp::Buf buf;
+	int len = 0;
+	int errorCnt = 0;
+	auto begin = std::chrono::steady_clock::now();
+	// the recorded span, then a second for what it set off
+	const int64_t endTs = records.back().ts_ + 1000;
+	while (clock.Now() <= endTs)
+	{
+		int64_t nextUpdateTs = session.Update();
+		do
+		{
+			while (session.Recv(&buf, len))
+				buf.retrieveAll();
+			if (len < 0 && len != -10)
+				++errorCnt;
+		} while (len != -10);
+		int64_t nextInTs = replay.NextInTs();
+		int64_t nextTs = nextUpdateTs > clock.Now() ? nextUpdateTs : clock.Now() + 1;
+		if (nextInTs >= 0 && nextInTs < nextTs)
+			nextTs = std::max(nextInTs, clock.Now() + 1);
+		clock.AdvanceTo(nextTs);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	kcpp::KcpSessionStats stats = session.GetStats();
+	printf("%s : %s capture of %d records, %.1f s\n", path, reader.Role() == kcpp::kCli ? "client" : "server",
+		static_cast<int>(records.size()), (records.back().ts_ - records.front().ts_) / 1000.0);
+	printf("  in  : %llu datagrams, %llu reliable %llu unreliable %llu state msgs, %llu duplicates, %d errors\n",
+		static_cast<unsigned long long>(stats.datagramsIn_), static_cast<unsigned long long>(stats.reliable_.msgsIn_),
+		static_cast<unsigned long long>(stats.unreliable_.msgsIn_), static_cast<unsigned long long>(stats.state_.msgsIn_),
+		static_cast<unsigned long long>(stats.duplicatesIn_), errorCnt);
+	printf("  out : %llu datagrams %llu bytes replayed, %llu datagrams %llu bytes captured\n",
+		static_cast<unsigned long long>(replay.outCnt_), static_cast<unsigned long long>(replay.outBytes_),
+		static_cast<unsigned long long>(capturedOutCnt), static_cast<unsigned long long>(capturedOutBytes));
+	if (options.isTrackingLatency_)
+	{
+		const kcpp::LatencyHistogram& latency = session.GetLatency()->reliable_;
+		printf("  reliable latency p50 %u p99 %u max %u ms\n",
+			latency.ValueAtPercentile(50), latency.ValueAtPercentile(99), latency.Max());
+	}
+	printf("  %d ms wall\n", static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()));
+	return 0;
+}
+
+static int Usage()
+{
+	printf("KcppReplay replay <file> [-r off|on|dynamic] [-s streams] [-c] [-l]\n"
+		"KcppReplay record <file> [loss %%] [seconds] [srv]\n");
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+		return Usage();
+	if (strcmp(argv[1], "record") == 0)
+		return RecordSim(argv[2], argc > 3 ? atof(argv[3]) : 0, argc > 4 && atoi(argv[4]) > 0 ? atoi(argv[4]) : kSimSeconds,
+			argc > 5 && strcmp(argv[5], "srv") == 0 ? kcpp::kSrv : kcpp::kCli);
+	if (strcmp(argv[1], "replay") != 0)
+		return Usage();
+
+	ReplayOptions options;
+	for (int i = 3; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+		{
+			const char* mode = argv[++i];
+			options.rdcMode_ = strcmp(mode, "on") == 0 ? kcpp::kRdcOn : strcmp(mode, "off") == 0 ? kcpp::kRdcOff : kcpp::kRdcDynamic;
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			options.streamCnt_ = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-c") == 0)
+			options.isCoalescing_ = true;
+		else if (strcmp(argv[i], "-l") == 0)
+			options.isTrackingLatency_ = true;
+		else
+			return Usage();
+	}
+	return ReplayCapture(argv[2], options);
+}
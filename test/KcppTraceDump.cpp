@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../kcpp_sim.h"
+
+// decodes a KcpTrace::Dump() file, one line per kcp event, oldest first:
+//	KcppTraceDump <file> [conv]
+// or writes one from a reliable flow over a lossy kcpp_sim link, both sessions tracing all events:
+//	KcppTraceDump record <file> [loss %] [seconds]
+
+static const char* EventName(int event)
+{
+	switch (event)
+	{
+	case IKCP_LOG_OUTPUT: return "output";
+	case IKCP_LOG_INPUT: return "input";
+	case IKCP_LOG_SEND: return "send";
+	case IKCP_LOG_RECV: return "recv";
+	case IKCP_LOG_IN_DATA: return "in_data";
+	case IKCP_LOG_IN_ACK: return "in_ack";
+	case IKCP_LOG_IN_PROBE: return "in_probe";
+	case IKCP_LOG_IN_WINS: return "in_wins";
+	case IKCP_LOG_OUT_DATA: return "out_data";
+	case IKCP_LOG_OUT_ACK: return "out_ack";
+	case IKCP_LOG_OUT_PROBE: return "out_probe";
+	case IKCP_LOG_OUT_WINS: return "out_wins";
+	default: return "?";
+	}
+}
+
+static int Record(const char* path, double lossRate, int seconds)
+{
+	kcpp::sim::LinkConfig config;
+	config.lossRate_ = lossRate;
+	kcpp::sim::Path link(config, config);
+	kcpp::sim::Session cli(kcpp::kCli, link.CliOutput(), link.CliInput(), link.Now());
+	kcpp::sim::Session srv(kcpp::kSrv, link.SrvOutput(), link.SrvInput(), link.Now());
+	cli.SetTracing(-1);
+	srv.SetTracing(-1);
+
+	std::string msg(1000, 'm');
+	kcpp::Buf buf;
+	int len = 0;
+	const int64_t endTs = link.clock_.Now() + seconds * 1000;
+	for (; link.clock_.Now() < endTs; link.clock_.Advance(1))
+	{
+		while (cli.IsConnected() && cli.CheckCanSend())
+			cli.Send(msg.data(), static_cast<int>(msg.size()));
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+				buf.retrieveAll();
+		} while (len != -10);
+	}
+	if (!kcpp::KcpTrace::Dump(path))
+	{
+		fprintf(stderr, "can't write %s\n", path);
+		return 1;
+	}
+	printf("%d records to %s\n", static_cast<int>(kcpp::KcpTrace::Snapshot().size()), path);
+	return 0;
+}
+
+static int Decode(const char* path, bool isConvFiltered, IUINT32 conv)
+{
+	FILE* file = fopen(path, "rb");
+	char magic[8];
+	uint32_t recLen = 0;
+	if (!file || fread(magic, 1, sizeof magic, file) != sizeof magic || memcmp(magic, "KCPPTRC1", 8) != 0
+		|| fread(&recLen, sizeof recLen, 1, file) != 1)
+	{
+		fprintf(stderr, "%s isn't a kcp trace\n", path);
+		return 1;
+	}
+	if (recLen != sizeof(IKCPTRACEREC))
+	{
+		fprintf(stderr, "%s has %u byte records, this build reads %u\n", path,
+			recLen, static_cast<unsigned>(sizeof(IKCPTRACEREC)));
+		return 1;
+	}
+
+	printf("%10s %10s %-9s %10s %10s %10s %6s %5s %5s\n",
+		"ts", "conv", "event", "sn", "una", "arg", "rto", "cwnd", "wnd");
+	IKCPTRACEREC rec;
+	while (fread(&rec, sizeof rec, 1, file) == 1)
+	{
+		if (isConvFiltered && rec.conv != conv)
+			continue;
+		printf("%10u %10u %-9s %10u %10u %10u %6u %5u %5u\n",
+			rec.ts, rec.conv, EventName(rec.event), rec.sn, rec.una, rec.arg, rec.rto, rec.cwnd,
+			static_cast<unsigned>(rec.wnd));
+	}
+	fclose(file);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 2 && strcmp(argv[1], "record") == 0)
+	{
+		double lossRate = argc > 3 ? atof(argv[3]) / 100 : 0.02;
+		int seconds = argc > 4 ? atoi(argv[4]) : 5;
+		return Record(argv[2], lossRate, seconds > 0 ? seconds : 5);
+	}
+	if (argc > 1 && strcmp(argv[1], "record") != 0)
+		return Decode(argv[1], argc > 2, argc > 2 ? static_cast<IUINT32>(strtoul(argv[2], nullptr, 10)) : 0);
+	fprintf(stderr, "usage : %s <file> [conv]\n"
+		"        %s record <file> [loss %%] [seconds]\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../kcpp_sim.h"
+
+// reliable streams over kcpp_sim, returns non-zero on failure :
+//	TestKcppStreams
+// - oversized segments while merging : path mtu discovery raises the mtu, then the path shrinks
+//	 under two streams' traffic. the segments cut for the larger mtu are retransmitted one per
+//	 output while the streams merge theirs, each has to go out alone and arrive whole
+// - expired msgs on reset : the client's msgs stuck on a cut link are handed back when the
+//	 restarted server resets it. those past their ttl, wholly or partly skipped, are given up,
+//	 the others come back whole with the ttl they have left
+// - partly acked msgs on reset : the same, the msgs whose first fragments were acked, a batch
+//	 of coalesced msgs or a single one, are given up instead of coming back cut off
+
+static int Fail(const char* name, const char* what)
+{
+	fprintf(stderr, "%s : %s\n", name, what);
+	return 1;
+}
+
+static int TestOversizedSegmentWhileMerging()
+{
+	const char* name = "oversized segment while merging";
+	const int kStreamCnt = 2;
+	kcpp::sim::LinkConfig config;
+	config.mtu_ = 1500;
+	kcpp::sim::Path link(config, config);
+	kcpp::sim::Session cli(kcpp::kCli, link.CliOutput(), link.CliInput(), link.Now());
+	kcpp::sim::Session srv(kcpp::kSrv, link.SrvOutput(), link.SrvInput(), link.Now());
+	for (kcpp::sim::Session* session : { &cli, &srv })
+	{
+		session->SetPathMtuDiscovery(true);
+		for (int i = 1; i < kStreamCnt; ++i)
+			session->AddStream();
+	}
+
+	std::vector<int> sentCnts(kStreamCnt), rcvedCnts(kStreamCnt);
+	uint32_t seed = 7;
+	bool isShrunk = false;
+	kcpp::Buf buf;
+	int len = 0;
+	int stream = 0;
+	const int64_t shrinkTs = link.clock_.Now() + 10 * 1000;
+	const int64_t stopSendingTs = shrinkTs + 10 * 1000;
+	const int64_t endTs = stopSendingTs + 10 * 1000;
+	for (; link.clock_.Now() < endTs; link.clock_.Advance(1))
+	{
+		if (!isShrunk && link.clock_.Now() >= shrinkTs)
+		{
+			if (cli.GetPathMtu() <= 900)
+				return Fail(name, "the path mtu wasn't raised");
+			config.mtu_ = 900;
+			link.c2s_.SetConfig(config);
+			link.s2c_.SetConfig(config);
+			isShrunk = true;
+		}
+		int sndStream = (sentCnts[0] + sentCnts[1]) % kStreamCnt;
+		if (link.clock_.Now() < stopSendingTs && link.clock_.Now() % 4 == 0 && cli.IsConnected() && cli.CheckCanSend())
+		{
+			// a msg is its stream's seq, repeated
+			seed = seed * 1103515245 + 12345;
+			std::string msg(50 + (seed >> 16) % 2500, static_cast<char>('a' + sentCnts[sndStream] % 26));
+			if (cli.SendOnStream(sndStream, msg.data(), static_cast<int>(msg.size())) >= 0)
+				++sentCnts[sndStream];
+		}
+		cli.Update();
+		srv.Update();
+		do
+		{
+			while (srv.Recv(&buf, len, stream))
+			{
+				if (len < 0)
+					return Fail(name, "the server's Recv() failed");
+				if (len > 0)
+				{
+					if (buf.peek()[0] != 'a' + rcvedCnts[stream] % 26 || buf.peek()[len - 1] != buf.peek()[0])
+						return Fail(name, "a msg arrived out of order or corrupted");
+					++rcvedCnts[stream];
+				}
+				buf.retrieveAll();
+			}
+		} while (len != -10);
+		do
+		{
+			while (cli.Recv(&buf, len))
+			{
+				if (len < 0)
+					return Fail(name, "the client's Recv() failed");
+				buf.retrieveAll();
+			}
+		} while (len != -10);
+	}
+
+	if (!cli.IsConnected() || !srv.IsConnected())
+		return Fail(name, "the sessions got disconnected");
+	if (rcvedCnts != sentCnts)
+		return Fail(name, "not every msg arrived");
+	if (cli.GetPathMtu() > 900 || srv.GetPathMtu() > 900)
+		return Fail(name, "the path mtu didn't come down");
+	printf("%s : ok, %d msgs, path mtu %d/%d\n", name, sentCnts[0] + sentCnts[1], cli.GetPathMtu(), srv.GetPathMtu());
+	return 0;
+}
+
+// a client and a server on a link, the server can restart. the msgs handed back to the
+// client on reset are kept with their ttl
+struct ResetRun
+{
+	explicit ResetRun(const kcpp::sim::LinkConfig& config)
+		: config_(config),
+		link_(config, config),
+		cli_(kcpp::kCli, link_.CliOutput(), link_.CliInput(), link_.Now()),
+		srv_(new kcpp::sim::Session(kcpp::kSrv, link_.SrvOutput(), link_.SrvInput(), link_.Now())),
+		len_(0)
+	{
+		cli_.setConnectionCallback([this](std::deque<std::string>* pendingMsgs)
+		{
+			if (!pendingMsgs)
+				return;
+			handedBack_ = *pendingMsgs;
+			for (size_t i = 0; i < handedBack_.size(); ++i)
+				ttls_.push_back(cli_.GetPendingTtlMs(i));
+		});
+	}
+
+	void Run(int ms)
+	{
+		for (int i = 0; i < ms; ++i, link_.clock_.Advance(1))
+		{
+			cli_.Update();
+			srv_->Update();
+			while (srv_->Recv(&buf_, len_))
+				buf_.retrieveAll();
+			while (cli_.Recv(&buf_, len_))
+				buf_.retrieveAll();
+		}
+	}
+
+	// the client's link to the server is cut, its msgs stay in its kcp
+	void Cut()
+	{
+		kcpp::sim::LinkConfig cut = config_;
+		cut.lossRate_ = 1;
+		link_.c2s_.SetConfig(cut);
+	}
+
+	// a restarted server answers the client's msgs with resets, the first ones are taken
+	// for stale datagrams of the old server. with a stuck window only retransmissions go out.
+	// true once the client is reset, `filler` is what it sent meanwhile
+	bool RestartServer(const std::string& filler)
+	{
+		link_.c2s_.SetConfig(config_);
+		srv_.reset(new kcpp::sim::Session(kcpp::kSrv, link_.SrvOutput(), link_.SrvInput(), link_.Now()));
+		for (int i = 0; i < 20000 && cli_.IsConnected(); ++i)
+		{
+			cli_.Send(filler.data(), static_cast<int>(filler.size()));
+			Run(1);
+		}
+		return !cli_.IsConnected();
+	}
+
+	// the msgs handed back are `msgs` then only `filler`
+	bool IsHandedBack(const std::vector<std::string>& msgs, const std::string& filler) const
+	{
+		if (handedBack_.size() < msgs.size())
+			return false;
+		for (size_t i = 0; i < handedBack_.size(); ++i)
+			if (handedBack_[i] != (i < msgs.size() ? msgs[i] : filler))
+				return false;
+		return true;
+	}
+
+	kcpp::sim::LinkConfig config_;
+	kcpp::sim::Path link_;
+	kcpp::sim::Session cli_;
+	std::unique_ptr<kcpp::sim::Session> srv_;
+	std::deque<std::string> handedBack_;
+	std::vector<int> ttls_;
+	kcpp::Buf buf_;
+	int len_;
+};
+
+static int TestExpiredMsgsOnReset(int sndWnd)
+{
+	const char* name = "expired msgs on reset";
+	kcpp::sim::LinkConfig config;
+	config.delayMs_ = 1; // a short handshake, fewer datagrams of the old server for the resets to outnumber
+	ResetRun run(config);
+	run.cli_.SetConfig(576, sndWnd, 128, 512);
+	run.Run(200);
+	if (!run.cli_.IsConnected())
+		return Fail(name, "the client didn't connect");
+
+	run.Cut();
+	std::string expiring(1500, 'e'), kept(300, 'k'), living(200, 'l');
+	run.cli_.Send(expiring.data(), static_cast<int>(expiring.size()), kcpp::kReliable, 100);
+	run.cli_.Send(kept.data(), static_cast<int>(kept.size()));
+	run.cli_.Send(living.data(), static_cast<int>(living.size()), kcpp::kReliable, 60 * 1000);
+	run.Run(400);
+
+	std::string filler(20, 'f');
+	if (!run.RestartServer(filler))
+		return Fail(name, "the client wasn't reset");
+	if (!run.IsHandedBack({ kept, living }, filler))
+		return Fail(name, "the msgs handed back aren't the unexpired ones, whole");
+	if (run.ttls_[0] != 0 || run.ttls_[1] <= 0 || run.ttls_[1] > 60 * 1000 - 400)
+		return Fail(name, "the msgs handed back didn't keep their ttl");
+	printf("%s : ok, snd_wnd %d, %d msgs handed back, ttl %d left\n", name, sndWnd,
+		static_cast<int>(run.handedBack_.size()), run.ttls_[1]);
+	return 0;
+}
+
+static int TestPartlyAckedMsgsOnReset(bool isCoalescing)
+{
+	const char* name = "partly acked msgs on reset";
+	kcpp::sim::LinkConfig config;
+	config.delayMs_ = 1;
+	ResetRun run(config);
+	run.cli_.SetCoalescing(isCoalescing, 2, 4000);
+	run.srv_->SetCoalescing(isCoalescing, 2, 4000);
+	run.Run(200);
+	if (!run.cli_.IsConnected())
+		return Fail(name, "the client didn't connect");
+
+	// a bottleneck queue holding a datagram lets the first fragment of a burst through only
+	kcpp::sim::LinkConfig narrow = config;
+	narrow.bandwidth_ = 100 * 1000;
+	narrow.queueBytes_ = 700;
+	run.link_.c2s_.SetConfig(narrow);
+	if (isCoalescing)
+	{
+		for (int i = 0; i < 30; ++i)
+		{
+			std::string msg(50, static_cast<char>('a' + i));
+			run.cli_.Send(msg.data(), static_cast<int>(msg.size()));
+		}
+	}
+	else
+	{
+		std::string msg(1500, 'a');
+		run.cli_.Send(msg.data(), static_cast<int>(msg.size()));
+	}
+	run.Run(5);
+	if (run.link_.c2s_.Stats().queueDrops_ == 0)
+		return Fail(name, "no fragment was held back");
+
+	// the first fragment is acked, the others are stuck
+	run.Cut();
+	std::string kept(300, 'k');
+	run.cli_.Send(kept.data(), static_cast<int>(kept.size()));
+	run.Run(100);
+
+	std::string filler(20, 'f');
+	if (!run.RestartServer(filler))
+		return Fail(name, "the client wasn't reset");
+	if (!run.IsHandedBack({ kept }, filler))
+		return Fail(name, "the msgs handed back aren't the unacked ones, whole");
+	printf("%s : ok, coalescing %d, %d msgs handed back\n", name, isCoalescing ? 1 : 0,
+		static_cast<int>(run.handedBack_.size()));
+	return 0;
+}
+
+int main()
+{
+	int failedCnt = 0;
+	failedCnt += TestOversizedSegmentWhileMerging();
+	failedCnt += TestExpiredMsgsOnReset(128);
+	failedCnt += TestExpiredMsgsOnReset(2); // the expiring msg is partly in snd_buf, partly in snd_queue
+	failedCnt += TestPartlyAckedMsgsOnReset(false);
+	failedCnt += TestPartlyAckedMsgsOnReset(true);
+	return failedCnt == 0 ? 0 : 1;
+}